@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Run the KUnit tests in ./src/sysinfo_kunit.c with kunit.py.
+#
+# Usage: ./scripts/runKunit.sh <path to a kernel tree>
+#
+# Links ./src into the kernel tree as drivers/misc/sysinfo, adds it
+# to drivers/misc/Kconfig and drivers/misc/Makefile once, then runs
+# every suite on x86_64 under QEMU with ./src/.kunitconfig.
+
+set -e
+
+if [ $# -ne 1 ] || [ ! -x "$1/tools/testing/kunit/kunit.py" ]; then
+    echo "usage: $0 <kernel tree with tools/testing/kunit/kunit.py>" >&2
+    exit 2
+fi
+
+KDIR=$(cd "$1" && pwd)
+SRC=$(cd "$(dirname "$0")/../src" && pwd)
+
+ln -sfn "$SRC" "$KDIR/drivers/misc/sysinfo"
+grep -q 'drivers/misc/sysinfo/Kconfig' "$KDIR/drivers/misc/Kconfig" ||
+    sed -i '$i source "drivers/misc/sysinfo/Kconfig"' "$KDIR/drivers/misc/Kconfig"
+grep -q 'CONFIG_SYSINFO) += sysinfo/' "$KDIR/drivers/misc/Makefile" ||
+    echo 'obj-$(CONFIG_SYSINFO) += sysinfo/' >> "$KDIR/drivers/misc/Makefile"
+
+cd "$KDIR"
+./tools/testing/kunit/kunit.py run --arch=x86_64 --kunitconfig=drivers/misc/sysinfo
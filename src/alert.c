@@ -0,0 +1,393 @@
+/**
+ * alert.c
+ *
+ * Threshold alerts. Readers register thresholds on their open
+ * file, the thresholds are evaluated on every sample, and an
+ * event is queued for the reader whenever one is crossed.
+ *
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>
+#include <linux/cpufreq.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/overflow.h>
+#include <linux/uio.h>
+#include "alert.h"
+#include "stats.h"
+
+// highest SYSINFO_METRIC_* value
+#define ALERT_METRIC_MAX SYSINFO_METRIC_CPU_IDLE_PCT
+
+/**
+ * Values of every metric at one point in time.
+ */
+struct alert_sample {
+    u64 timestamp_ns;
+    s64 values[ALERT_METRIC_MAX + 1];
+    bool valid[ALERT_METRIC_MAX + 1];
+};
+
+static LIST_HEAD(alert_watches);                // watches of all open files
+static DEFINE_MUTEX(alert_mutex);               // protects alert_watches, thresholds and event queues
+
+static u64 prev_idle_us;                        // summed CPU idle time at the previous sample
+static u64 prev_wall_us;                        // summed CPU wall time at the previous sample
+
+/**
+ * @brief allocate a watch and add it to the list of watches.
+ *
+ * @return pointer to the watch, NULL on allocation failure.
+ */
+struct alert_watch*
+alert_watch_create(void)
+{
+    struct alert_watch* watch = kzalloc(sizeof(struct alert_watch), GFP_KERNEL);
+    if (watch == NULL)
+        return NULL;
+
+    INIT_KFIFO(watch->events);
+    init_waitqueue_head(&watch->wait);
+
+    mutex_lock(&alert_mutex);
+    list_add_tail(&watch->node, &alert_watches);
+    mutex_unlock(&alert_mutex);
+
+    return watch;
+}
+
+/**
+ * @brief remove a watch from the list of watches and free it.
+ *
+ * @param watch - the watch to destroy, may be NULL.
+ */
+void
+alert_watch_destroy(struct alert_watch* watch)
+{
+    if (watch == NULL)
+        return;
+
+    mutex_lock(&alert_mutex);
+    list_del(&watch->node);
+    mutex_unlock(&alert_mutex);
+
+    kfree(watch);
+}
+
+/**
+ * @brief register a threshold on a watch.
+ *
+ * @param watch - the watch to add the threshold to.
+ * @param t - the threshold to add. t->id is set on success.
+ *
+ * @return 0 on success, -EINVAL for an invalid threshold, e.g.
+ *         one whose re-arm level value +/- hysteresis does not
+ *         fit in an s64, -ENOSPC if the watch has
+ *         ALERT_MAX_THRESHOLDS thresholds.
+ */
+int
+alert_add_threshold(struct alert_watch* watch,
+                    struct sysinfo_threshold* t)
+{
+    s64 rearm;
+
+    if (t->metric < 1 || t->metric > ALERT_METRIC_MAX)
+        return -EINVAL;
+    if (t->direction != SYSINFO_THRESHOLD_BELOW && t->direction != SYSINFO_THRESHOLD_ABOVE)
+        return -EINVAL;
+    if (t->hysteresis < 0)
+        return -EINVAL;
+    // alert_check_threshold() computes the re-arm level on every sample
+    if (t->direction == SYSINFO_THRESHOLD_BELOW && check_add_overflow(t->value, t->hysteresis, &rearm))
+        return -EINVAL;
+    if (t->direction == SYSINFO_THRESHOLD_ABOVE && check_sub_overflow(t->value, t->hysteresis, &rearm))
+        return -EINVAL;
+
+    mutex_lock(&alert_mutex);
+    if (watch->threshold_count >= ALERT_MAX_THRESHOLDS)
+    {
+        mutex_unlock(&alert_mutex);
+        return -ENOSPC;
+    }
+
+    t->id = watch->threshold_count + 1;
+    watch->thresholds[watch->threshold_count].threshold = *t;
+    watch->thresholds[watch->threshold_count].fired = false;
+    watch->threshold_count++;
+    mutex_unlock(&alert_mutex);
+
+    return 0;
+}
+
+/**
+ * @brief remove all thresholds and pending events from a watch,
+ *        and wake the readers and pollers waiting for events, so
+ *        they go back to reading samples.
+ *
+ * @param watch - the watch to clear.
+ */
+void
+alert_clear_thresholds(struct alert_watch* watch)
+{
+    mutex_lock(&alert_mutex);
+    watch->threshold_count = 0;
+    kfifo_reset(&watch->events);
+    mutex_unlock(&alert_mutex);
+
+    wake_up_interruptible(&watch->wait);
+}
+
+/**
+ * @brief check whether a watch has any thresholds registered.
+ *
+ * @param watch - the watch to check, may be NULL.
+ *
+ * @return true if reads on the file should return events.
+ */
+bool
+alert_watch_active(struct alert_watch* watch)
+{
+    return watch != NULL && READ_ONCE(watch->threshold_count) > 0;
+}
+
+/**
+ * @brief check whether a watch has events waiting to be read.
+ *
+ * @param watch - the watch to check.
+ *
+ * @return true if at least one event is queued.
+ */
+bool
+alert_events_pending(struct alert_watch* watch)
+{
+    return !kfifo_is_empty(&watch->events);
+}
+
+/**
+ * @brief copy queued events into an iov_iter.
+ *
+ * Only whole struct sysinfo_alert_event records are copied. An
+ * event is removed from the queue once it has been copied in full.
+ *
+ * @param watch - the watch to read events from.
+ * @param to - the iterator to copy the events to.
+ * @param nonblock - return -EAGAIN instead of waiting for an event.
+ *
+ * @return number of bytes copied, -ENODATA if the thresholds were
+ *         cleared before an event was queued, or negative error
+ *         code.
+ */
+ssize_t
+alert_read_iter(struct alert_watch* watch,
+                struct iov_iter *to,
+                bool nonblock)
+{
+    struct sysinfo_alert_event event;
+    ssize_t copied = 0;
+
+    if (iov_iter_count(to) < sizeof(struct sysinfo_alert_event))
+        return -EINVAL;
+
+    mutex_lock(&alert_mutex);
+    while (kfifo_is_empty(&watch->events))
+    {
+        mutex_unlock(&alert_mutex);
+
+        if (!alert_watch_active(watch))
+            return -ENODATA;
+        if (nonblock)
+            return -EAGAIN;
+
+        // sleep until the sampler queues an event, or the thresholds are cleared
+        if (wait_event_interruptible(watch->wait, alert_events_pending(watch) || !alert_watch_active(watch)))
+            return -ERESTARTSYS;
+
+        mutex_lock(&alert_mutex);
+    }
+
+    while (iov_iter_count(to) >= sizeof(struct sysinfo_alert_event) &&
+           kfifo_peek(&watch->events, &event))
+    {
+        if (copy_to_iter(&event, sizeof(event), to) != sizeof(event))
+        {
+            if (copied == 0)
+                copied = -EFAULT;
+            break;
+        }
+
+        kfifo_skip(&watch->events);
+        copied += sizeof(event);
+    }
+    mutex_unlock(&alert_mutex);
+
+    return copied;
+}
+
+/**
+ * @brief get the idle percentage of all online CPUs since the previous call.
+ *
+ * @param pct - set to the idle percentage.
+ *
+ * @return true if pct was set, false on the first call or if the
+ *         CPU times went backwards (e.g. after CPU hotplug).
+ */
+static
+bool
+alert_sample_cpu_idle(s64* pct)
+{
+    u64 idle_us = 0;
+    u64 wall_us = 0;
+    u64 cpu_wall_us;
+    bool valid;
+    int cpu;
+
+    for_each_online_cpu(cpu)
+    {
+        idle_us += get_cpu_idle_time(cpu, &cpu_wall_us, 0);
+        wall_us += cpu_wall_us;
+    }
+
+    valid = prev_wall_us != 0 && wall_us > prev_wall_us && idle_us >= prev_idle_us;
+    if (valid)
+        *pct = min_t(u64, 100, div64_u64((idle_us - prev_idle_us) * 100, wall_us - prev_wall_us));
+
+    prev_idle_us = idle_us;
+    prev_wall_us = wall_us;
+
+    return valid;
+}
+
+/**
+ * @brief sample every metric a threshold can watch.
+ *
+ * @param s - the sample to fill in.
+ */
+static
+void
+alert_sample_metrics(struct alert_sample* s)
+{
+    struct sysinfo si;
+
+    memset(s, 0, sizeof(struct alert_sample));
+    s->timestamp_ns = ktime_get_ns();
+
+    si_meminfo(&si);
+    s->values[SYSINFO_METRIC_FREE_RAM_KB] = (u64)si.freeram * si.mem_unit / 1024;
+    s->valid[SYSINFO_METRIC_FREE_RAM_KB] = true;
+
+    s->valid[SYSINFO_METRIC_CPU_IDLE_PCT] = alert_sample_cpu_idle(&s->values[SYSINFO_METRIC_CPU_IDLE_PCT]);
+}
+
+/**
+ * @brief queue an event on a watch, dropping the oldest event if full.
+ */
+static
+void
+alert_queue_event(struct alert_watch* watch,
+                  struct sysinfo_threshold* t,
+                  struct alert_sample* s,
+                  u32 state)
+{
+    struct sysinfo_alert_event event = {
+        .timestamp_ns = s->timestamp_ns,
+        .value = s->values[t->metric],
+        .id = t->id,
+        .metric = t->metric,
+        .state = state,
+    };
+
+    if (kfifo_is_full(&watch->events))
+    {
+        kfifo_skip(&watch->events);
+        stats_inc(STATS_RING_OVERRUNS);
+    }
+    kfifo_put(&watch->events, event);
+}
+
+/**
+ * @brief evaluate one threshold against a sample.
+ *
+ * The threshold fires once when the metric crosses value, and is
+ * re-armed once the metric is back past value by hysteresis.
+ *
+ * @return true if an event was queued.
+ */
+static
+bool
+alert_check_threshold(struct alert_watch* watch,
+                      struct alert_threshold* at,
+                      struct alert_sample* s)
+{
+    struct sysinfo_threshold* t = &at->threshold;
+    bool crossed;
+    bool rearmed;
+    s64 v;
+
+    if (!s->valid[t->metric])
+        return false;
+
+    // the re-arm levels cannot overflow, alert_add_threshold() checked them
+    v = s->values[t->metric];
+    if (t->direction == SYSINFO_THRESHOLD_BELOW)
+    {
+        crossed = v < t->value;
+        rearmed = v >= t->value + t->hysteresis;
+    }
+    else
+    {
+        crossed = v > t->value;
+        rearmed = v <= t->value - t->hysteresis;
+    }
+
+    if (!at->fired && crossed)
+    {
+        at->fired = true;
+        alert_queue_event(watch, t, s, SYSINFO_ALERT_FIRED);
+        return true;
+    }
+    if (at->fired && rearmed)
+    {
+        at->fired = false;
+        alert_queue_event(watch, t, s, SYSINFO_ALERT_CLEARED);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief evaluate the thresholds of every watch.
+ *
+ * Called from the sampler on every sample. Wakes up readers
+ * of watches that have new events.
+ */
+void
+alert_evaluate(void)
+{
+    struct alert_sample s;
+    struct alert_watch* watch;
+
+    // sample even without watches, so the CPU idle baseline stays current
+    alert_sample_metrics(&s);
+
+    mutex_lock(&alert_mutex);
+    list_for_each_entry(watch, &alert_watches, node)
+    {
+        bool queued = false;
+
+        for (int i = 0; i < watch->threshold_count; i++)
+        {
+            if (alert_check_threshold(watch, &watch->thresholds[i], &s))
+                queued = true;
+        }
+
+        if (queued)
+            wake_up_interruptible(&watch->wait);
+    }
+    mutex_unlock(&alert_mutex);
+}
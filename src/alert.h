@@ -0,0 +1,50 @@
+#ifndef ALERT_H
+#define ALERT_H
+
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include "sysinfo_ioctl.h"
+
+// maximum number of thresholds per file
+#define ALERT_MAX_THRESHOLDS 16
+
+// number of events queued per file before the oldest are dropped
+#define ALERT_EVENT_QUEUE_SIZE 64
+
+/**
+ * A registered threshold and whether it has fired.
+ */
+struct alert_threshold {
+    struct sysinfo_threshold threshold;
+    bool fired;
+};
+
+/**
+ * Thresholds and pending events for one open file.
+ */
+struct alert_watch {
+    // entry in the list of watches evaluated on each sample
+    struct list_head node;
+
+    struct alert_threshold thresholds[ALERT_MAX_THRESHOLDS];
+    int threshold_count;
+
+    // events waiting to be read
+    DECLARE_KFIFO(events, struct sysinfo_alert_event, ALERT_EVENT_QUEUE_SIZE);
+
+    // readers waiting for events
+    wait_queue_head_t wait;
+};
+
+struct alert_watch* alert_watch_create(void);
+void alert_watch_destroy(struct alert_watch* watch);
+int alert_add_threshold(struct alert_watch* watch, struct sysinfo_threshold* t);
+void alert_clear_thresholds(struct alert_watch* watch);
+bool alert_watch_active(struct alert_watch* watch);
+bool alert_events_pending(struct alert_watch* watch);
+ssize_t alert_read_iter(struct alert_watch* watch, struct iov_iter *to, bool nonblock);
+void alert_evaluate(void);
+
+#endif
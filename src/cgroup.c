@@ -0,0 +1,1090 @@
+/**
+ * cgroup.c
+ *
+ * Defines the cgroup and cgroup_top jobs, which report the
+ * resource use of one cgroup v2 cgroup, and rank the children
+ * of a cgroup by CPU or memory use.
+ *
+ * Each reader selects its cgroup with SYSINFO_IOC_SET_CGROUP, by a
+ * path below the root of its cgroup namespace or a file descriptor
+ * of a cgroup directory, and the categories are collected for that
+ * reader when it reads them. Samples, /proc/sysinfo and netlink
+ * report the root cgroup. The values are read from the cgroup's
+ * interface files, in the kernel, so a reader gets them all with
+ * one read of the device.
+ *
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/cred.h>
+#include <linux/namei.h>
+#include <linux/path.h>
+#include <linux/magic.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/stringhash.h>
+#include <linux/version.h>
+#include "sysinfo_ioctl.h"
+#include "cgroup.h"
+
+// largest interface file read, io.stat has a line per device
+#define CGROUP_READ_MAX (4 * PAGE_SIZE)
+// most children of a cgroup looked at by cgroup_top
+#define CGROUP_TOP_MAX_SCAN 512
+// number of cgroups reported by cgroup_top
+#define CGROUP_TOP_COUNT 10
+
+static char* cgroup_mount = "/sys/fs/cgroup";
+module_param(cgroup_mount, charp, 0444);
+MODULE_PARM_DESC(cgroup_mount, "Mount point of the cgroup2 hierarchy (default /sys/fs/cgroup)");
+
+static struct path cgroup_root_dir;              // cgroup2 mount, looked up when the module loads
+
+/**
+ * CPU time of a child of the cgroup, from the previous run of
+ * cgroup_top, to rank children by their recent CPU use.
+ */
+struct cgroup_top_usage {
+    u32 hash;                                   // hash of the parent and the child's name
+    u64 usage_us;                               // CPU time used by the child
+};
+
+static DEFINE_MUTEX(cgroup_top_mutex);          // protects cgroup_top_prev
+static struct cgroup_top_usage* cgroup_top_prev;    // usage of each child of the root, from the previous sample
+static int cgroup_top_prev_count;
+
+/**
+ * A line of a flat keyed interface file, e.g. "usage_usec 1234",
+ * and the key and unit it is emitted with.
+ */
+struct cgroup_field {
+    const char* name;                           // name in the interface file
+    const char* key;                            // key in the output
+    const char* unit;                           // unit of the value, NULL if it has none
+    bool counter;                               // the value only grows, see JOB_FLAG_COUNTER
+};
+
+static const struct cgroup_field cgroup_cpu_fields[] = {
+    { "usage_usec", "usage", "us", true },
+    { "user_usec", "user", "us", true },
+    { "system_usec", "system", "us", true },
+    { "nr_periods", "periods", NULL, true },
+    { "nr_throttled", "throttled_periods", NULL, true },
+    { "throttled_usec", "throttled", "us", true },
+    { "nr_bursts", "bursts", NULL, true },
+    { "burst_usec", "burst", "us", true },
+};
+
+static const struct cgroup_field cgroup_memory_event_fields[] = {
+    { "low", "low", NULL, true },
+    { "high", "high", NULL, true },
+    { "max", "max", NULL, true },
+    { "oom", "oom", NULL, true },
+    { "oom_kill", "oom_kill", NULL, true },
+};
+
+static const struct cgroup_field cgroup_memory_files[] = {
+    { "memory.current", "current", "B" },
+    { "memory.peak", "peak", "B" },
+    { "memory.min", "min", "B" },
+    { "memory.low", "low", "B" },
+    { "memory.high", "high", "B" },
+    { "memory.max", "max", "B" },
+    { "memory.swap.current", "swap_current", "B" },
+    { "memory.swap.max", "swap_max", "B" },
+};
+
+static const struct cgroup_field cgroup_io_fields[] = {
+    { "rbytes", "read_bytes", "B", true },
+    { "wbytes", "write_bytes", "B", true },
+    { "rios", "read_ios", NULL, true },
+    { "wios", "write_ios", NULL, true },
+    { "dbytes", "discard_bytes", "B", true },
+    { "dios", "discard_ios", NULL, true },
+};
+
+/**
+ * @brief check that a path is on a cgroup2 file system.
+ */
+static
+bool
+cgroup_is_cgroup2(const struct path* path)
+{
+    return path->dentry->d_sb->s_magic == CGROUP2_SUPER_MAGIC;
+}
+
+/**
+ * @brief get the directory of the cgroup a job is collected for,
+ *        the reader's selected cgroup or the root cgroup.
+ *
+ * @param ctx - what the job is collected for, NULL if nothing.
+ * @param dir - set to the directory, with a reference held for
+ *              the caller to drop with path_put().
+ * @return 0 on success, negative error code otherwise.
+ */
+static
+int
+cgroup_get_dir(const JobContext* ctx,
+               struct path* dir)
+{
+    const struct sysinfo_cgroup_view* view = ctx != NULL ? ctx->reader : NULL;
+    int err;
+
+    if (view != NULL)
+    {
+        *dir = view->dir;
+        path_get(dir);
+        return 0;
+    }
+
+    if (cgroup_root_dir.mnt != NULL)
+    {
+        *dir = cgroup_root_dir;
+        path_get(dir);
+        return 0;
+    }
+
+    // not mounted when the module loaded, look again
+    err = kern_path(cgroup_mount, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, dir);
+    if (err)
+        return err;
+
+    if (!cgroup_is_cgroup2(dir))
+    {
+        path_put(dir);
+        return -ENOTDIR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the root of the cgroup2 hierarchy, as found when the
+ *        module loaded.
+ *
+ * The mount is looked up in the mount namespace of the task that
+ * loaded the module, as readers in containers can have a cgroup2
+ * mount of their own cgroup at the same path.
+ *
+ * @param root - set to the root directory, with a reference held
+ *               for the caller to drop with path_put().
+ * @return 0 on success, -ENOENT if cgroup2 was not mounted.
+ */
+int
+sysinfo_cgroup_root(struct path* root)
+{
+    if (cgroup_root_dir.mnt == NULL)
+        return -ENOENT;
+
+    *root = cgroup_root_dir;
+    path_get(root);
+    return 0;
+}
+
+/**
+ * @brief Select the cgroup a reader's cgroup and cgroup_top
+ *        categories report.
+ *
+ * The cgroup must be root or below it, so a reader in a container
+ * cannot select the cgroups of other containers. A path is looked
+ * up relative to root, and cannot leave it.
+ *
+ * @param view - the reader's selection, allocated on the first
+ *               call and freed with sysinfo_cgroup_view_destroy().
+ * @param root - the cgroup the reader can select below, e.g. the
+ *               root of its cgroup namespace.
+ * @param fd - file descriptor of a cgroup directory, or negative
+ *             to select by path.
+ * @param path - path of the cgroup relative to root, "" for root
+ *               itself. Ignored if fd is not negative.
+ * @param sort - SYSINFO_CGROUP_SORT_* order of cgroup_top.
+ *
+ * @return 0 on success, -EINVAL if sort is not valid, -EBADF if
+ *         fd is not open, -ENOTDIR if the file or path is not a
+ *         cgroup2 directory, -EPERM if it is not below root, or the
+ *         error looking up path.
+ */
+int
+sysinfo_cgroup_select(struct sysinfo_cgroup_view** view,
+                      const struct path* root,
+                      int fd,
+                      const char* path,
+                      u32 sort)
+{
+    struct path dir;
+    int err;
+
+    if (sort != SYSINFO_CGROUP_SORT_CPU && sort != SYSINFO_CGROUP_SORT_MEMORY)
+        return -EINVAL;
+
+    if (fd >= 0)
+    {
+        struct file* file = fget(fd);
+        if (file == NULL)
+            return -EBADF;
+
+        dir = file->f_path;
+        path_get(&dir);
+        fput(file);
+    }
+    else if (path[0] == '\0')
+    {
+        dir = *root;
+        path_get(&dir);
+    }
+    else
+    {
+        // ".." and absolute paths stop at root, like in a chroot
+        err = vfs_path_lookup(root->dentry, root->mnt, path, LOOKUP_DIRECTORY, &dir);
+        if (err)
+            return err;
+    }
+
+    if (!d_is_dir(dir.dentry) || !cgroup_is_cgroup2(&dir))
+    {
+        path_put(&dir);
+        return -ENOTDIR;
+    }
+
+    // by dentry, as a container can have a cgroup2 mount of its own
+    if (dir.dentry->d_sb != root->dentry->d_sb || !is_subdir(dir.dentry, root->dentry))
+    {
+        path_put(&dir);
+        return -EPERM;
+    }
+
+    if (*view == NULL)
+    {
+        *view = kzalloc(sizeof(struct sysinfo_cgroup_view), GFP_KERNEL);
+        if (*view == NULL)
+        {
+            path_put(&dir);
+            return -ENOMEM;
+        }
+    }
+    else
+    {
+        path_put(&(*view)->dir);
+    }
+
+    // the usage of the previous cgroup's children does not apply
+    kfree((*view)->top_prev);
+    (*view)->top_prev = NULL;
+    (*view)->top_prev_count = 0;
+    (*view)->dir = dir;
+    (*view)->sort = sort;
+
+    return 0;
+}
+
+/**
+ * @brief Free a reader's cgroup selection.
+ *
+ * @param view - the selection, may be NULL.
+ */
+void
+sysinfo_cgroup_view_destroy(struct sysinfo_cgroup_view* view)
+{
+    if (view == NULL)
+        return;
+
+    path_put(&view->dir);
+    kfree(view->top_prev);
+    kfree(view);
+}
+
+/**
+ * @brief Find the cgroup job a sample was collected from.
+ *
+ * @param sample - the values of a sample.
+ *
+ * @return cgroup_job or cgroup_top_job, NULL if the sample is of
+ *         another category.
+ */
+static
+const Job*
+cgroup_job_of(const JobResult* sample)
+{
+    if (strcmp(sample->job_title, cgroup_job.job_title) == 0)
+        return &cgroup_job;
+    if (strcmp(sample->job_title, cgroup_top_job.job_title) == 0)
+        return &cgroup_top_job;
+
+    return NULL;
+}
+
+/**
+ * @brief Check whether a sample is of a cgroup category, which
+ *        reports on a cgroup rather than on the whole machine.
+ *
+ * @param sample - the values of a sample.
+ *
+ * @return true for the cgroup and cgroup_top categories.
+ */
+bool
+sysinfo_cgroup_is_sample(const JobResult* sample)
+{
+    return cgroup_job_of(sample) != NULL;
+}
+
+/**
+ * @brief Collect a cgroup category for a reader's selected cgroup,
+ *        in place of a sample of it.
+ *
+ * @param view - the reader's selection, NULL if it selected none.
+ * @param sample - the values of the sample the reader would get.
+ *
+ * @return the values for the reader, freed by the caller with
+ *         free_job_result(), NULL if the sample is not of a cgroup
+ *         category or the reader selected no cgroup, or
+ *         ERR_PTR(-ENOMEM).
+ */
+JobResult*
+sysinfo_cgroup_collect(struct sysinfo_cgroup_view* view,
+                       const JobResult* sample)
+{
+    JobContext ctx = { .reader = view };
+    const Job* j;
+    JobResult* r;
+
+    if (view == NULL)
+        return NULL;
+
+    j = cgroup_job_of(sample);
+    if (j == NULL)
+        return NULL;
+
+    r = collect_job_ctx(j, &ctx);
+    if (r == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    // collected when the reader read it, in place of this sample
+    r->seq = sample->seq;
+    return r;
+}
+
+/**
+ * @brief read an interface file of a cgroup.
+ *
+ * @param dir - the cgroup's directory.
+ * @param name - name of the file, relative to dir.
+ *
+ * @return the contents of the file, NUL terminated and freed by
+ *         the caller. NULL if it could not be read, e.g. when
+ *         the file's controller is not enabled for the cgroup.
+ */
+static
+char*
+cgroup_read_file(const struct path* dir,
+                 const char* name)
+{
+    struct file* file;
+    loff_t pos = 0;
+    size_t len = 0;
+    ssize_t n = 0;
+    char* buf;
+
+    file = file_open_root(dir, name, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return NULL;
+
+    buf = kmalloc(CGROUP_READ_MAX, GFP_KERNEL);
+    if (buf == NULL)
+    {
+        fput(file);
+        return NULL;
+    }
+
+    while (len < CGROUP_READ_MAX - 1)
+    {
+        n = kernel_read(file, buf + len, CGROUP_READ_MAX - 1 - len, &pos);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    fput(file);
+
+    if (n < 0)
+    {
+        kfree(buf);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+    return buf;
+}
+
+/**
+ * @brief Read a single value interface file of a cgroup, e.g.
+ *        memory.current.
+ *
+ * @param dir - the cgroup's directory.
+ * @param name - name of the file, relative to dir.
+ *
+ * @return the value without its newline, freed by the caller,
+ *         NULL if it could not be read.
+ */
+char*
+sysinfo_cgroup_read_value(const struct path* dir,
+                          const char* name)
+{
+    char* text = cgroup_read_file(dir, name);
+    char* value;
+
+    if (text == NULL)
+        return NULL;
+
+    value = kstrdup(strim(text), GFP_KERNEL);
+    kfree(text);
+
+    return value;
+}
+
+/**
+ * @brief emit a value read from an interface file, as a number
+ *        unless it is not one, e.g. "max".
+ */
+static
+void
+cgroup_emit_value(JobEmitter* e,
+                  const char* key,
+                  const char* value,
+                  const char* unit,
+                  bool counter)
+{
+    bool number = value[0] >= '0' && value[0] <= '9';
+
+    if (number && counter)
+        job_emit_counter(e, key, kstrdup(value, GFP_KERNEL), unit);
+    else
+        job_emit_value(e, key, kstrdup(value, GFP_KERNEL),
+                       number ? JOB_VALUE_NUMBER : JOB_VALUE_STRING, number ? unit : NULL);
+}
+
+/**
+ * @brief find the output field of a name in an interface file.
+ *
+ * @return the field, NULL if the name is not reported.
+ */
+static
+const struct cgroup_field*
+cgroup_find_field(const struct cgroup_field* fields,
+                  int count,
+                  const char* name)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(fields[i].name, name) == 0)
+            return &fields[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief emit the lines of a flat keyed interface file that are
+ *        listed in fields, e.g. the lines of cpu.stat.
+ *
+ * @param e - the emitter.
+ * @param text - contents of the file, modified while parsing.
+ * @param fields - the lines to emit.
+ * @param count - number of entries in fields.
+ */
+static
+void
+cgroup_emit_flat(JobEmitter* e,
+                 char* text,
+                 const struct cgroup_field* fields,
+                 int count)
+{
+    char* line;
+
+    while ((line = strsep(&text, "\n")) != NULL)
+    {
+        char* name = strsep(&line, " ");
+        const struct cgroup_field* field;
+
+        if (line == NULL)
+            continue;
+
+        field = cgroup_find_field(fields, count, name);
+        if (field != NULL)
+            cgroup_emit_value(e, field->key, strim(line), field->unit, field->counter);
+    }
+}
+
+/**
+ * @brief run a function on the selected cgroup's directory.
+ *
+ * The directory is looked up once per step, so a step sees the
+ * same cgroup throughout.
+ */
+static
+void
+cgroup_with_dir(JobEmitter* e,
+                void (*fn)(JobEmitter* e, const struct path* dir))
+{
+    struct path dir;
+
+    if (cgroup_get_dir(e->ctx, &dir) != 0)
+        return;
+
+    fn(e, &dir);
+    path_put(&dir);
+}
+
+/**
+ * @brief get the path of the cgroup a job is collected for.
+ *
+ * @param ctx - what the job is collected for, NULL if nothing.
+ * @return the path, for the caller to kfree(), NULL on error.
+ */
+static
+char*
+cgroup_selected_path(const JobContext* ctx)
+{
+    struct path dir;
+    char* buf;
+    char* name;
+    char* path = NULL;
+
+    if (cgroup_get_dir(ctx, &dir) != 0)
+        return NULL;
+
+    buf = kmalloc(PATH_MAX, GFP_KERNEL);
+    if (buf != NULL)
+    {
+        name = d_path(&dir, buf, PATH_MAX);
+        if (!IS_ERR(name))
+            path = kstrdup(name, GFP_KERNEL);
+        kfree(buf);
+    }
+    path_put(&dir);
+
+    return path;
+}
+
+/**
+ * @brief emit the CPU time and throttling of the cgroup, from
+ *        cpu.stat, and its quota and period from cpu.max.
+ *
+ * @param e - the emitter of the step.
+ * @param dir - the directory of the cgroup.
+ */
+static
+void
+cgroup_cpu_dir(JobEmitter* e,
+               const struct path* dir)
+{
+    char* text;
+
+    text = cgroup_read_file(dir, "cpu.stat");
+    if (text != NULL)
+    {
+        cgroup_emit_flat(e, text, cgroup_cpu_fields, ARRAY_SIZE(cgroup_cpu_fields));
+        kfree(text);
+    }
+
+    // "max 100000", or "50000 100000" for half a CPU
+    text = sysinfo_cgroup_read_value(dir, "cpu.max");
+    if (text != NULL)
+    {
+        char* period = text;
+        char* quota = strsep(&period, " ");
+
+        cgroup_emit_value(e, "quota", quota, "us", false);
+        if (period != NULL)
+            cgroup_emit_value(e, "period", period, "us", false);
+        kfree(text);
+    }
+}
+
+/**
+ * @brief emit the cpu step of the selected cgroup.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+cgroup_cpu(JobEmitter* e)
+{
+    cgroup_with_dir(e, cgroup_cpu_dir);
+}
+
+/**
+ * @brief emit the memory use and limits of the cgroup, and the
+ *        counts of its memory events.
+ *
+ * @param e - the emitter of the step.
+ * @param dir - the directory of the cgroup.
+ */
+static
+void
+cgroup_memory_dir(JobEmitter* e,
+                  const struct path* dir)
+{
+    char* text;
+
+    for (int i = 0; i < ARRAY_SIZE(cgroup_memory_files); i++)
+    {
+        const struct cgroup_field* field = &cgroup_memory_files[i];
+
+        text = sysinfo_cgroup_read_value(dir, field->name);
+        if (text == NULL)
+            continue;
+
+        cgroup_emit_value(e, field->key, text, field->unit, field->counter);
+        kfree(text);
+    }
+
+    text = cgroup_read_file(dir, "memory.events");
+    if (text != NULL)
+    {
+        job_emit_begin(e, "events", JOB_VALUE_OBJECT);
+        cgroup_emit_flat(e, text, cgroup_memory_event_fields, ARRAY_SIZE(cgroup_memory_event_fields));
+        job_emit_end(e);
+        kfree(text);
+    }
+}
+
+/**
+ * @brief emit the memory step of the selected cgroup.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+cgroup_memory(JobEmitter* e)
+{
+    cgroup_with_dir(e, cgroup_memory_dir);
+}
+
+/**
+ * @brief emit an array with the I/O of the cgroup on each device,
+ *        from io.stat lines like "8:0 rbytes=1024 wbytes=0 ...".
+ *
+ * @param e - the emitter of the step.
+ * @param dir - the directory of the cgroup.
+ */
+static
+void
+cgroup_io_dir(JobEmitter* e,
+              const struct path* dir)
+{
+    char* text = cgroup_read_file(dir, "io.stat");
+    char* cur = text;
+    char* line;
+
+    if (text == NULL)
+        return;
+
+    while ((line = strsep(&cur, "\n")) != NULL)
+    {
+        char* device = strsep(&line, " ");
+        char* stat;
+
+        if (device[0] == '\0' || line == NULL)
+            continue;
+
+        job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+        job_emit_value(e, "device", kstrdup(device, GFP_KERNEL), JOB_VALUE_LABEL, NULL);
+        while ((stat = strsep(&line, " ")) != NULL)
+        {
+            char* value = stat;
+            char* name = strsep(&value, "=");
+            const struct cgroup_field* field;
+
+            if (value == NULL)
+                continue;
+
+            field = cgroup_find_field(cgroup_io_fields, ARRAY_SIZE(cgroup_io_fields), name);
+            if (field != NULL)
+                cgroup_emit_value(e, field->key, value, field->unit, field->counter);
+        }
+        job_emit_end(e);
+    }
+
+    kfree(text);
+}
+
+/**
+ * @brief emit the io step of the selected cgroup.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+cgroup_io(JobEmitter* e)
+{
+    cgroup_with_dir(e, cgroup_io_dir);
+}
+
+/**
+ * A child of the cgroup, ranked by cgroup_top.
+ */
+struct cgroup_top_entry {
+    char* name;                                 // name of the child's directory
+    u32 hash;                                   // hash of the parent and name
+    u64 usage_us;                               // CPU time used by the child
+    u64 recent_us;                              // CPU time used since the previous run
+    u64 memory;                                 // memory used by the child, in bytes
+};
+
+/**
+ * Directory iterator collecting the names of child cgroups.
+ */
+struct cgroup_top_ctx {
+    struct dir_context ctx;
+    struct cgroup_top_entry* entries;
+    int count;
+};
+
+/**
+ * @brief add a child cgroup to the entries, if it is a directory.
+ *
+ * @param ctx - the dir_context of a cgroup_top_ctx.
+ * @param name - the name of the directory entry.
+ * @param namlen - the length of name.
+ * @param offset - unused.
+ * @param ino - unused.
+ * @param d_type - the type of the directory entry.
+ * @return whether to go on iterating, as true or 0 depending on
+ *         the kernel version.
+ */
+static
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+bool
+#else
+int
+#endif
+cgroup_top_actor(struct dir_context* ctx,
+                 const char* name,
+                 int namlen,
+                 loff_t offset,
+                 u64 ino,
+                 unsigned int d_type)
+{
+    struct cgroup_top_ctx* top = container_of(ctx, struct cgroup_top_ctx, ctx);
+    bool more = top->count < CGROUP_TOP_MAX_SCAN;
+
+    if (more && d_type == DT_DIR && name[0] != '.')
+    {
+        char* child = kstrndup(name, namlen, GFP_KERNEL);
+        if (child != NULL)
+            top->entries[top->count++].name = child;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+    return more;
+#else
+    return more ? 0 : -ENOSPC;
+#endif
+}
+
+/**
+ * @brief parse the first line starting with name in a flat keyed
+ *        file.
+ *
+ * @param text - the contents of the file.
+ * @param name - the key to look for.
+ * @return the value of the key, 0 if it is missing.
+ */
+static
+u64
+cgroup_top_stat(const char* text,
+                const char* name)
+{
+    size_t len = strlen(name);
+    const char* line = text;
+    u64 value;
+
+    while (line != NULL && *line != '\0')
+    {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ' &&
+            sscanf(line + len + 1, "%llu", &value) == 1)
+            return value;
+
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief read the CPU time and memory use of a child cgroup, and
+ *        work out its CPU time since the previous run from prev.
+ *
+ * @param dir - the directory of the parent cgroup.
+ * @param entry - the child, with its name set.
+ * @param prev - the usage of the previous run.
+ * @param prev_count - the number of elements in prev.
+ */
+static
+void
+cgroup_top_read(const struct path* dir,
+                struct cgroup_top_entry* entry,
+                const struct cgroup_top_usage* prev,
+                int prev_count)
+{
+    char name[NAME_MAX + 32];
+    char* text;
+
+    entry->hash = full_name_hash(dir->dentry, entry->name, strlen(entry->name));
+
+    snprintf(name, sizeof(name), "%s/cpu.stat", entry->name);
+    text = cgroup_read_file(dir, name);
+    if (text != NULL)
+    {
+        entry->usage_us = cgroup_top_stat(text, "usage_usec");
+        kfree(text);
+    }
+
+    snprintf(name, sizeof(name), "%s/memory.current", entry->name);
+    text = sysinfo_cgroup_read_value(dir, name);
+    if (text != NULL)
+    {
+        if (kstrtou64(text, 10, &entry->memory) != 0)
+            entry->memory = 0;
+        kfree(text);
+    }
+
+    // children seen for the first time are ranked by all their CPU time
+    entry->recent_us = entry->usage_us;
+    for (int i = 0; i < prev_count; i++)
+    {
+        if (prev[i].hash == entry->hash)
+        {
+            if (entry->usage_us >= prev[i].usage_us)
+                entry->recent_us = entry->usage_us - prev[i].usage_us;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief sort() comparison of children, most recent CPU time first.
+ *
+ * @param a - a cgroup_top_entry.
+ * @param b - a cgroup_top_entry.
+ * @return negative if a sorts first, positive if b does, else 0.
+ */
+static
+int
+cgroup_top_cmp_cpu(const void* a,
+                   const void* b)
+{
+    const struct cgroup_top_entry* x = a;
+    const struct cgroup_top_entry* y = b;
+
+    if (x->recent_us != y->recent_us)
+        return x->recent_us < y->recent_us ? 1 : -1;
+    return 0;
+}
+
+/**
+ * @brief sort() comparison of children, most memory first.
+ *
+ * @param a - a cgroup_top_entry.
+ * @param b - a cgroup_top_entry.
+ * @return negative if a sorts first, positive if b does, else 0.
+ */
+static
+int
+cgroup_top_cmp_memory(const void* a,
+                      const void* b)
+{
+    const struct cgroup_top_entry* x = a;
+    const struct cgroup_top_entry* y = b;
+
+    if (x->memory != y->memory)
+        return x->memory < y->memory ? 1 : -1;
+    return 0;
+}
+
+/**
+ * @brief emit the CGROUP_TOP_COUNT children of the cgroup using
+ *        the most CPU time since the previous run, or the most
+ *        memory.
+ *
+ * A reader's selected cgroup is ranked by its CPU time since that
+ * reader's previous read, kept in its view.
+ *
+ * @param e - the emitter of the step.
+ * @param dir - the directory of the cgroup.
+ */
+static
+void
+cgroup_top_dir(JobEmitter* e,
+               const struct path* dir)
+{
+    struct cgroup_top_ctx top = { .ctx.actor = cgroup_top_actor };
+    struct sysinfo_cgroup_view* view = e->ctx != NULL ? e->ctx->reader : NULL;
+    const struct cgroup_top_usage* prev;        // usage of the previous run, to compute cpu_recent from
+    struct cgroup_top_usage* shared_prev = NULL;    // copy of the shared usage, NULL for a view
+    int prev_count;
+    struct cgroup_top_usage* usage;
+    struct file* file;
+    u32 order = view != NULL ? view->sort : SYSINFO_CGROUP_SORT_CPU;
+    // a reader's usage is its own, the shared usage is only kept by samples
+    bool keep = view != NULL || (e->ctx != NULL && e->ctx->sampled);
+
+    top.entries = kcalloc(CGROUP_TOP_MAX_SCAN, sizeof(struct cgroup_top_entry), GFP_KERNEL);
+    if (top.entries == NULL)
+        return;
+
+    file = dentry_open(dir, O_RDONLY | O_DIRECTORY, current_cred());
+    if (IS_ERR(file))
+    {
+        kfree(top.entries);
+        return;
+    }
+    iterate_dir(file, &top.ctx);
+    fput(file);
+
+    if (view != NULL)
+    {
+        // a view's usage is protected by the device's read mutex
+        prev = view->top_prev;
+        prev_count = view->top_prev_count;
+    }
+    else
+    {
+        // copy the shared usage, so the files of the children are read unlocked
+        mutex_lock(&cgroup_top_mutex);
+        if (cgroup_top_prev_count > 0)
+            shared_prev = kmemdup(cgroup_top_prev, cgroup_top_prev_count * sizeof(struct cgroup_top_usage), GFP_KERNEL);
+        prev_count = shared_prev != NULL ? cgroup_top_prev_count : 0;
+        mutex_unlock(&cgroup_top_mutex);
+        prev = shared_prev;
+    }
+
+    for (int i = 0; i < top.count; i++)
+        cgroup_top_read(dir, &top.entries[i], prev, prev_count);
+    kfree(shared_prev);
+
+    usage = keep ? kcalloc(max(top.count, 1), sizeof(struct cgroup_top_usage), GFP_KERNEL) : NULL;
+    if (usage != NULL)
+    {
+        for (int i = 0; i < top.count; i++)
+        {
+            usage[i].hash = top.entries[i].hash;
+            usage[i].usage_us = top.entries[i].usage_us;
+        }
+
+        if (view != NULL)
+        {
+            kfree(view->top_prev);
+            view->top_prev = usage;
+            view->top_prev_count = top.count;
+        }
+        else
+        {
+            // only the swap is locked
+            mutex_lock(&cgroup_top_mutex);
+            kfree(cgroup_top_prev);
+            cgroup_top_prev = usage;
+            cgroup_top_prev_count = top.count;
+            mutex_unlock(&cgroup_top_mutex);
+        }
+    }
+
+    sort(top.entries, top.count, sizeof(struct cgroup_top_entry),
+         order == SYSINFO_CGROUP_SORT_MEMORY ? cgroup_top_cmp_memory : cgroup_top_cmp_cpu, NULL);
+
+    for (int i = 0; i < top.count; i++)
+    {
+        struct cgroup_top_entry* entry = &top.entries[i];
+
+        if (i < CGROUP_TOP_COUNT)
+        {
+            job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+            // the emitter takes the name
+            job_emit_value(e, "name", entry->name, JOB_VALUE_LABEL, NULL);
+            job_emit_counter(e, "cpu_usage", kasprintf(GFP_KERNEL, "%llu", entry->usage_us), "us");
+            job_emit_value(e, "cpu_recent", kasprintf(GFP_KERNEL, "%llu", entry->recent_us), JOB_VALUE_NUMBER, "us");
+            job_emit_value(e, "memory_current", kasprintf(GFP_KERNEL, "%llu", entry->memory), JOB_VALUE_NUMBER, "B");
+            job_emit_end(e);
+        }
+        else
+        {
+            kfree(entry->name);
+        }
+    }
+
+    kfree(top.entries);
+}
+
+/**
+ * @brief emit the top step of the selected cgroup.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+cgroup_top(JobEmitter* e)
+{
+    cgroup_with_dir(e, cgroup_top_dir);
+}
+
+/**
+ * @brief look up the cgroup2 mount, when the module loads.
+ *
+ * @return 0 on success, negative error code if cgroup2 is not
+ *         mounted at cgroup_mount.
+ */
+int
+sysinfo_cgroup_init(void)
+{
+    int err = kern_path(cgroup_mount, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &cgroup_root_dir);
+    if (err)
+        return err;
+
+    if (!cgroup_is_cgroup2(&cgroup_root_dir))
+    {
+        path_put(&cgroup_root_dir);
+        cgroup_root_dir = (struct path){ };
+        return -ENOTDIR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief drop the cgroup2 mount and the usage kept by cgroup_top,
+ *        once the categories are unregistered and every file is
+ *        closed.
+ */
+void
+sysinfo_cgroup_exit(void)
+{
+    if (cgroup_root_dir.mnt != NULL)
+        path_put(&cgroup_root_dir);
+    cgroup_root_dir = (struct path){ };
+
+    mutex_lock(&cgroup_top_mutex);
+    kfree(cgroup_top_prev);
+    cgroup_top_prev = NULL;
+    cgroup_top_prev_count = 0;
+    mutex_unlock(&cgroup_top_mutex);
+}
+
+DEFINE_JOB(cgroup_job, "cgroup",
+    JOB_STEP_CTX("path", cgroup_selected_path, JOB_VALUE_STRING, NULL),
+    JOB_STEP_EMIT("cpu", cgroup_cpu, JOB_VALUE_OBJECT),
+    JOB_STEP_EMIT("memory", cgroup_memory, JOB_VALUE_OBJECT),
+    JOB_STEP_EMIT("io", cgroup_io, JOB_VALUE_ARRAY),
+);
+
+DEFINE_JOB(cgroup_top_job, "cgroup_top",
+    JOB_STEP_CTX("path", cgroup_selected_path, JOB_VALUE_STRING, NULL),
+    JOB_STEP_EMIT_ASYNC("cgroups", cgroup_top, JOB_VALUE_ARRAY, .budget_ms = 200),
+);
@@ -0,0 +1,36 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <linux/path.h>
+#include <linux/types.h>
+#include "job.h"
+
+extern const Job cgroup_job;
+extern const Job cgroup_top_job;
+
+struct cgroup_top_usage;
+
+/**
+ * The cgroup a reader selected with SYSINFO_IOC_SET_CGROUP. The
+ * cgroup categories the reader reads are collected for it, with
+ * the view as the reader of their JobContext.
+ *
+ * Protected by the device's read mutex once the file is open.
+ */
+struct sysinfo_cgroup_view {
+    struct path dir;                            // the selected cgroup
+    u32 sort;                                   // SYSINFO_CGROUP_SORT_* order of cgroup_top
+    struct cgroup_top_usage* top_prev;          // usage of each child, from the reader's previous read
+    int top_prev_count;
+};
+
+int sysinfo_cgroup_init(void);
+void sysinfo_cgroup_exit(void);
+int sysinfo_cgroup_select(struct sysinfo_cgroup_view** view, const struct path* root, int fd, const char* path, u32 sort);
+void sysinfo_cgroup_view_destroy(struct sysinfo_cgroup_view* view);
+bool sysinfo_cgroup_is_sample(const JobResult* sample);
+JobResult* sysinfo_cgroup_collect(struct sysinfo_cgroup_view* view, const JobResult* sample);
+int sysinfo_cgroup_root(struct path* root);
+char* sysinfo_cgroup_read_value(const struct path* dir, const char* name);
+
+#endif
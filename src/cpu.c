@@ -1,7 +1,7 @@
 /**
  * cpu.c
  * 
- * Configures and gets cpu job.
+ * Defines the cpu job.
  * 
  * @author Sarah McDonagh
  */
@@ -12,50 +12,35 @@
 #include <linux/ktime.h>
 #include <linux/cpu.h>
 #include <linux/cpufreq.h>
+#include <linux/kernel_stat.h>
+#include <linux/smp.h>
 #include <linux/version.h>  
 #include "cpu.h"
 
-key_value_pair cpu_model(void);
-key_value_pair cpu_vendor(void);
-key_value_pair cpu_frequency(void);
-key_value_pair cpu_cores(void);
-key_value_pair cpu_idle_time(void);
-Job* get_cpu_job(void);
-
-key_value_pair cpu_model(void) { 
-    key_value_pair keyVal;
-    keyVal.key = "cpu_model";
-
+static char* cpu_model(void)
+{
     #if defined(CONFIG_X86)
-        keyVal.value = kstrdup(cpu_data(smp_processor_id()).x86_model_id, GFP_KERNEL);
+        return kstrdup(cpu_data(smp_processor_id()).x86_model_id, GFP_KERNEL);
     #elif defined(CONFIG_ARM) || defined(CONFIG_ARM64)
-        keyVal.value = kstrdup("ARM CPU", GFP_KERNEL); 
+        return kstrdup("ARM CPU", GFP_KERNEL);
     #else
-        keyVal.value = kstrdup("Unknown CPU", GFP_KERNEL);
+        return kstrdup("Unknown CPU", GFP_KERNEL);
     #endif
-
-    return keyVal;
 }
 
-key_value_pair cpu_vendor(void) {
-    key_value_pair keyVal;
-    keyVal.key = "cpu_vendor";
-
+static char* cpu_vendor(void)
+{
     #if defined(CONFIG_X86)
-        keyVal.value = kstrdup(cpu_data(smp_processor_id()).x86_vendor_id, GFP_KERNEL);
+        return kstrdup(cpu_data(smp_processor_id()).x86_vendor_id, GFP_KERNEL);
     #elif defined(CONFIG_ARM) || defined(CONFIG_ARM64)
-        keyVal.value = kstrdup("ARM Vendor", GFP_KERNEL);
+        return kstrdup("ARM Vendor", GFP_KERNEL);
     #else
-        keyVal.value = kstrdup("Unknown Vendor", GFP_KERNEL);
+        return kstrdup("Unknown Vendor", GFP_KERNEL);
     #endif
-
-    return keyVal;
 }
 
-key_value_pair cpu_frequency(void) {
-    key_value_pair keyVal;
-    keyVal.key = "cpu_frequency";
-
+static char* cpu_frequency(void)
+{
     unsigned long freq = 0;
 
     #if defined(CONFIG_CPU_FREQ)
@@ -64,36 +49,16 @@ key_value_pair cpu_frequency(void) {
         freq = arch_timer_get_cntfrq();
     #endif
 
-    char *freq_str = kmalloc(20, GFP_KERNEL);
-    if (!freq_str)
-        return keyVal;
-
-    scnprintf(freq_str, 20, "%lu", freq ? freq : 1000000); 
-    keyVal.value = freq_str;
-
-    return keyVal;
+    return kasprintf(GFP_KERNEL, "%lu", freq ? freq : 1000000);
 }
 
-key_value_pair cpu_cores(void) {
-    key_value_pair keyVal;
-    keyVal.key = "cpu_cores";
-
-    int num_cores = num_online_cpus();
-
-    char *value = kmalloc(16, GFP_KERNEL);
-    if (!value)
-        return keyVal;
-
-    scnprintf(value, 16, "%d", num_cores);
-    keyVal.value = value;
-
-    return keyVal;
+static char* cpu_cores(void)
+{
+    return kasprintf(GFP_KERNEL, "%d", num_online_cpus());
 }
- 
-key_value_pair cpu_idle_time(void) {
-    key_value_pair keyVal;
-    keyVal.key = "cpu_idle_time";
 
+static char* cpu_idle_time(void)
+{
     unsigned long idle_time = 0;
 
     #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
@@ -102,22 +67,65 @@ key_value_pair cpu_idle_time(void) {
         idle_time = get_cpu_idle_time(0, NULL, 0);
     #endif
 
-    char *idle_str = kmalloc(20, GFP_KERNEL);
-    if (!idle_str)
-        return keyVal;
+    return kasprintf(GFP_KERNEL, "%lu", idle_time);
+}
 
-    scnprintf(idle_str, 20, "%lu", idle_time);
-    keyVal.value = idle_str;
+/**
+ * Values of one CPU, read on that CPU by cpu_sample_local().
+ */
+struct cpu_sample {
+    u64 idle_us;                                // time spent idle
+    u64 user_ns;                                // time spent in user mode
+    u64 system_ns;                              // time spent in the kernel
+};
 
-    return keyVal;
+/**
+ * Fills in the cpu_sample of the CPU this runs on, from an IPI.
+ */
+static void cpu_sample_local(void* slot)
+{
+    struct cpu_sample* s = slot;
+    struct kernel_cpustat* kcs = kcpustat_this_cpu;
+
+    s->idle_us = get_cpu_idle_time(smp_processor_id(), NULL, 0);
+    s->user_ns = kcs->cpustat[CPUTIME_USER];
+    s->system_ns = kcs->cpustat[CPUTIME_SYSTEM];
 }
 
-Job* get_cpu_job(void) {
-    Job* cpu_info = job_init("cpu", &cpu_model);
-    append_step_to_job(cpu_info, &cpu_vendor);
-    append_step_to_job(cpu_info, &cpu_frequency);
-    append_step_to_job(cpu_info, &cpu_cores);
-    append_step_to_job(cpu_info, &cpu_idle_time);
-
-    return cpu_info;
+/**
+ * Emits an array with the frequency, idle, user and system time
+ * of each online CPU. The times are read on each CPU.
+ */
+static void cpu_per_cpu(JobEmitter* e)
+{
+    struct cpu_sample* samples;
+    int cpu;
+
+    cpus_read_lock();
+    samples = job_collect_per_cpu(cpu_sample_local, sizeof(struct cpu_sample));
+    for_each_online_cpu(cpu)
+    {
+        if (samples == NULL)
+            break;
+
+        job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+        job_emit_value(e, "cpu", kasprintf(GFP_KERNEL, "%d", cpu), JOB_VALUE_LABEL, NULL);
+        job_emit_value(e, "frequency", kasprintf(GFP_KERNEL, "%u", cpufreq_quick_get(cpu)), JOB_VALUE_NUMBER, "kHz");
+        job_emit_counter(e, "idle_time", kasprintf(GFP_KERNEL, "%llu", samples[cpu].idle_us / 1000), "ms");
+        job_emit_counter(e, "user_time", kasprintf(GFP_KERNEL, "%llu", samples[cpu].user_ns / NSEC_PER_MSEC), "ms");
+        job_emit_counter(e, "system_time", kasprintf(GFP_KERNEL, "%llu", samples[cpu].system_ns / NSEC_PER_MSEC), "ms");
+        job_emit_end(e);
+    }
+    cpus_read_unlock();
+
+    kfree(samples);
 }
+
+DEFINE_JOB(cpu_job, "cpu",
+    JOB_STEP("cpu_model", cpu_model, JOB_VALUE_STRING, NULL),
+    JOB_STEP("cpu_vendor", cpu_vendor, JOB_VALUE_STRING, NULL),
+    JOB_STEP("cpu_frequency", cpu_frequency, JOB_VALUE_NUMBER, "kHz"),
+    JOB_STEP("cpu_cores", cpu_cores, JOB_VALUE_NUMBER, NULL),
+    JOB_STEP_COUNTER("cpu_idle_time", cpu_idle_time, "ms"),
+    JOB_STEP_EMIT_ASYNC("cpus", cpu_per_cpu, JOB_VALUE_ARRAY, .budget_ms = 100),
+);
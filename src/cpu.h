@@ -1,8 +1,8 @@
-
 #ifndef CPU_H
 #define CPU_H
+
 #include "job.h"
 
-Job* get_cpu_job(void);
+extern const Job cpu_job;
 
-#endif
\ No newline at end of file
+#endif
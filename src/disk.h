@@ -1,6 +1,8 @@
 #ifndef DISK_H
 #define DISK_H
 
-Job* get_disk_job(void);
+#include "job.h"
 
-#endif
\ No newline at end of file
+extern const Job disk_job;
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * instrument.c
+ * 
+ * Hot path instrumentation. Records how long each job, each
+ * step, serialization and reads take, in per-CPU counters, and
+ * exposes the totals in debugfs at /sys/kernel/debug/sysinfo/.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include "instrument.h"
+
+#define INSTRUMENT_DIR_NAME "sysinfo"
+
+// fixed timers, jobs and steps are added after these
+#define INSTRUMENT_TIMER_SERIALIZE 0
+#define INSTRUMENT_TIMER_READ 1
+#define INSTRUMENT_FIXED_TIMERS 2
+
+/**
+ * Name of a timer. Jobs are timed with key == NULL,
+ * steps with the key of the value they return.
+ *
+ * Names of job and step timers are copies, as their category
+ * can be unregistered while the timers are still shown.
+ */
+struct instrument_timer_name {
+    const char* job_title;
+    const char* key;
+};
+
+/**
+ * Counters kept by each CPU.
+ */
+struct instrument_cpu {
+    struct instrument_timing timers[INSTRUMENT_MAX_TIMERS];
+    u64 bytes_copied;                           // bytes copied to readers
+    u64 timers_dropped;                         // durations not recorded, as every timer was in use
+};
+
+static struct instrument_cpu __percpu *instrument_counters;    // NULL if instrumentation is off
+static struct dentry *instrument_dir;           // /sys/kernel/debug/sysinfo
+
+static struct instrument_timer_name timer_names[INSTRUMENT_MAX_TIMERS] = {
+    [INSTRUMENT_TIMER_SERIALIZE] = { "serialize", NULL },
+    [INSTRUMENT_TIMER_READ] = { "read", NULL },
+};
+static int timer_count = INSTRUMENT_FIXED_TIMERS;
+static DEFINE_SPINLOCK(timer_names_lock);       // protects timer_names and timer_count
+
+/**
+ * @brief find the timer for a job or step, adding it if it is new.
+ * 
+ * @param job_title - title of the job.
+ * @param key - key of the step, NULL for the job itself.
+ * 
+ * @return index of the timer, -1 if all timers are in use.
+ */
+static
+int
+instrument_timer_index(const char* job_title,
+                       const char* key)
+{
+    int index = -1;
+
+    spin_lock(&timer_names_lock);
+    for (int i = INSTRUMENT_FIXED_TIMERS; i < timer_count; i++)
+    {
+        if (strcmp(timer_names[i].job_title, job_title) != 0)
+            continue;
+        if ((key == NULL) != (timer_names[i].key == NULL))
+            continue;
+        if (key != NULL && strcmp(timer_names[i].key, key) != 0)
+            continue;
+
+        index = i;
+        break;
+    }
+
+    if (index < 0 && timer_count < INSTRUMENT_MAX_TIMERS)
+    {
+        char* title_copy = kstrdup(job_title, GFP_ATOMIC);
+        char* key_copy = key ? kstrdup(key, GFP_ATOMIC) : NULL;
+
+        if (title_copy != NULL && (key == NULL || key_copy != NULL))
+        {
+            index = timer_count;
+            timer_names[index].job_title = title_copy;
+            timer_names[index].key = key_copy;
+            // publish the name before the new count
+            smp_store_release(&timer_count, timer_count + 1);
+        }
+        else
+        {
+            kfree(title_copy);
+            kfree(key_copy);
+        }
+    }
+    spin_unlock(&timer_names_lock);
+
+    if (index < 0)
+        pr_warn_once("All %d sysinfo timers are in use, durations of new jobs and steps are dropped\n", INSTRUMENT_MAX_TIMERS);
+
+    return index;
+}
+
+/**
+ * @brief record one duration in a timing on this CPU.
+ */
+static
+void
+instrument_record(struct instrument_timing* t,
+                  u64 duration_ns)
+{
+    int bucket = duration_ns ? min_t(int, ilog2(duration_ns), INSTRUMENT_HIST_BUCKETS - 1) : 0;
+
+    t->count++;
+    t->total_ns += duration_ns;
+    if (duration_ns > t->max_ns)
+        t->max_ns = duration_ns;
+    t->hist[bucket]++;
+}
+
+/**
+ * @brief record the duration of a job and of each of its steps.
+ * 
+ * @param r - the result of running the job.
+ */
+void
+instrument_job(JobResult* r)
+{
+    struct instrument_cpu* c;
+    int job_index;
+    int step_index[INSTRUMENT_MAX_TIMERS];
+    int steps;
+
+    if (instrument_counters == NULL || r == NULL)
+        return;
+
+    // look timers up before pinning the CPU, adding a name takes a lock
+    job_index = instrument_timer_index(r->job_title, NULL);
+    steps = min_t(int, r->kvp_count, INSTRUMENT_MAX_TIMERS);
+    for (int i = 0; i < steps; i++)
+        step_index[i] = r->kvps[i].key ? instrument_timer_index(r->job_title, r->kvps[i].key) : -1;
+
+    c = get_cpu_ptr(instrument_counters);
+    if (job_index >= 0)
+        instrument_record(&c->timers[job_index], r->duration_ns);
+    else
+        c->timers_dropped++;
+    for (int i = 0; i < steps; i++)
+    {
+        if (step_index[i] >= 0)
+            instrument_record(&c->timers[step_index[i]], r->step_ns[i]);
+        else if (r->kvps[i].key != NULL)
+            c->timers_dropped++;
+    }
+    // steps past the last timer cannot have one
+    c->timers_dropped += r->kvp_count - steps;
+    put_cpu_ptr(instrument_counters);
+}
+
+/**
+ * @brief record the time taken to serialize a document.
+ * 
+ * @param duration_ns - time taken, in nanoseconds.
+ */
+void
+instrument_serialize(u64 duration_ns)
+{
+    struct instrument_cpu* c;
+
+    if (instrument_counters == NULL)
+        return;
+
+    c = get_cpu_ptr(instrument_counters);
+    instrument_record(&c->timers[INSTRUMENT_TIMER_SERIALIZE], duration_ns);
+    put_cpu_ptr(instrument_counters);
+}
+
+/**
+ * @brief record the time taken by a read and the bytes it copied.
+ * 
+ * @param duration_ns - time taken, in nanoseconds.
+ * @param bytes - number of bytes copied to the reader.
+ */
+void
+instrument_read(u64 duration_ns,
+                size_t bytes)
+{
+    struct instrument_cpu* c;
+
+    if (instrument_counters == NULL)
+        return;
+
+    c = get_cpu_ptr(instrument_counters);
+    instrument_record(&c->timers[INSTRUMENT_TIMER_READ], duration_ns);
+    c->bytes_copied += bytes;
+    put_cpu_ptr(instrument_counters);
+}
+
+/**
+ * @brief write the summed timings of every timer to debugfs.
+ * 
+ * One line per timer: name, count, total_ns, max_ns and the
+ * histogram buckets, separated by tabs. Then the bytes copied to
+ * readers, and the durations dropped as every timer was in use.
+ */
+static
+int
+latency_show(struct seq_file *m,
+             void *v)
+{
+    int count = smp_load_acquire(&timer_count);
+    u64 bytes_copied = 0;
+    u64 timers_dropped = 0;
+    int cpu;
+
+    seq_puts(m, "# name\tcount\ttotal_ns\tmax_ns\thistogram (bucket i counts [2^i, 2^(i+1)) ns)\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        struct instrument_timing sum = {};
+
+        for_each_possible_cpu(cpu)
+        {
+            struct instrument_timing* t = &per_cpu_ptr(instrument_counters, cpu)->timers[i];
+
+            sum.count += t->count;
+            sum.total_ns += t->total_ns;
+            sum.max_ns = max(sum.max_ns, t->max_ns);
+            for (int b = 0; b < INSTRUMENT_HIST_BUCKETS; b++)
+                sum.hist[b] += t->hist[b];
+        }
+
+        if (timer_names[i].key != NULL)
+            seq_printf(m, "step/%s/%s", timer_names[i].job_title, timer_names[i].key);
+        else if (i >= INSTRUMENT_FIXED_TIMERS)
+            seq_printf(m, "job/%s", timer_names[i].job_title);
+        else
+            seq_puts(m, timer_names[i].job_title);
+
+        seq_printf(m, "\t%llu\t%llu\t%llu\t", sum.count, sum.total_ns, sum.max_ns);
+        for (int b = 0; b < INSTRUMENT_HIST_BUCKETS; b++)
+            seq_printf(m, b ? " %llu" : "%llu", sum.hist[b]);
+        seq_putc(m, '\n');
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        bytes_copied += per_cpu_ptr(instrument_counters, cpu)->bytes_copied;
+        timers_dropped += per_cpu_ptr(instrument_counters, cpu)->timers_dropped;
+    }
+    seq_printf(m, "bytes_copied\t%llu\n", bytes_copied);
+    seq_printf(m, "timers_dropped\t%llu\n", timers_dropped);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/**
+ * @brief allocate the per-CPU counters and create the debugfs files.
+ * 
+ * Instrumentation is left off if the counters cannot be allocated.
+ */
+void
+instrument_init(void)
+{
+    instrument_counters = alloc_percpu(struct instrument_cpu);
+    if (instrument_counters == NULL)
+    {
+        pr_err("Could not allocate instrumentation counters\n");
+        return;
+    }
+
+    instrument_dir = debugfs_create_dir(INSTRUMENT_DIR_NAME, NULL);
+    debugfs_create_file("latency", 0444, instrument_dir, NULL, &latency_fops);
+}
+
+/**
+ * @brief remove the debugfs files and free the per-CPU counters.
+ */
+void
+instrument_exit(void)
+{
+    debugfs_remove(instrument_dir);
+    instrument_dir = NULL;
+
+    free_percpu(instrument_counters);
+    instrument_counters = NULL;
+
+    for (int i = INSTRUMENT_FIXED_TIMERS; i < timer_count; i++)
+    {
+        kfree(timer_names[i].job_title);
+        kfree(timer_names[i].key);
+    }
+    timer_count = INSTRUMENT_FIXED_TIMERS;
+}
@@ -0,0 +1,29 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <linux/types.h>
+#include "job.h"
+
+// maximum number of distinct jobs and steps that are timed
+#define INSTRUMENT_MAX_TIMERS 64
+
+// histogram buckets, bucket i counts durations in [2^i, 2^(i+1)) ns
+#define INSTRUMENT_HIST_BUCKETS 32
+
+/**
+ * Execution time statistics for one timer.
+ */
+struct instrument_timing {
+    u64 count;                                  // number of recorded durations
+    u64 total_ns;                               // sum of recorded durations
+    u64 max_ns;                                 // longest recorded duration
+    u64 hist[INSTRUMENT_HIST_BUCKETS];          // log2 histogram of durations
+};
+
+void instrument_init(void);
+void instrument_exit(void);
+void instrument_job(JobResult* r);
+void instrument_serialize(u64 duration_ns);
+void instrument_read(u64 duration_ns, size_t bytes);
+
+#endif
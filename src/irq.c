@@ -0,0 +1,238 @@
+/**
+ * irq.c
+ *
+ * Defines the irq job: the hardirqs and softirqs handled by each
+ * CPU, with softirqs by type, and the count of each interrupt line,
+ * with how much each grew since the previous sample. The counts are
+ * read from the kernel's counters, so nothing is formatted and
+ * parsed like /proc/interrupts.
+ *
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/irqnr.h>
+#include <linux/kernel_stat.h>
+#include <linux/smp.h>
+#include "irq.h"
+
+/**
+ * Counts of one CPU, read on that CPU by irq_sample_local().
+ */
+struct irq_cpu_counts {
+    u64 hardirqs;                               // interrupts handled, every line included
+    unsigned int softirqs[NR_SOFTIRQS];         // softirqs run, by type
+    bool valid;                                 // read, false for CPUs that were offline
+};
+
+// names of the softirq types, as keys, NULL for types not reported
+static const char* const irq_softirq_names[NR_SOFTIRQS] = {
+    [HI_SOFTIRQ] = "hi",
+    [TIMER_SOFTIRQ] = "timer",
+    [NET_TX_SOFTIRQ] = "net_tx",
+    [NET_RX_SOFTIRQ] = "net_rx",
+    [BLOCK_SOFTIRQ] = "block",
+    [IRQ_POLL_SOFTIRQ] = "irq_poll",
+    [TASKLET_SOFTIRQ] = "tasklet",
+    [SCHED_SOFTIRQ] = "sched",
+    [HRTIMER_SOFTIRQ] = "hrtimer",
+    [RCU_SOFTIRQ] = "rcu",
+};
+
+static DEFINE_MUTEX(irq_cpu_mutex);             // protects irq_cpu_prev
+static struct irq_cpu_counts* irq_cpu_prev;     // counts of each CPU, by id, from the previous sample
+
+static DEFINE_MUTEX(irq_line_mutex);            // protects irq_line_prev
+static u64* irq_line_prev;                      // count of each line, from the previous sample
+static unsigned int irq_line_prev_count;
+
+/**
+ * @brief fill in the irq_cpu_counts of the CPU this runs on, from
+ *        an IPI.
+ *
+ * @param slot - the irq_cpu_counts of this CPU.
+ */
+static
+void
+irq_sample_local(void* slot)
+{
+    struct irq_cpu_counts* c = slot;
+    int cpu = smp_processor_id();
+
+    c->hardirqs = kstat_cpu_irqs_sum(cpu);
+    for (int i = 0; i < NR_SOFTIRQS; i++)
+        c->softirqs[i] = kstat_softirqs_cpu(i, cpu);
+    c->valid = true;
+}
+
+/**
+ * @brief emit an object with the count of each softirq type of a
+ *        CPU, or with how much each grew since prev.
+ *
+ * @param e - the emitter of the step.
+ * @param key - the key of the object.
+ * @param now - the counts of the CPU.
+ * @param prev - the counts of the previous sample, NULL to emit
+ *               the counts themselves.
+ */
+static
+void
+irq_emit_softirqs(JobEmitter* e,
+                  const char* key,
+                  const struct irq_cpu_counts* now,
+                  const struct irq_cpu_counts* prev)
+{
+    job_emit_begin(e, key, JOB_VALUE_OBJECT);
+    for (int i = 0; i < NR_SOFTIRQS; i++)
+    {
+        // the counters are unsigned int, so this holds when they wrap
+        unsigned int count = prev != NULL ? now->softirqs[i] - prev->softirqs[i] : now->softirqs[i];
+
+        if (irq_softirq_names[i] == NULL)
+            continue;
+
+        // the counts only grow, their deltas are gauges
+        if (prev != NULL)
+            job_emit_value(e, irq_softirq_names[i], kasprintf(GFP_KERNEL, "%u", count), JOB_VALUE_NUMBER, NULL);
+        else
+            job_emit_counter(e, irq_softirq_names[i], kasprintf(GFP_KERNEL, "%u", count), NULL);
+    }
+    job_emit_end(e);
+}
+
+/**
+ * @brief emit an array with the hardirqs and softirqs handled by
+ *        each online CPU, and how much they grew since the
+ *        previous sample.
+ *
+ * The counts are read on each CPU. A CPU's deltas are left out
+ * until it has been sampled. Only samples keep their counts as the
+ * next baseline, so other collections do not shorten the interval.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+irq_per_cpu(JobEmitter* e)
+{
+    struct irq_cpu_counts* counts;
+    int cpu;
+
+    cpus_read_lock();
+    counts = job_collect_per_cpu(irq_sample_local, sizeof(struct irq_cpu_counts));
+    mutex_lock(&irq_cpu_mutex);
+    for_each_online_cpu(cpu)
+    {
+        const struct irq_cpu_counts* prev = irq_cpu_prev != NULL && irq_cpu_prev[cpu].valid ? &irq_cpu_prev[cpu] : NULL;
+
+        if (counts == NULL)
+            break;
+
+        job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+        job_emit_value(e, "cpu", kasprintf(GFP_KERNEL, "%d", cpu), JOB_VALUE_LABEL, NULL);
+        job_emit_counter(e, "hardirqs", kasprintf(GFP_KERNEL, "%llu", counts[cpu].hardirqs), NULL);
+        if (prev != NULL)
+            job_emit_value(e, "hardirqs_delta", kasprintf(GFP_KERNEL, "%llu", counts[cpu].hardirqs - prev->hardirqs), JOB_VALUE_NUMBER, NULL);
+        irq_emit_softirqs(e, "softirqs", &counts[cpu], NULL);
+        if (prev != NULL)
+            irq_emit_softirqs(e, "softirqs_delta", &counts[cpu], prev);
+        job_emit_end(e);
+    }
+
+    // keep a sample's counts for the next one, CPUs that were offline are not valid
+    if (counts != NULL && e->ctx != NULL && e->ctx->sampled)
+    {
+        kfree(irq_cpu_prev);
+        irq_cpu_prev = counts;
+    }
+    else
+    {
+        kfree(counts);
+    }
+    mutex_unlock(&irq_cpu_mutex);
+    cpus_read_unlock();
+}
+
+/**
+ * @brief emit an array with the count of each interrupt line that
+ *        has fired, summed over the CPUs, and how much it grew
+ *        since the previous sample.
+ *
+ * Lines that have never fired are left out. Only samples keep
+ * their counts as the next baseline.
+ *
+ * @param e - the emitter of the step.
+ */
+static
+void
+irq_lines(JobEmitter* e)
+{
+    unsigned int count = READ_ONCE(nr_irqs);
+    u64* totals;
+    int cpu;
+
+    totals = kcalloc(count, sizeof(u64), GFP_KERNEL);
+    if (totals == NULL)
+        return;
+
+    for (unsigned int irq = 0; irq < count; irq++)
+    {
+        for_each_possible_cpu(cpu)
+            totals[irq] += kstat_irqs_cpu(irq, cpu);
+    }
+
+    mutex_lock(&irq_line_mutex);
+    for (unsigned int irq = 0; irq < count; irq++)
+    {
+        if (totals[irq] == 0)
+            continue;
+
+        job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+        job_emit_value(e, "irq", kasprintf(GFP_KERNEL, "%u", irq), JOB_VALUE_LABEL, NULL);
+        job_emit_counter(e, "count", kasprintf(GFP_KERNEL, "%llu", totals[irq]), NULL);
+        // a line freed and set up again can start over from a lower count
+        if (irq < irq_line_prev_count && totals[irq] >= irq_line_prev[irq])
+            job_emit_value(e, "delta", kasprintf(GFP_KERNEL, "%llu", totals[irq] - irq_line_prev[irq]), JOB_VALUE_NUMBER, NULL);
+        job_emit_end(e);
+    }
+
+    if (e->ctx != NULL && e->ctx->sampled)
+    {
+        kfree(irq_line_prev);
+        irq_line_prev = totals;
+        irq_line_prev_count = count;
+    }
+    else
+    {
+        kfree(totals);
+    }
+    mutex_unlock(&irq_line_mutex);
+}
+
+/**
+ * @brief drop the counts kept for deltas, once the category is
+ *        unregistered and nothing collects it any more.
+ */
+void
+irq_exit(void)
+{
+    mutex_lock(&irq_cpu_mutex);
+    kfree(irq_cpu_prev);
+    irq_cpu_prev = NULL;
+    mutex_unlock(&irq_cpu_mutex);
+
+    mutex_lock(&irq_line_mutex);
+    kfree(irq_line_prev);
+    irq_line_prev = NULL;
+    irq_line_prev_count = 0;
+    mutex_unlock(&irq_line_mutex);
+}
+
+DEFINE_JOB(irq_job, "irq",
+    JOB_STEP_EMIT_ASYNC("cpus", irq_per_cpu, JOB_VALUE_ARRAY, .budget_ms = 100),
+    JOB_STEP_EMIT_ASYNC("lines", irq_lines, JOB_VALUE_ARRAY, .budget_ms = 100),
+);
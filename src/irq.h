@@ -0,0 +1,10 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include "job.h"
+
+extern const Job irq_job;
+
+void irq_exit(void);
+
+#endif
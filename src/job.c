@@ -10,34 +10,127 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include "cpu.h"
-#include "memory.h"
-#include "disk.h"
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include "job.h"
+
+#ifdef __KERNEL__
+#include "sysinfo_trace.h"
+#else
+// userspace builds of the job engine have no tracepoints
+#define trace_sysinfo_job_start(title, steps) do { } while (0)
+#define trace_sysinfo_step(title, key, duration_ns) do { } while (0)
+#define trace_sysinfo_job_end(title, steps, duration_ns) do { } while (0)
+#endif
 
 // definitions for backing array for job
 #define INITIAL_CAPACITY 16
 #define GROWTH_FACTOR 2
+// largest capacity serialize_job_result() starts its buffer with
+#define MAX_INITIAL_CAPACITY (64 * 1024)
+// longest Prometheus metric name and list of labels
+#define JOB_PROM_NAME_LEN 128
+#define JOB_PROM_LABELS_LEN 512
+
+/**
+ * A step queued on a workqueue by collect_job().
+ */
+struct job_step_work {
+    struct work_struct work;
+    const Job* job;
+    const JobContext* ctx;                      // what the job is collected for
+    JobResult* result;
+    int index;                                  // index of the step in the job
+    struct job_budget_work* attempt;            // attempt waited for instead, if the step has a budget
+};
 
-// definitions for info types
-#define CPU 1
-#define MEMORY 2
-#define DISK 3
+/**
+ * An attempt at running a step with a time budget. Shared by the
+ * step's StepState, while it is pending, and by every collector
+ * waiting for it, and freed when the last of them drops it.
+ */
+struct job_budget_work {
+    struct work_struct work;
+    const Job* job;
+    const Step* step;
+    JobContext ctx;                             // what the collector that started the attempt collected for
+    bool has_ctx;                               // ctx is set, the step is passed NULL otherwise
+    key_value_pair kvp;                         // value returned by the step
+    u64 step_ns;                                // time the step took
+    u64 deadline_ns;                            // collectors wait for the attempt until then
+    struct completion done;                     // completed when the step returns
+    int refs;                                   // the state and the waiting collectors
+    bool failed;                                // the step returned no value
+};
 
-// set current_info_type to CPU initially
-static int current_info_type = CPU;
+static DEFINE_MUTEX(job_budget_mutex);          // protects the StepState of every job
+
+/**
+ * Arguments of job_collect_per_cpu() passed to each CPU.
+ */
+struct job_per_cpu_call {
+    void (*fn)(void* slot);
+    char* slots;
+    size_t slot_size;
+};
 
 typedef struct {
     char *data;         // The buffer
     ssize_t size;       // the current size of the buffer
     ssize_t capacity;   // allocated capacity of the buffer
+    int error;          // negative error code once an append failed
 } DynamicJobBuffer;
 
+// size of the largest document serialized so far, so that
+// serialize_job_result() can allocate its buffer once
+static size_t job_buffer_hint = INITIAL_CAPACITY;
+
 // function prototypes
 DynamicJobBuffer* init_job_buffer(void);
-void resize_job_buffer(DynamicJobBuffer *b, size_t new_capacity);
-void append_to_job_buffer(DynamicJobBuffer *b, const char* text);
+int resize_job_buffer(DynamicJobBuffer *b, size_t new_capacity);
+int append_to_job_buffer(DynamicJobBuffer *b, const char* text);
 void free_job_buffer(DynamicJobBuffer *b);
-Step* step_init(key_value_pair (*get_kvp)(void));
+static int job_buffer_setup(DynamicJobBuffer *b, size_t capacity);
+static bool job_delta_needs_keyframe(JobDelta* d, JobResult* r);
+static void job_free_children(key_value_pair* kvp);
+static bool job_kvp_has_value(const key_value_pair* kvp);
+static void job_serialize_value(DynamicJobBuffer* b, const key_value_pair* kvp);
+static int job_buffer_append_len(DynamicJobBuffer *b, const char* text, size_t text_len);
+static void job_append_json_string(DynamicJobBuffer* b, const char* text);
+static void job_delta_remember(JobDelta* d, int index, const char* value);
+
+/**
+ * @brief set up an empty DynamicJobBuffer with a backing array of
+ *        a given capacity.
+ * 
+ * @param b - the DynamicJobBuffer to set up.
+ * @param capacity - size of the backing array.
+ * @return 0 on success, -ENOMEM on allocation failure.
+ */
+static
+int
+job_buffer_setup(DynamicJobBuffer *b,
+                 size_t capacity)
+{
+    b->capacity = capacity;
+    b->size = 0;
+    b->error = 0;
+    b->data = (char *)kmalloc(b->capacity, GFP_KERNEL);
+    if (!b->data)
+    {
+        pr_err("Could not allocate backing array for job buffer\n");
+        return -ENOMEM;
+    }
+    b->data[0] = '\0';
+    return 0;
+}
 
 /**
  * @brief Backing array for writing sysinfo data as string.
@@ -48,32 +141,37 @@ Step* step_init(key_value_pair (*get_kvp)(void));
  * 
  * This is more efficient as there are less frequent resizes.
  * 
- * @return pointer to a DynamicJobBuffer.
+ * @return pointer to a DynamicJobBuffer, NULL on allocation failure.
  */
 DynamicJobBuffer*
 init_job_buffer(void)
 {
     DynamicJobBuffer *b = kmalloc(sizeof(DynamicJobBuffer), GFP_KERNEL);
-    b->capacity = INITIAL_CAPACITY;
-    b->size = 0;
-    b->data = (char *)kmalloc(b->capacity, GFP_KERNEL);
-    if (!b->data)
+    if (!b)
     {
-        pr_err("Could not increase size of backing array in job buffer\n");
+        pr_err("Could not allocate job buffer\n");
+        return NULL;
+    }
+
+    if (job_buffer_setup(b, INITIAL_CAPACITY) != 0)
+    {
+        kfree(b);
         return NULL;
     }
-    b->data[0] = '\0';
     return b;
 }
 
 /**
  * @brief resize a DynamicJobBuffer.
  * 
+ * The buffer is left as it was if it cannot be resized.
+ * 
  * @param b - pointer to the DynamicJobBuffer to resize.
  * @param new_capacity - the new size of the backing array for the
  *                       DynamicJobBuffer.
+ * @return 0 on success, -ENOMEM on allocation failure.
  */
-void
+int
 resize_job_buffer(DynamicJobBuffer *b,
                   size_t new_capacity)
 {
@@ -82,7 +180,7 @@ resize_job_buffer(DynamicJobBuffer *b,
     if (!new_data)
     {
         pr_err("Memory allocation failed resizing job buffer\n");
-        return;
+        return -ENOMEM;
     }
 
     // set the data for the new DynamicJobBuffer 
@@ -90,19 +188,44 @@ resize_job_buffer(DynamicJobBuffer *b,
     b->data = new_data;
     // set the capacity of the array to new_capacity 
     b->capacity = new_capacity;
+    return 0;
 }
 
 /**
  * @brief append text to DynamicJobBuffer
  * 
+ * Once an append fails, the buffer keeps the error and later
+ * appends do nothing, so a caller can append a whole document
+ * and check b->error once at the end.
+ * 
  * @param b - the DynamicJobBuffer to append to
  * @param text - text to append to b
+ * @return 0 on success, -ENOMEM if the buffer could not grow.
  */
-void
+int
 append_to_job_buffer(DynamicJobBuffer *b,
                      const char* text)
 {
-    size_t text_len = strlen(text);
+    return job_buffer_append_len(b, text, strlen(text));
+}
+
+/**
+ * @brief append the first text_len bytes of text to a
+ *        DynamicJobBuffer, as append_to_job_buffer() does.
+ * 
+ * @param b - the DynamicJobBuffer to append to
+ * @param text - text to append to b, need not be NUL terminated
+ * @param text_len - number of bytes of text to append
+ * @return 0 on success, -ENOMEM if the buffer could not grow.
+ */
+static
+int
+job_buffer_append_len(DynamicJobBuffer *b,
+                      const char* text,
+                      size_t text_len)
+{
+    if (b->error)
+        return b->error;
 
     if (b->size + text_len + 1 > b->capacity)
     {
@@ -112,12 +235,55 @@ append_to_job_buffer(DynamicJobBuffer *b,
         {
             new_capacity *= GROWTH_FACTOR;
         }
-        resize_job_buffer(b, new_capacity);
+        if (resize_job_buffer(b, new_capacity) != 0)
+        {
+            b->error = -ENOMEM;
+            return b->error;
+        }
     }
 
     memcpy(b->data + b->size, text, text_len);
     b->data[b->size + text_len] = '\0';
     b->size += text_len;
+    return 0;
+}
+
+/**
+ * @brief append text to a DynamicJobBuffer as the contents of a
+ *        JSON string, without the quotes.
+ * 
+ * Keys and values can come from users, e.g. the names of cgroups,
+ * so '"' and '\' are escaped, and bytes below 0x20 are written
+ * as \u00XX, to keep the document valid.
+ * 
+ * @param b - the DynamicJobBuffer to append to
+ * @param text - text to append to b
+ */
+static
+void
+job_append_json_string(DynamicJobBuffer* b,
+                       const char* text)
+{
+    const char* run = text;                     // start of the bytes not written yet
+    const char* p;
+
+    for (p = text; *p != '\0'; p++)
+    {
+        unsigned char c = *p;
+        char escaped[8];
+
+        if (c != '"' && c != '\\' && c >= 0x20)
+            continue;
+
+        job_buffer_append_len(b, run, p - run);
+        if (c == '"' || c == '\\')
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        else
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        append_to_job_buffer(b, escaped);
+        run = p + 1;
+    }
+    job_buffer_append_len(b, run, p - run);
 }
 
 /**
@@ -135,203 +301,1872 @@ free_job_buffer(DynamicJobBuffer *b)
 }
 
 /**
- * @brief Initialize a step with Step.next==NULL
- *
- * @param get_kvp the get_kvp function to initialize the step.
- * @return Step* - pointer to the initialized step.
+ * @brief run steps in a Job.
  * 
- * @return NULL if step init failed.
+ * Runs the job (gets the key-value information for each step)
+ * and writes the contents to a buffer 'target_buf'.
+ *
+ * @param j - pointer to the job to run.
+ * @return string buffer that contains job data in key-value form.
+ *
+ * WARNING: It is the responsibility of the caller to free
+ * the memory of the returned buffer.
  */
-Step*
-step_init(key_value_pair (*get_kvp)(void))
+char*
+run_job(const Job* j)
 {
-    Step* step;
-    step = (Step*) kmalloc(sizeof(Step), GFP_KERNEL);
-    if (step == NULL)
+    JobResult* result = collect_job(j);
+    if (result == NULL)
+    {
         return NULL;
-    step->next = NULL;
-    step->get_kvp = get_kvp;
-    return step;
-}
+    }
 
-/**
- * @brief Initialize a job, by title and first function to run in the job.
- *
- * @param title The title of the Job to initialize.
- * @param head_func the function for the first step in the Job.
- * @return a pointer to the initialized Job,
- *         NULL if job_init failed
- */
-Job*
-job_init(char* title,
-         key_value_pair (*head_func)(void))
-{
-    // kmalloc new Job.
-    Job* job = (Job*)kmalloc(sizeof(Job), GFP_KERNEL);
-    // if failure in kmalloc return NULL.
-    if (job == NULL)
-        return NULL;
+    char* data = serialize_job_result(result, NULL);
+    free_job_result(result);
 
-    // set title of job.
-    job->job_title = title;
+    return data;
+}
 
-    // initialize step for head_step of job.
-    Step* head_step = step_init(head_func);
-    if (head_step == NULL)
-        return NULL;
+/**
+ * @brief run one step and store its value.
+ * 
+ * @param j - the job the step belongs to.
+ * @param step - the step to run.
+ * @param ctx - what the job is collected for, NULL if nothing.
+ * @param kvp - set to the value of the step.
+ * @param step_ns - set to the time the step took.
+ */
+static
+void
+job_run_step(const Job* j,
+             const Step* step,
+             const JobContext* ctx,
+             key_value_pair* kvp,
+             u64* step_ns)
+{
+    u64 step_start_ns = ktime_get_ns();
 
-    // set job.head to head_step.
-    job->head=head_step;
+    if (step->emit != NULL)
+    {
+        JobEmitter e = { .stack = { kvp }, .ctx = ctx };
+        kvp->type = step->type;
+        step->emit(&e);
+        if (e.error || e.depth != 0)
+            pr_err("Step %s of job %s emitted an incomplete value (%d)\n",
+                   step->key, j->job_title, e.error ? e.error : -EINVAL);
+    }
+    else if (step->ctx_handler != NULL)
+    {
+        kvp->value = step->ctx_handler(ctx);
+    }
+    else
+    {
+        kvp->value = step->handler();
+    }
+    *step_ns = ktime_get_ns() - step_start_ns;
 
-    job->step_count = 1;
-    return job;
+    kvp->key = step->key;
+    kvp->unit = step->unit;
+    kvp->type = step->type;
+    kvp->counter = step->flags & JOB_FLAG_COUNTER;
+    trace_sysinfo_step(j->job_title, kvp->key, *step_ns);
 }
 
 /**
- * @brief Add a step to the job.
+ * @brief Free the value and children of a key_value_pair, and
+ *        clear it.
  * 
- * @param job - the job to add the function pointer to.
- * @param get_kvp_func - the function for the step to add
+ * @param kvp - the key_value_pair.
  */
 void
-append_step_to_job(Job* job,
-                   key_value_pair (*get_kvp_func)(void))
+job_free_kvp(key_value_pair* kvp)
+{
+    kfree(kvp->value);
+    job_free_children(kvp);
+    memset(kvp, 0, sizeof(key_value_pair));
+}
+
+/**
+ * @brief copy a key_value_pair, with its value and children.
+ * 
+ * @param dst - set to the copy. Free it with job_free_kvp(), also
+ *              on error.
+ * @param src - the key_value_pair to copy.
+ * @return 0 on success, -ENOMEM on allocation failure.
+ */
+static
+int
+job_copy_kvp(key_value_pair* dst,
+             const key_value_pair* src)
 {
-    // initialize cur as job.head
-    Step* cur = job->head;
+    *dst = *src;
+    dst->value = NULL;
+    dst->children = NULL;
+    dst->child_count = 0;
 
-    while (cur->next != NULL)       // until cur.next is a NULL pointer
+    if (src->value != NULL)
     {
-        cur = cur->next;            // ... walk the job.
+        dst->value = kstrdup(src->value, GFP_KERNEL);
+        if (dst->value == NULL)
+            return -ENOMEM;
     }
-    
-    if (get_kvp_func == NULL)
+
+    if (src->child_count == 0)
+        return 0;
+
+    dst->children = kcalloc(src->child_count, sizeof(key_value_pair), GFP_KERNEL);
+    if (dst->children == NULL)
+        return -ENOMEM;
+
+    for (int i = 0; i < src->child_count; i++)
     {
-        pr_err("get_kvp_func == NULL\n");
-        return;
+        dst->child_count++;
+        if (job_copy_kvp(&dst->children[i], &src->children[i]) != 0)
+            return -ENOMEM;
     }
 
-    // create the step to append
-    Step* p_step_to_add = step_init(get_kvp_func);
-    if (p_step_to_add == NULL)
+    return 0;
+}
+
+/**
+ * @brief keep a value as the last good value of a step.
+ * 
+ * Called with job_budget_mutex held. Values from steps that
+ * failed are dropped, and the previous good value is kept.
+ * 
+ * @param state - state of the step.
+ * @param kvp - the value, owned by the state afterwards.
+ */
+static
+void
+job_budget_keep(StepState* state,
+                key_value_pair* kvp)
+{
+    if (!job_kvp_has_value(kvp))
     {
-        pr_err("Pointer to step to add is NULL\n");
+        job_free_kvp(kvp);
+        return;
+    }
+
+    if (state->has_last)
+        job_free_kvp(&state->last);
+    state->last = *kvp;
+    state->has_last = true;
+}
+
+/**
+ * @brief run one attempt at a step with a time budget.
+ */
+static
+void
+job_budget_work_fn(struct work_struct *work)
+{
+    struct job_budget_work* w = container_of(work, struct job_budget_work, work);
+
+    job_run_step(w->job, w->step, w->has_ctx ? &w->ctx : NULL, &w->kvp, &w->step_ns);
+    complete(&w->done);
+}
+
+/**
+ * @brief drop a reference to an attempt, and free it with the last.
+ * 
+ * Called with job_budget_mutex held.
+ * 
+ * @param w - the attempt.
+ */
+static
+void
+job_budget_put(struct job_budget_work* w)
+{
+    if (--w->refs > 0)
+        return;
+
+    job_free_kvp(&w->kvp);
+    kfree(w);
+}
+
+/**
+ * @brief keep the value of an attempt that has returned as the last
+ *        good value of its step, and drop it from the step's state.
+ *        Does nothing if another collector already did.
+ * 
+ * Called with job_budget_mutex held.
+ * 
+ * @param state - state of the step.
+ * @param w - the attempt, which has returned.
+ */
+static
+void
+job_budget_retire(StepState* state,
+                  struct job_budget_work* w)
+{
+    if (state->pending != w)
         return;
+
+    w->failed = !job_kvp_has_value(&w->kvp);
+    job_budget_keep(state, &w->kvp);
+    w->kvp = (key_value_pair){ };
+    state->pending = NULL;
+    job_budget_put(w);
+}
+
+/**
+ * @brief check whether a step runs within a time budget. Budgets
+ *        are shared by every collector, so a job collected for a
+ *        reader runs its steps without them.
+ */
+static
+bool
+job_step_budgeted(const Job* j,
+                  int index,
+                  const JobContext* ctx)
+{
+    return j->state != NULL && j->steps[index].budget_ms > 0 &&
+           (ctx == NULL || ctx->reader == NULL);
+}
+
+/**
+ * @brief start an attempt at a step with a time budget, or join
+ *        the one that is running.
+ * 
+ * A running attempt is joined while it is within its budget, so
+ * every collector waits for it until the same deadline. One that
+ * ran over is not joined, and collectors are served the step's
+ * last good value until it returns. An attempt runs with the
+ * context of the collector that started it.
+ * 
+ * @param j - the job the step belongs to.
+ * @param index - index of the step in the job.
+ * @param ctx - what the job is collected for, NULL if nothing.
+ * 
+ * @return the attempt, to pass to job_budget_wait(), or NULL to
+ *         serve the last good value.
+ */
+static
+struct job_budget_work*
+job_budget_start(const Job* j,
+                 int index,
+                 const JobContext* ctx)
+{
+    const Step* step = &j->steps[index];
+    StepState* state = &j->state[index];
+    struct job_budget_work* attempt = NULL;
+    bool queue = false;
+    u64 now_ns = ktime_get_ns();
+
+    mutex_lock(&job_budget_mutex);
+    if (state->pending != NULL && completion_done(&state->pending->done))
+    {
+        // the attempt that ran over has returned, keep its value and try again
+        job_budget_retire(state, state->pending);
     }
-    cur->next = p_step_to_add;
 
-    if (cur->next == NULL)
+    if (state->pending != NULL)
+    {
+        if (now_ns < state->pending->deadline_ns)
+        {
+            attempt = state->pending;
+            attempt->refs++;
+        }
+    }
+    else
     {
-        pr_err("End of the list reached.\n");
-        pr_err("kvp_of cur (expected to be last) is: %s:%s.\n", cur->get_kvp().key, cur->get_kvp().value);
+        // without memory for an attempt, the last good value is served
+        attempt = kzalloc(sizeof(struct job_budget_work), GFP_KERNEL);
+        if (attempt != NULL)
+        {
+            attempt->job = j;
+            attempt->step = step;
+            if (ctx != NULL)
+            {
+                attempt->ctx = *ctx;
+                attempt->has_ctx = true;
+            }
+            attempt->deadline_ns = now_ns + (u64)step->budget_ms * NSEC_PER_MSEC;
+            attempt->refs = 2;
+            init_completion(&attempt->done);
+            INIT_WORK(&attempt->work, job_budget_work_fn);
+            state->pending = attempt;
+            queue = true;
+        }
     }
+    mutex_unlock(&job_budget_mutex);
+
+    if (queue)
+        queue_work(system_unbound_wq, &attempt->work);
 
-    job->step_count++;
-    return;
+    return attempt;
 }
 
 /**
- * @brief run steps in a Job.
+ * @brief wait for an attempt at a step with a time budget until its
+ *        deadline, and take the step's value.
  * 
- * Runs the job (gets the key-value information for each step)
- * and writes the contents to a buffer 'target_buf'.
- *
- * @param j - pointer to the job to run.
- * @return string buffer that contains job data in key-value form.
- *
- * WARNING: It is the responsibility of the caller to free
- * the memory of the returned buffer.
+ * If the attempt returned in time, its value is used. Otherwise
+ * the step's last good value is, marked stale, and the attempt
+ * carries on in the background, owned by the step's state. Its
+ * value becomes the last good value once it returns.
+ * 
+ * @param j - the job the step belongs to.
+ * @param index - index of the step in the job.
+ * @param attempt - from job_budget_start(), dropped by this.
+ * @param kvp - set to the value of the step.
+ * @param step_ns - set to the time the step took, or was waited for.
+ * @param start_ns - when the collector started on the step.
  */
-char*
-run_job(Job* j)
+static
+void
+job_budget_wait(const Job* j,
+                int index,
+                struct job_budget_work* attempt,
+                key_value_pair* kvp,
+                u64* step_ns,
+                u64 start_ns)
 {
-    if (j == NULL)
+    const Step* step = &j->steps[index];
+    StepState* state = &j->state[index];
+    bool fresh = false;
+    u64 now_ns = ktime_get_ns();
+
+    if (attempt != NULL && now_ns < attempt->deadline_ns)
+        wait_for_completion_timeout(&attempt->done, nsecs_to_jiffies(attempt->deadline_ns - now_ns));
+
+    mutex_lock(&job_budget_mutex);
+    if (attempt != NULL && completion_done(&attempt->done))
     {
-        return NULL;
+        job_budget_retire(state, attempt);
+        fresh = true;
+        *step_ns = attempt->step_ns;
     }
 
-    DynamicJobBuffer* target_buf = init_job_buffer();
+    // a step that failed has no value, like a step without a budget
+    if (!(fresh && attempt->failed) &&
+        state->has_last && job_copy_kvp(kvp, &state->last) != 0)
+        job_free_kvp(kvp);
 
-    int run_count = 0;
+    if (attempt != NULL)
+        job_budget_put(attempt);
+    mutex_unlock(&job_budget_mutex);
 
-    append_to_job_buffer(target_buf, "{");
-    Step* cur = j->head;
-    while (cur != NULL)
+    kvp->key = step->key;
+    kvp->unit = step->unit;
+    kvp->type = step->type;
+    kvp->counter = step->flags & JOB_FLAG_COUNTER;
+    kvp->stale = !fresh;
+    if (!fresh)
+        *step_ns = ktime_get_ns() - start_ns;
+}
+
+/**
+ * @brief run one step of a job, within its budget if it has one.
+ * 
+ * @param j - the job the step belongs to.
+ * @param index - index of the step in the job.
+ * @param ctx - what the job is collected for, NULL if nothing.
+ * @param r - the result to store the step's value in.
+ */
+static
+void
+job_collect_step(const Job* j,
+                 int index,
+                 const JobContext* ctx,
+                 JobResult* r)
+{
+    u64 start_ns = ktime_get_ns();
+
+    if (job_step_budgeted(j, index, ctx))
+        job_budget_wait(j, index, job_budget_start(j, index, ctx), &r->kvps[index], &r->step_ns[index], start_ns);
+    else
+        job_run_step(j, &j->steps[index], ctx, &r->kvps[index], &r->step_ns[index]);
+}
+
+/**
+ * @brief run a step queued by collect_job().
+ */
+static
+void
+job_step_work_fn(struct work_struct *work)
+{
+    struct job_step_work* w = container_of(work, struct job_step_work, work);
+
+    job_collect_step(w->job, w->index, w->ctx, w->result);
+}
+
+/**
+ * @brief Wait for steps of a job that ran over their budget, and
+ *        keep their values as the last good values, e.g. so that
+ *        the next run of the job is served them.
+ * 
+ * @param j - the job.
+ */
+void
+job_wait_budgets(const Job* j)
+{
+    if (j == NULL || j->state == NULL)
+        return;
+
+    for (int i = 0; i < j->step_count; i++)
     {
-        key_value_pair cur_kvp = cur->get_kvp();
-        append_to_job_buffer(target_buf, "\"");
-        append_to_job_buffer(target_buf, cur_kvp.key);
-        append_to_job_buffer(target_buf, "\"");
-        append_to_job_buffer(target_buf, ":");
-        append_to_job_buffer(target_buf, "\"");
-        append_to_job_buffer(target_buf, cur_kvp.value);
-        append_to_job_buffer(target_buf, "\"");
-        if (cur->next != NULL)
-            append_to_job_buffer(target_buf, ",");
-        run_count++;
-        cur = cur->next;
-    }
+        StepState* state = &j->state[i];
+        struct job_budget_work* w;
 
-    append_to_job_buffer(target_buf, "}");
+        mutex_lock(&job_budget_mutex);
+        w = state->pending;
+        if (w != NULL)
+            w->refs++;
+        mutex_unlock(&job_budget_mutex);
 
-    return target_buf->data;
+        if (w == NULL)
+            continue;
+
+        wait_for_completion(&w->done);
+        mutex_lock(&job_budget_mutex);
+        job_budget_retire(state, w);
+        job_budget_put(w);
+        mutex_unlock(&job_budget_mutex);
+    }
 }
 
 /**
- * @brief Get a pointer to the job for the current_info_type.
+ * @brief Wait for steps of a job that ran over their budget, and
+ *        free their last good values.
  * 
- * @return pointer to the job for current_info_type.
+ * @param j - the job, which nothing may be collecting.
  */
-Job*
-get_current_job(void)
+void
+job_flush_budgets(const Job* j)
 {
-    printk(KERN_DEBUG "get_current_job called\n");
-    Job* current_job;
-    
-    switch (current_info_type)
+    if (j == NULL || j->state == NULL)
+        return;
+
+    for (int i = 0; i < j->step_count; i++)
     {
-        case CPU:
-            current_job = get_cpu_job();
-            break;
-        case MEMORY:
-            current_job = get_memory_job();
-            break;
-        case DISK:
-            current_job = get_disk_job();
-            break;
-        default:
-            current_job = get_cpu_job();
-            break;
+        StepState* state = &j->state[i];
+        struct job_budget_work* w;
+
+        mutex_lock(&job_budget_mutex);
+        w = state->pending;
+        state->pending = NULL;
+        mutex_unlock(&job_budget_mutex);
+
+        if (w != NULL)
+        {
+            // wait for the step to return, it may belong to a module being unloaded
+            flush_work(&w->work);
+            mutex_lock(&job_budget_mutex);
+            job_budget_put(w);
+            mutex_unlock(&job_budget_mutex);
+        }
+
+        mutex_lock(&job_budget_mutex);
+        if (state->has_last)
+            job_free_kvp(&state->last);
+        state->has_last = false;
+        mutex_unlock(&job_budget_mutex);
     }
-    return current_job;
 }
 
 /**
- * @brief set the current_info_type of the Job
+ * @brief run each step in a Job and collect the results.
+ * 
+ * Steps with JOB_FLAG_ASYNC are queued on a workqueue first, and
+ * steps with a time budget are started on it, the other steps then
+ * run in order on the calling task, and the queued and budgeted
+ * steps are waited for at the end. A budgeted step is queued once,
+ * whether or not it is also async. Every step writes its own
+ * key_value_pair, so the result is in step order either way.
  * 
- * Set the value of the current info type to 1 of
- * 3 values:
+ * @param j - pointer to the job to run.
+ * @return JobResult* - the collected values, NULL on error.
+ *
+ * WARNING: It is the responsibility of the caller to free
+ * the returned JobResult with free_job_result().
+ */
+JobResult*
+collect_job(const Job* j)
+{
+    return collect_job_ctx(j, NULL);
+}
+
+/**
+ * @brief run each step in a Job for a context, and collect the
+ *        results, as collect_job() does.
  * 
- * 1. CPU
- * 2. MEMORY
- * 3. DISK
+ * The context is passed to the steps through their JobEmitter, or
+ * to their ctx_handler. A job collected for a reader runs its
+ * steps without their budgets, as the last good values are shared.
  * 
- * @return 0 if success, -1 on error.
+ * @param j - pointer to the job to run.
+ * @param ctx - what the job is collected for, NULL if nothing. It
+ *              must outlive the call.
+ * @return JobResult* - the collected values, NULL on error.
  */
-int
-set_current_info_type(int value)
+JobResult*
+collect_job_ctx(const Job* j,
+                const JobContext* ctx)
 {
-    printk("Attempting to set ioctl val to: %d\n", value);
-    if (value <=3 && value >=1)
+    struct job_step_work* works = NULL;
+    JobResult* r;
+    u64 job_start_ns;
+    int deferred_count = 0;
+    int queued = 0;
+
+    if (j == NULL)
     {
-        printk("value <=3 && value >=1\n");
-        current_info_type = value;
-        return 0;
+        return NULL;
     }
-    else
+
+    r = kmalloc(sizeof(JobResult), GFP_KERNEL);
+    if (r == NULL)
+    {
+        return NULL;
+    }
+
+    r->kvps = kcalloc(j->step_count, sizeof(key_value_pair), GFP_KERNEL);
+    r->step_ns = kcalloc(j->step_count, sizeof(u64), GFP_KERNEL);
+    if (r->kvps == NULL || r->step_ns == NULL)
     {
-        return -EFAULT;
+        kfree(r->kvps);
+        kfree(r->step_ns);
+        kfree(r);
+        return NULL;
+    }
+    r->job_title = j->job_title;
+    r->kvp_count = 0;
+    r->seq = 0;
+
+    trace_sysinfo_job_start(j->job_title, j->step_count);
+    job_start_ns = ktime_get_ns();
+    r->timestamp_ns = job_start_ns;
+    r->realtime_ns = ktime_get_real_ns();
+
+    for (int i = 0; i < j->step_count; i++)
+    {
+        if ((j->steps[i].flags & JOB_FLAG_ASYNC) || job_step_budgeted(j, i, ctx))
+            deferred_count++;
     }
+
+    // without work items, the deferred steps run in order with the others
+    if (deferred_count > 0)
+        works = kcalloc(deferred_count, sizeof(struct job_step_work), GFP_KERNEL);
+
+    for (int i = 0; works != NULL && i < j->step_count; i++)
+    {
+        struct job_step_work* w;
+
+        if (!(j->steps[i].flags & JOB_FLAG_ASYNC) && !job_step_budgeted(j, i, ctx))
+            continue;
+
+        w = &works[queued++];
+        w->job = j;
+        w->ctx = ctx;
+        w->result = r;
+        w->index = i;
+        if (job_step_budgeted(j, i, ctx))
+        {
+            // the attempt runs on the workqueue itself
+            w->attempt = job_budget_start(j, i, ctx);
+            continue;
+        }
+        INIT_WORK(&w->work, job_step_work_fn);
+        queue_work(system_unbound_wq, &w->work);
+    }
+
+    for (int i = 0; i < j->step_count; i++)
+    {
+        if (works != NULL && ((j->steps[i].flags & JOB_FLAG_ASYNC) || job_step_budgeted(j, i, ctx)))
+            continue;
+
+        job_collect_step(j, i, ctx, r);
+    }
+
+    // join the queued steps, budgeted ones until their deadline
+    for (int i = 0; i < queued; i++)
+    {
+        struct job_step_work* w = &works[i];
+
+        if (job_step_budgeted(j, w->index, ctx))
+            job_budget_wait(j, w->index, w->attempt, &r->kvps[w->index], &r->step_ns[w->index], job_start_ns);
+        else
+            flush_work(&w->work);
+    }
+    kfree(works);
+    r->kvp_count = j->step_count;
+
+    r->duration_ns = ktime_get_ns() - job_start_ns;
+    trace_sysinfo_job_end(j->job_title, r->kvp_count, r->duration_ns);
+
+    return r;
+}
+
+/**
+ * @brief fill in the slot of the CPU this runs on.
+ * 
+ * @param info - the struct job_per_cpu_call.
+ */
+static
+void
+job_per_cpu_fn(void* info)
+{
+    struct job_per_cpu_call* call = info;
+
+    call->fn(call->slots + smp_processor_id() * call->slot_size);
+}
+
+/**
+ * @brief read values of every online CPU on that CPU.
+ * 
+ * @param fn - fills in the slot of the CPU it runs on, from an
+ *             IPI, so it must not sleep or allocate.
+ * @param slot_size - size of one CPU's slot.
+ * 
+ * @return array of nr_cpu_ids slots, indexed by CPU, NULL on
+ *         allocation failure. Slots of CPUs that were offline
+ *         are zeroed.
+ */
+void*
+job_collect_per_cpu(void (*fn)(void* slot),
+                    size_t slot_size)
+{
+    struct job_per_cpu_call call = {
+        .fn = fn,
+        .slots = kcalloc(nr_cpu_ids, slot_size, GFP_KERNEL),
+        .slot_size = slot_size,
+    };
+
+    if (call.slots == NULL)
+        return NULL;
+
+    // runs fn on this CPU too, and waits for every CPU to finish
+    on_each_cpu(job_per_cpu_fn, &call, 1);
+
+    return call.slots;
+}
+
+/**
+ * @brief Free a JobResult and the values it owns.
+ * 
+ * @param r - the JobResult to free.
+ */
+void
+free_job_result(JobResult* r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        kfree(r->kvps[i].value);
+        job_free_children(&r->kvps[i]);
+    }
+    kfree(r->kvps);
+    kfree(r->step_ns);
+    kfree(r);
+}
+
+/**
+ * @brief Copy a JobResult and the values it owns, e.g. to change
+ *        some of its values for one reader.
+ * 
+ * @param r - the JobResult to copy.
+ * 
+ * @return the copy, freed with free_job_result(), NULL on
+ *         allocation failure.
+ */
+JobResult*
+copy_job_result(const JobResult* r)
+{
+    JobResult* copy = kmalloc(sizeof(JobResult), GFP_KERNEL);
+    if (copy == NULL)
+        return NULL;
+
+    *copy = *r;
+    copy->kvp_count = 0;
+    copy->kvps = kcalloc(max(r->kvp_count, 1), sizeof(key_value_pair), GFP_KERNEL);
+    copy->step_ns = kcalloc(max(r->kvp_count, 1), sizeof(u64), GFP_KERNEL);
+    if (copy->kvps == NULL || copy->step_ns == NULL)
+    {
+        free_job_result(copy);
+        return NULL;
+    }
+
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        copy->kvp_count++;
+        copy->step_ns[i] = r->step_ns[i];
+        if (job_copy_kvp(&copy->kvps[i], &r->kvps[i]) != 0)
+        {
+            free_job_result(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+/**
+ * @brief free the children of an object or array, recursively.
+ * 
+ * @param kvp - the object or array.
+ */
+static
+void
+job_free_children(key_value_pair* kvp)
+{
+    for (int i = 0; i < kvp->child_count; i++)
+    {
+        kfree(kvp->children[i].value);
+        job_free_children(&kvp->children[i]);
+    }
+    kfree(kvp->children);
+    kvp->children = NULL;
+    kvp->child_count = 0;
+}
+
+/**
+ * @brief add an empty child to the object or array being emitted.
+ * 
+ * Children are kept in an array that doubles in size whenever
+ * child_count reaches a power of two (4 or more).
+ * 
+ * @param e - the emitter.
+ * @param key - name of the child, NULL in arrays.
+ * @param type - JOB_VALUE_* type of the child.
+ * @return pointer to the child, NULL on error.
+ */
+static
+key_value_pair*
+job_emit_child(JobEmitter* e,
+               const char* key,
+               int type)
+{
+    key_value_pair* parent = e->stack[e->depth];
+    int count = parent->child_count;
+
+    if (e->error)
+        return NULL;
+
+    if (count == 0 || (count >= 4 && (count & (count - 1)) == 0))
+    {
+        int capacity = count == 0 ? 4 : count * 2;
+        key_value_pair* children = krealloc(parent->children,
+                                            capacity * sizeof(key_value_pair),
+                                            GFP_KERNEL);
+        if (children == NULL)
+        {
+            e->error = -ENOMEM;
+            return NULL;
+        }
+        parent->children = children;
+    }
+
+    key_value_pair* child = &parent->children[count];
+    memset(child, 0, sizeof(key_value_pair));
+    child->key = parent->type == JOB_VALUE_ARRAY ? NULL : key;
+    child->type = type;
+    parent->child_count++;
+
+    return child;
+}
+
+/**
+ * @brief Add a value to the object or array being emitted.
+ * 
+ * @param e - the emitter passed to the step.
+ * @param key - name of the value, a string that outlives the
+ *              JobResult (e.g. a literal). Ignored in arrays.
+ * @param value - the value, heap allocated. The emitter takes
+ *                ownership, even on error. NULL values are left
+ *                out of the output.
+ * @param type - JOB_VALUE_STRING or JOB_VALUE_NUMBER.
+ * @param unit - unit of the value, NULL if it has none.
+ */
+void
+job_emit_value(JobEmitter* e,
+               const char* key,
+               char* value,
+               int type,
+               const char* unit)
+{
+    key_value_pair* child = job_emit_child(e, key, type);
+    if (child == NULL)
+    {
+        kfree(value);
+        return;
+    }
+
+    child->value = value;
+    child->unit = unit;
+}
+
+/**
+ * @brief Add a number that only grows, e.g. a time or an event
+ *        count, to the object or array being emitted. It is
+ *        written as a counter in Prometheus output.
+ * 
+ * @param e - the emitter passed to the step.
+ * @param key - name of the value, as for job_emit_value().
+ * @param value - the value, heap allocated, as for job_emit_value().
+ * @param unit - unit of the value, NULL if it has none.
+ */
+void
+job_emit_counter(JobEmitter* e,
+                 const char* key,
+                 char* value,
+                 const char* unit)
+{
+    key_value_pair* child = job_emit_child(e, key, JOB_VALUE_NUMBER);
+    if (child == NULL)
+    {
+        kfree(value);
+        return;
+    }
+
+    child->value = value;
+    child->unit = unit;
+    child->counter = true;
+}
+
+/**
+ * @brief Open a nested object or array, closed with job_emit_end().
+ * 
+ * @param e - the emitter passed to the step.
+ * @param key - name of the object or array. Ignored in arrays.
+ * @param type - JOB_VALUE_OBJECT or JOB_VALUE_ARRAY.
+ */
+void
+job_emit_begin(JobEmitter* e,
+               const char* key,
+               int type)
+{
+    key_value_pair* child;
+
+    if (e->depth >= JOB_EMIT_MAX_DEPTH)
+    {
+        e->error = -EINVAL;
+        return;
+    }
+
+    child = job_emit_child(e, key, type);
+    if (child == NULL)
+        return;
+
+    e->stack[++e->depth] = child;
+}
+
+/**
+ * @brief Close the object or array opened by the last job_emit_begin().
+ * 
+ * @param e - the emitter passed to the step.
+ */
+void
+job_emit_end(JobEmitter* e)
+{
+    if (e->depth == 0)
+    {
+        e->error = -EINVAL;
+        return;
+    }
+
+    e->depth--;
+}
+
+/**
+ * @brief check whether a value is written to the output.
+ * 
+ * Steps that failed to produce a value are left out. Objects and
+ * arrays are always written, even when empty.
+ */
+static
+bool
+job_kvp_has_value(const key_value_pair* kvp)
+{
+    if (kvp->type == JOB_VALUE_OBJECT || kvp->type == JOB_VALUE_ARRAY)
+        return true;
+
+    return kvp->value != NULL;
+}
+
+/**
+ * @brief write a value as JSON, with the children of objects and
+ * arrays written recursively.
+ * 
+ * @param b - the buffer to write to.
+ * @param kvp - the value to write.
+ */
+static
+void
+job_serialize_value(DynamicJobBuffer* b,
+                    const key_value_pair* kvp)
+{
+    bool object = kvp->type == JOB_VALUE_OBJECT;
+    int written = 0;
+
+    if (!object && kvp->type != JOB_VALUE_ARRAY)
+    {
+        append_to_job_buffer(b, "\"");
+        job_append_json_string(b, kvp->value);
+        if (kvp->unit != NULL)
+        {
+            append_to_job_buffer(b, " ");
+            job_append_json_string(b, kvp->unit);
+        }
+        append_to_job_buffer(b, "\"");
+        return;
+    }
+
+    append_to_job_buffer(b, object ? "{" : "[");
+    for (int i = 0; i < kvp->child_count; i++)
+    {
+        const key_value_pair* child = &kvp->children[i];
+
+        if (!job_kvp_has_value(child) || (object && child->key == NULL))
+            continue;
+
+        if (written > 0)
+            append_to_job_buffer(b, ",");
+        if (object)
+        {
+            append_to_job_buffer(b, "\"");
+            job_append_json_string(b, child->key);
+            append_to_job_buffer(b, "\":");
+        }
+        job_serialize_value(b, child);
+        written++;
+    }
+    append_to_job_buffer(b, object ? "}" : "]");
+}
+
+/**
+ * @brief write the metadata of a sample as JSON members.
+ * 
+ * Numbers are written as strings, like the values, so that
+ * nanosecond times keep their precision in every JSON parser.
+ * 
+ * @param b - the buffer to write to.
+ * @param r - the sample's JobResult.
+ */
+static
+void
+job_serialize_meta(DynamicJobBuffer* b,
+                   const JobResult* r)
+{
+    char meta[160];
+
+    snprintf(meta, sizeof(meta),
+             "\"" JOB_SEQ_KEY "\":\"%llu\","
+             "\"" JOB_MONOTONIC_KEY "\":\"%llu\","
+             "\"" JOB_REALTIME_KEY "\":\"%llu\","
+             "\"" JOB_DURATION_KEY "\":\"%llu\"",
+             (unsigned long long)r->seq,
+             (unsigned long long)r->timestamp_ns,
+             (unsigned long long)r->realtime_ns,
+             (unsigned long long)r->duration_ns);
+    append_to_job_buffer(b, meta);
+}
+
+/**
+ * @brief Serialize a JobResult as a JSON object.
+ * 
+ * When d is not NULL, only values that differ from the last
+ * values sent against d are written, unless a keyframe is due.
+ * 
+ * @param r - the JobResult to serialize.
+ * @param d - delta state for the reader, or NULL to serialize
+ *            every value.
+ * @return string buffer that contains job data in key-value form,
+ *         NULL on error.
+ *
+ * WARNING: It is the responsibility of the caller to free
+ * the memory of the returned buffer.
+ */
+char*
+serialize_job_result(JobResult* r,
+                     JobDelta* d)
+{
+    if (r == NULL)
+    {
+        return NULL;
+    }
+
+    bool keyframe = (d == NULL) || job_delta_needs_keyframe(d, r);
+
+    // start at the size of the largest document so far, so the buffer rarely grows
+    DynamicJobBuffer buf;
+    DynamicJobBuffer* target_buf = &buf;
+    if (job_buffer_setup(target_buf, READ_ONCE(job_buffer_hint)) != 0)
+        return NULL;
+
+    int written = 0;
+
+    append_to_job_buffer(target_buf, "{");
+    if (r->seq != 0)
+    {
+        // sample metadata, sent in every document so readers can compute rates
+        job_serialize_meta(target_buf, r);
+        written++;
+    }
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        key_value_pair* cur_kvp = &r->kvps[i];
+        bool scalar = cur_kvp->type != JOB_VALUE_OBJECT && cur_kvp->type != JOB_VALUE_ARRAY;
+
+        // skip steps that failed to produce a value
+        if (cur_kvp->key == NULL || !job_kvp_has_value(cur_kvp))
+            continue;
+
+        // skip values the reader has already been sent
+        if (scalar && !keyframe && d->last_values[i] != NULL &&
+            strcmp(d->last_values[i], cur_kvp->value) == 0)
+            continue;
+
+        ssize_t mark = target_buf->size;
+        if (written > 0)
+            append_to_job_buffer(target_buf, ",");
+        append_to_job_buffer(target_buf, "\"");
+        job_append_json_string(target_buf, cur_kvp->key);
+        append_to_job_buffer(target_buf, "\"");
+        append_to_job_buffer(target_buf, ":");
+        ssize_t value_start = target_buf->size;
+        job_serialize_value(target_buf, cur_kvp);
+
+        if (d != NULL && !scalar)
+        {
+            // objects and arrays are compared by their JSON text
+            const char* text = target_buf->data + value_start;
+
+            if (!keyframe && d->last_values[i] != NULL &&
+                strcmp(d->last_values[i], text) == 0)
+            {
+                target_buf->size = mark;
+                target_buf->data[mark] = '\0';
+                continue;
+            }
+            job_delta_remember(d, i, text);
+        }
+        else if (d != NULL)
+        {
+            job_delta_remember(d, i, cur_kvp->value);
+        }
+        written++;
+    }
+
+    // list the steps served from their last good value
+    int stale = 0;
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        if (!r->kvps[i].stale || r->kvps[i].key == NULL)
+            continue;
+
+        if (stale == 0)
+        {
+            if (written > 0)
+                append_to_job_buffer(target_buf, ",");
+            append_to_job_buffer(target_buf, "\"" JOB_STALE_KEY "\":[");
+        }
+        else
+        {
+            append_to_job_buffer(target_buf, ",");
+        }
+        append_to_job_buffer(target_buf, "\"");
+        job_append_json_string(target_buf, r->kvps[i].key);
+        append_to_job_buffer(target_buf, "\"");
+        stale++;
+    }
+    if (stale > 0)
+        append_to_job_buffer(target_buf, "]");
+    append_to_job_buffer(target_buf, "}");
+
+    if (target_buf->error)
+    {
+        // a delta reader is sent a full document next time
+        if (d != NULL)
+            d->run_count = 0;
+        free_job_buffer(target_buf);
+        return NULL;
+    }
+
+    if (d != NULL)
+        d->run_count++;
+
+    if (target_buf->size + 1 > READ_ONCE(job_buffer_hint))
+        WRITE_ONCE(job_buffer_hint, min_t(size_t, target_buf->size + 1, MAX_INITIAL_CAPACITY));
+
+    return target_buf->data;
+}
+
+/**
+ * @brief Initialize delta state for a reader.
+ * 
+ * @param keyframe_interval - send a full document every
+ *                            keyframe_interval runs (minimum 1).
+ * @return JobDelta* - the initialized delta state, NULL on error.
+ */
+JobDelta*
+job_delta_init(int keyframe_interval)
+{
+    JobDelta* d = kmalloc(sizeof(JobDelta), GFP_KERNEL);
+    if (d == NULL)
+    {
+        return NULL;
+    }
+
+    d->job_title = NULL;
+    d->last_values = NULL;
+    d->value_count = 0;
+    d->keyframe_interval = keyframe_interval < 1 ? 1 : keyframe_interval;
+    d->run_count = 0;
+
+    return d;
+}
+
+/**
+ * @brief Free delta state and the values it remembers.
+ * 
+ * @param d - the JobDelta to free.
+ */
+void
+free_job_delta(JobDelta* d)
+{
+    if (d == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < d->value_count; i++)
+    {
+        kfree(d->last_values[i]);
+    }
+    kfree(d->last_values);
+    kfree(d->job_title);
+    kfree(d);
+}
+
+/**
+ * @brief decide whether the next document for d must be a keyframe.
+ * 
+ * A keyframe is due every keyframe_interval runs, and whenever
+ * the remembered values belong to a different job (e.g. after the
+ * current category changed). In the latter case the remembered
+ * values are discarded and resized for r.
+ * 
+ * @param d - delta state for the reader.
+ * @param r - the JobResult about to be serialized.
+ * @return true if every value in r must be sent.
+ */
+static
+bool
+job_delta_needs_keyframe(JobDelta* d,
+                         JobResult* r)
+{
+    if (d->last_values != NULL &&
+        d->value_count == r->kvp_count &&
+        strcmp(d->job_title, r->job_title) == 0)
+    {
+        return d->run_count % d->keyframe_interval == 0;
+    }
+
+    // remembered values belong to another job, start again
+    for (int i = 0; i < d->value_count; i++)
+    {
+        kfree(d->last_values[i]);
+    }
+    kfree(d->last_values);
+    kfree(d->job_title);
+
+    d->value_count = 0;
+    d->run_count = 0;
+    d->last_values = NULL;
+    d->job_title = kstrdup(r->job_title, GFP_KERNEL);
+    if (d->job_title != NULL)
+        d->last_values = kcalloc(r->kvp_count, sizeof(char*), GFP_KERNEL);
+    if (d->last_values == NULL)
+    {
+        pr_err("Could not allocate delta state for job %s\n", r->job_title);
+        return true;
+    }
+    d->value_count = r->kvp_count;
+
+    return true;
+}
+
+/**
+ * @brief remember the value sent for a step.
+ * 
+ * @param d - delta state for the reader.
+ * @param index - index of the step in the job.
+ * @param value - value sent for the step.
+ */
+static
+void
+job_delta_remember(JobDelta* d,
+                   int index,
+                   const char* value)
+{
+    if (index >= d->value_count)
+    {
+        return;
+    }
+
+    kfree(d->last_values[index]);
+    // on allocation failure the value is sent again next run
+    d->last_values[index] = kstrdup(value, GFP_KERNEL);
+}
+
+/**
+ * A unit, and how values in it are written in Prometheus output,
+ * in the base unit Prometheus names use.
+ */
+struct job_prom_unit {
+    const char* unit;                           // unit of the step
+    const char* suffix;                         // suffix of the metric name
+    s64 multiplier;                             // values are multiplied by this
+    s64 divisor;                                // then divided by this, a power of 10
+    int decimals;                               // number of digits in divisor, less one
+};
+
+static const struct job_prom_unit job_prom_units[] = {
+    { "B", "bytes", 1, 1, 0 },
+    { "kB", "bytes", 1024, 1, 0 },
+    { "Hz", "hertz", 1, 1, 0 },
+    { "kHz", "hertz", 1000, 1, 0 },
+    { "MHz", "hertz", 1000000, 1, 0 },
+    { "s", "seconds", 1, 1, 0 },
+    { "ms", "seconds", 1, 1000, 3 },
+    { "us", "seconds", 1, 1000000, 6 },
+    { "ns", "seconds", 1, 1000000000, 9 },
+};
+
+/**
+ * A value written under a Prometheus metric name, with the labels
+ * of the objects and arrays it is in.
+ */
+struct job_prom_series {
+    const key_value_pair* kvp;
+    const char* labels;                         // e.g. cpu="0",index="1", "" for none
+};
+
+/**
+ * @brief append a name part to a Prometheus metric or label name.
+ * 
+ * Letters are lowercased, and anything other than a letter or
+ * digit becomes a single '_'.
+ * 
+ * @param name - the name to append to, joined to part with '_'
+ *               if not empty.
+ * @param size - size of name.
+ * @param part - the text to append.
+ */
+static
+void
+job_prom_append_name(char* name,
+                     size_t size,
+                     const char* part)
+{
+    size_t len = strlen(name);
+
+    if (len > 0 && len + 1 < size && name[len - 1] != '_')
+        name[len++] = '_';
+
+    for (; *part != '\0' && len + 1 < size; part++)
+    {
+        char c = *part;
+
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        else if (!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9'))
+            c = '_';
+
+        if (c == '_' && len > 0 && name[len - 1] == '_')
+            continue;
+        name[len++] = c;
+    }
+    name[len] = '\0';
+}
+
+/**
+ * @brief add a label to a list of Prometheus labels.
+ * 
+ * @param labels - comma separated labels to add to.
+ * @param size - size of labels.
+ * @param key - name of the label, made a valid label name.
+ * @param value - value of the label, escaped.
+ * @return 0 on success, -E2BIG if labels is too small.
+ */
+static
+int
+job_prom_add_label(char* labels,
+                   size_t size,
+                   const char* key,
+                   const char* value)
+{
+    char name[JOB_PROM_NAME_LEN] = "";
+    size_t len = strlen(labels);
+
+    job_prom_append_name(name, sizeof(name), key);
+    len += snprintf(labels + len, size - len, "%s%s=\"", len > 0 ? "," : "", name);
+
+    for (; *value != '\0' && len + 4 < size; value++)
+    {
+        if (*value == '\\' || *value == '"')
+        {
+            labels[len++] = '\\';
+            labels[len++] = *value;
+        }
+        else if (*value == '\n')
+        {
+            labels[len++] = '\\';
+            labels[len++] = 'n';
+        }
+        else
+        {
+            labels[len++] = *value;
+        }
+    }
+
+    if (*value != '\0' || len + 2 > size)
+        return -E2BIG;
+    labels[len++] = '"';
+    labels[len] = '\0';
+
+    return 0;
+}
+
+/**
+ * @brief format a number in the base unit of its metric.
+ * 
+ * @param out - set to the number as text.
+ * @param size - size of out.
+ * @param value - the value, a decimal number.
+ * @param u - the unit of the value.
+ * @return true if the value could be written.
+ */
+static
+bool
+job_prom_format_number(char* out,
+                       size_t size,
+                       const char* value,
+                       const struct job_prom_unit* u)
+{
+    s64 v;
+
+    if (kstrtos64(value, 10, &v) != 0)
+    {
+        // not an integer, which can only be written as it is
+        if (u->multiplier != 1 || u->divisor != 1 || value[0] == '\0' ||
+            strspn(value, "0123456789.eE+-") != strlen(value))
+            return false;
+        snprintf(out, size, "%s", value);
+        return true;
+    }
+
+    v *= u->multiplier;
+    if (u->divisor == 1)
+    {
+        snprintf(out, size, "%lld", (long long)v);
+    }
+    else
+    {
+        u64 magnitude = v < 0 ? -(u64)v : (u64)v;
+
+        snprintf(out, size, "%s%llu.%0*llu", v < 0 ? "-" : "",
+                 (unsigned long long)(magnitude / u->divisor), u->decimals,
+                 (unsigned long long)(magnitude % u->divisor));
+    }
+    return true;
+}
+
+/**
+ * @brief check whether two values have the same unit.
+ */
+static
+bool
+job_prom_same_unit(const char* a,
+                   const char* b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+
+    return strcmp(a, b) == 0;
+}
+
+static void job_prom_write(DynamicJobBuffer* b, const char* title, const char* path, const char* name, const struct job_prom_series* set, int n, int indexes);
+
+/**
+ * @brief write the scalar values of a set of series as one metric.
+ * 
+ * Numbers are written in the base unit of the metric, as a counter
+ * with a _total suffix if they only grow, and a gauge otherwise.
+ * Strings are written as an info metric, with the text as a label
+ * and a value of 1. Values of the other kind than the first one
+ * are left out, so that every line belongs to the same metric.
+ */
+static
+void
+job_prom_write_scalars(DynamicJobBuffer* b,
+                       const char* title,
+                       const char* path,
+                       const char* name,
+                       const struct job_prom_series* set,
+                       int n)
+{
+    char metric[JOB_PROM_NAME_LEN];
+    char labels[JOB_PROM_LABELS_LEN];
+    char number[32];
+    struct job_prom_unit unit = { NULL, NULL, 1, 1, 0 };
+    bool header = false;
+    bool info = false;
+    bool counter = false;
+
+    for (int i = 0; i < n; i++)
+    {
+        const key_value_pair* kvp = set[i].kvp;
+
+        if (kvp->type == JOB_VALUE_OBJECT || kvp->type == JOB_VALUE_ARRAY || kvp->value == NULL)
+            continue;
+
+        if (!header)
+        {
+            info = kvp->type != JOB_VALUE_NUMBER;
+            strscpy(metric, name, sizeof(metric));
+            if (info)
+            {
+                job_prom_append_name(metric, sizeof(metric), "info");
+            }
+            else if (kvp->unit != NULL)
+            {
+                unit.unit = kvp->unit;
+                unit.suffix = kvp->unit;
+                for (int u = 0; u < ARRAY_SIZE(job_prom_units); u++)
+                {
+                    if (strcmp(job_prom_units[u].unit, kvp->unit) == 0)
+                        unit = job_prom_units[u];
+                }
+                job_prom_append_name(metric, sizeof(metric), unit.suffix);
+            }
+            counter = !info && kvp->counter;
+            if (counter)
+                job_prom_append_name(metric, sizeof(metric), "total");
+
+            append_to_job_buffer(b, "# HELP ");
+            append_to_job_buffer(b, metric);
+            append_to_job_buffer(b, " ");
+            append_to_job_buffer(b, title);
+            append_to_job_buffer(b, ": ");
+            append_to_job_buffer(b, path);
+            append_to_job_buffer(b, "\n# TYPE ");
+            append_to_job_buffer(b, metric);
+            append_to_job_buffer(b, counter ? " counter\n" : " gauge\n");
+            header = true;
+        }
+
+        if (info != (kvp->type != JOB_VALUE_NUMBER) || (!info && counter != kvp->counter))
+            continue;
+
+        strscpy(labels, set[i].labels, sizeof(labels));
+        if (info)
+        {
+            if (job_prom_add_label(labels, sizeof(labels), "value", kvp->value) != 0)
+            {
+                b->error = -E2BIG;
+                return;
+            }
+            strscpy(number, "1", sizeof(number));
+        }
+        else if (!job_prom_same_unit(unit.unit, kvp->unit) ||
+                 !job_prom_format_number(number, sizeof(number), kvp->value, &unit))
+        {
+            // a value in another unit, or not a number
+            continue;
+        }
+
+        append_to_job_buffer(b, metric);
+        if (labels[0] != '\0')
+        {
+            append_to_job_buffer(b, "{");
+            append_to_job_buffer(b, labels);
+            append_to_job_buffer(b, "}");
+        }
+        append_to_job_buffer(b, " ");
+        append_to_job_buffer(b, number);
+        append_to_job_buffer(b, "\n");
+    }
+}
+
+/**
+ * @brief write the values in a set of objects, one metric per key.
+ * 
+ * Values of type JOB_VALUE_LABEL become labels of the object's
+ * other values, e.g. cpus.frequency{cpu="0"}.
+ */
+static
+void
+job_prom_write_objects(DynamicJobBuffer* b,
+                       const char* title,
+                       const char* path,
+                       const char* name,
+                       const struct job_prom_series* set,
+                       int n,
+                       int indexes)
+{
+    char child_name[JOB_PROM_NAME_LEN];
+    char child_path[JOB_PROM_NAME_LEN];
+    char labels[JOB_PROM_LABELS_LEN];
+    struct job_prom_series* children = NULL;
+    const char** keys = NULL;
+    char** object_labels = NULL;
+    int key_count = 0;
+    int max_keys = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (set[i].kvp->type == JOB_VALUE_OBJECT)
+            max_keys += set[i].kvp->child_count;
+    }
+    if (max_keys == 0)
+        return;
+
+    keys = kcalloc(max_keys, sizeof(const char*), GFP_KERNEL);
+    object_labels = kcalloc(n, sizeof(char*), GFP_KERNEL);
+    children = kcalloc(n, sizeof(struct job_prom_series), GFP_KERNEL);
+    if (keys == NULL || object_labels == NULL || children == NULL)
+    {
+        b->error = -ENOMEM;
+        goto out;
+    }
+
+    // the labels of each object, and the keys of the values in any of them
+    for (int i = 0; i < n; i++)
+    {
+        const key_value_pair* kvp = set[i].kvp;
+
+        if (kvp->type != JOB_VALUE_OBJECT)
+            continue;
+
+        strscpy(labels, set[i].labels, sizeof(labels));
+        for (int c = 0; c < kvp->child_count; c++)
+        {
+            const key_value_pair* child = &kvp->children[c];
+            int k;
+
+            if (child->key == NULL || !job_kvp_has_value(child))
+                continue;
+
+            if (child->type == JOB_VALUE_LABEL)
+            {
+                if (job_prom_add_label(labels, sizeof(labels), child->key, child->value) != 0)
+                {
+                    b->error = -E2BIG;
+                    goto out;
+                }
+                continue;
+            }
+
+            for (k = 0; k < key_count; k++)
+            {
+                if (strcmp(keys[k], child->key) == 0)
+                    break;
+            }
+            if (k == key_count)
+                keys[key_count++] = child->key;
+        }
+
+        object_labels[i] = kstrdup(labels, GFP_KERNEL);
+        if (object_labels[i] == NULL)
+        {
+            b->error = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (int k = 0; k < key_count; k++)
+    {
+        int count = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            const key_value_pair* kvp = set[i].kvp;
+
+            if (kvp->type != JOB_VALUE_OBJECT)
+                continue;
+
+            for (int c = 0; c < kvp->child_count; c++)
+            {
+                const key_value_pair* child = &kvp->children[c];
+
+                if (child->key != NULL && child->type != JOB_VALUE_LABEL &&
+                    strcmp(child->key, keys[k]) == 0)
+                {
+                    children[count].kvp = child;
+                    children[count].labels = object_labels[i];
+                    count++;
+                    break;
+                }
+            }
+        }
+
+        strscpy(child_name, name, sizeof(child_name));
+        job_prom_append_name(child_name, sizeof(child_name), keys[k]);
+        snprintf(child_path, sizeof(child_path), "%s.%s", path, keys[k]);
+        job_prom_write(b, title, child_path, child_name, children, count, indexes);
+    }
+
+out:
+    if (object_labels != NULL)
+    {
+        for (int i = 0; i < n; i++)
+            kfree(object_labels[i]);
+    }
+    kfree(object_labels);
+    kfree(children);
+    kfree(keys);
+}
+
+/**
+ * @brief write the elements of a set of arrays under the arrays'
+ *        metric name.
+ * 
+ * Elements are told apart by an index label, unless they are
+ * objects with labels of their own.
+ */
+static
+void
+job_prom_write_arrays(DynamicJobBuffer* b,
+                      const char* title,
+                      const char* path,
+                      const char* name,
+                      const struct job_prom_series* set,
+                      int n,
+                      int indexes)
+{
+    char labels[JOB_PROM_LABELS_LEN];
+    char index_key[24];
+    char index[16];
+    struct job_prom_series* elements = NULL;
+    int count = 0;
+    int max_elements = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (set[i].kvp->type == JOB_VALUE_ARRAY)
+            max_elements += set[i].kvp->child_count;
+    }
+    if (max_elements == 0)
+        return;
+
+    elements = kcalloc(max_elements, sizeof(struct job_prom_series), GFP_KERNEL);
+    if (elements == NULL)
+    {
+        b->error = -ENOMEM;
+        return;
+    }
+
+    // nested arrays each get an index label of their own
+    if (indexes == 0)
+        strscpy(index_key, "index", sizeof(index_key));
+    else
+        snprintf(index_key, sizeof(index_key), "index%d", indexes + 1);
+
+    for (int i = 0; i < n; i++)
+    {
+        const key_value_pair* kvp = set[i].kvp;
+
+        if (kvp->type != JOB_VALUE_ARRAY)
+            continue;
+
+        for (int e = 0; e < kvp->child_count; e++)
+        {
+            const key_value_pair* element = &kvp->children[e];
+            bool labelled = false;
+
+            if (!job_kvp_has_value(element))
+                continue;
+
+            for (int c = 0; element->type == JOB_VALUE_OBJECT && c < element->child_count; c++)
+            {
+                if (element->children[c].type == JOB_VALUE_LABEL)
+                    labelled = true;
+            }
+
+            strscpy(labels, set[i].labels, sizeof(labels));
+            if (!labelled)
+            {
+                snprintf(index, sizeof(index), "%d", e);
+                if (job_prom_add_label(labels, sizeof(labels), index_key, index) != 0)
+                {
+                    b->error = -E2BIG;
+                    goto out;
+                }
+            }
+
+            elements[count].kvp = element;
+            elements[count].labels = kstrdup(labels, GFP_KERNEL);
+            if (elements[count].labels == NULL)
+            {
+                b->error = -ENOMEM;
+                goto out;
+            }
+            count++;
+        }
+    }
+
+    job_prom_write(b, title, path, name, elements, count, indexes + 1);
+
+out:
+    for (int i = 0; i < count; i++)
+        kfree(elements[i].labels);
+    kfree(elements);
+}
+
+/**
+ * @brief write a set of values that share a metric name, with
+ *        the values in objects and arrays written recursively.
+ * 
+ * @param b - the buffer to write to.
+ * @param title - title of the job, for the HELP lines.
+ * @param path - dotted path of the values in the job's JSON.
+ * @param name - metric name of the values.
+ * @param set - the values, with their labels.
+ * @param n - number of values in set.
+ * @param indexes - number of index labels the values already have.
+ */
+static
+void
+job_prom_write(DynamicJobBuffer* b,
+               const char* title,
+               const char* path,
+               const char* name,
+               const struct job_prom_series* set,
+               int n,
+               int indexes)
+{
+    if (b->error || n == 0)
+        return;
+
+    job_prom_write_scalars(b, title, path, name, set, n);
+    job_prom_write_objects(b, title, path, name, set, n, indexes);
+    job_prom_write_arrays(b, title, path, name, set, n, indexes);
+}
+
+/**
+ * @brief write one metric of the sample metadata.
+ */
+static
+void
+job_prom_write_meta_metric(DynamicJobBuffer* b,
+                           const char* title,
+                           const char* suffix,
+                           const char* help,
+                           const char* type,
+                           const char* value)
+{
+    char metric[JOB_PROM_NAME_LEN] = "sysinfo";
+
+    job_prom_append_name(metric, sizeof(metric), title);
+    job_prom_append_name(metric, sizeof(metric), suffix);
+
+    append_to_job_buffer(b, "# HELP ");
+    append_to_job_buffer(b, metric);
+    append_to_job_buffer(b, " ");
+    append_to_job_buffer(b, title);
+    append_to_job_buffer(b, ": ");
+    append_to_job_buffer(b, help);
+    append_to_job_buffer(b, "\n# TYPE ");
+    append_to_job_buffer(b, metric);
+    append_to_job_buffer(b, " ");
+    append_to_job_buffer(b, type);
+    append_to_job_buffer(b, "\n");
+    append_to_job_buffer(b, metric);
+    append_to_job_buffer(b, " ");
+    append_to_job_buffer(b, value);
+    append_to_job_buffer(b, "\n");
+}
+
+/**
+ * @brief write the metadata of a sample as Prometheus metrics.
+ * 
+ * @param b - the buffer to write to.
+ * @param r - the sample's JobResult.
+ */
+static
+void
+job_prom_write_meta(DynamicJobBuffer* b,
+                    const JobResult* r)
+{
+    char value[32];
+
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)r->seq);
+    job_prom_write_meta_metric(b, r->job_title, "sample_seq",
+                               "sequence number of the sample", "counter", value);
+
+    snprintf(value, sizeof(value), "%llu.%09llu",
+             (unsigned long long)(r->realtime_ns / NSEC_PER_SEC),
+             (unsigned long long)(r->realtime_ns % NSEC_PER_SEC));
+    job_prom_write_meta_metric(b, r->job_title, "sample_timestamp_seconds",
+                               "time the sample was taken, since the epoch", "gauge", value);
+
+    snprintf(value, sizeof(value), "%llu.%09llu",
+             (unsigned long long)(r->duration_ns / NSEC_PER_SEC),
+             (unsigned long long)(r->duration_ns % NSEC_PER_SEC));
+    job_prom_write_meta_metric(b, r->job_title, "sample_duration_seconds",
+                               "time taken to collect the sample", "gauge", value);
+}
+
+/**
+ * @brief Serialize a JobResult in the Prometheus text exposition
+ *        format.
+ * 
+ * Each value is a metric named sysinfo_<job title>_<key>, with
+ * the keys of nested objects appended and a suffix for the base
+ * unit, e.g. sysinfo_memory_total_ram_bytes. Elements of arrays
+ * are labelled with their JOB_VALUE_LABEL values or their index.
+ * 
+ * @param r - the JobResult to serialize.
+ * @return string buffer that contains the metrics, NULL on error.
+ *
+ * WARNING: It is the responsibility of the caller to free
+ * the memory of the returned buffer.
+ */
+char*
+serialize_job_result_prometheus(const JobResult* r)
+{
+    char name[JOB_PROM_NAME_LEN];
+    DynamicJobBuffer buf;
+
+    if (r == NULL)
+    {
+        return NULL;
+    }
+
+    if (job_buffer_setup(&buf, READ_ONCE(job_buffer_hint)) != 0)
+        return NULL;
+
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        struct job_prom_series series = { .kvp = &r->kvps[i], .labels = "" };
+
+        // skip steps that failed to produce a value
+        if (r->kvps[i].key == NULL || !job_kvp_has_value(&r->kvps[i]))
+            continue;
+
+        strscpy(name, "sysinfo", sizeof(name));
+        job_prom_append_name(name, sizeof(name), r->job_title);
+        job_prom_append_name(name, sizeof(name), r->kvps[i].key);
+        job_prom_write(&buf, r->job_title, r->kvps[i].key, name, &series, 1, 0);
+    }
+
+    if (r->seq != 0)
+        job_prom_write_meta(&buf, r);
+
+    if (buf.error)
+    {
+        free_job_buffer(&buf);
+        return NULL;
+    }
+
+    return buf.data;
 }
 
 MODULE_LICENSE("GPL");
\ No newline at end of file
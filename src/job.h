@@ -1,75 +1,300 @@
 #ifndef JOB_H
 #define JOB_H
 
-// definitions for info types
-#define CPU 1
-#define MEMORY 2
-#define DISK 3
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+// types of step values
+#define JOB_VALUE_STRING 0                      // free text, e.g. a model name
+#define JOB_VALUE_NUMBER 1                      // a decimal number, in the step's unit
+#define JOB_VALUE_OBJECT 2                      // named values, emitted by the step
+#define JOB_VALUE_ARRAY 3                       // unnamed values, emitted by the step
+#define JOB_VALUE_LABEL 4                       // text naming the object it is in, e.g. a CPU or device
+
+// deepest nesting of objects and arrays a step can emit
+#define JOB_EMIT_MAX_DEPTH 4
+
+// flags of a step
+#define JOB_FLAG_ASYNC 1                        // runs on a workqueue, concurrently with the other steps
+#define JOB_FLAG_COUNTER 2                      // a number that only grows, e.g. a time or an event count
+
+// key of the array of stale steps in a serialized JobResult
+#define JOB_STALE_KEY "_stale"
+
+// keys of the sample metadata in a serialized JobResult, see JobResult.seq
+#define JOB_SEQ_KEY "_seq"
+#define JOB_MONOTONIC_KEY "_monotonic_ns"
+#define JOB_REALTIME_KEY "_realtime_ns"
+#define JOB_DURATION_KEY "_duration_ns"
 
 /**
- * Return type for job function in snake case.
- * key_value_pair.key - the name of the metric (e.g. cpu_speed_hz)
- * key_value_pair.value - the value of that metric
+ * A value collected by a Step.
+ * key_value_pair.key - the name of the metric (e.g. cpu_speed_hz),
+ *                      NULL for the elements of an array
+ * key_value_pair.value - the value of that metric, heap allocated
+ *                        and freed by the job runner
+ * key_value_pair.unit - unit of the value, NULL if it has none
+ * key_value_pair.type - JOB_VALUE_* type of the value
+ * key_value_pair.children - the values in a JOB_VALUE_OBJECT or
+ *                           JOB_VALUE_ARRAY, which has no value
+ * key_value_pair.child_count - number of children
+ * key_value_pair.stale - the step ran over its time budget, and
+ *                        this is its last good value
+ * key_value_pair.counter - the value is a number that only grows,
+ *                          see JOB_FLAG_COUNTER
  */
 typedef struct key_value_pair {
-    char* key;
+    const char* key;
     char* value;
+    const char* unit;
+    int type;
+    struct key_value_pair* children;
+    int child_count;
+    bool stale;
+    bool counter;
 } key_value_pair;
 
 /**
- * The smallest unit of a Job.
- * Consists of a get_kvp function pointer and a pointer to the
- * next Step in the Job.
+ * What a Job is collected for, passed to its steps by
+ * collect_job_ctx(). Jobs collected with collect_job() have no
+ * context, and their steps are passed NULL.
+ */
+typedef struct JobContext {
+    // state of the reader the job is collected for, e.g. the cgroup
+    // it selected, NULL for values shared by every reader. Only the
+    // job's own steps know what it points to.
+    void* reader;
+
+    // collected by the sampler. Steps that report how much a value
+    // grew since the previous run only keep a new baseline then, so
+    // other collections do not shorten the sampler's interval.
+    bool sampled;
+} JobContext;
+
+/**
+ * Passed to the emit function of a multi-value step, to add
+ * values to the object or array the step produces.
+ *
+ * See job_emit_value(), job_emit_begin() and job_emit_end().
+ */
+typedef struct JobEmitter {
+    // open objects and arrays, stack[0] is the step's own value
+    key_value_pair* stack[JOB_EMIT_MAX_DEPTH + 1];
+    int depth;
+
+    // first error hit while emitting, 0 if none
+    int error;
+
+    // what the job is collected for, NULL if it has no context
+    const JobContext* ctx;
+} JobEmitter;
+
+/**
+ * The smallest unit of a Job: one metric, and the handler that
+ * collects its value.
+ *
+ * A multi-value step has an emit function instead of a handler,
+ * and produces an object or array of any number of values, e.g.
+ * one per CPU.
+ *
+ * Steps are defined in static tables with JOB_STEP() and
+ * JOB_STEP_EMIT(), see DEFINE_JOB(). Expensive steps that do not
+ * depend on the other steps can be defined with JOB_STEP_ASYNC()
+ * or JOB_STEP_EMIT_ASYNC() instead, so that they run concurrently.
  */
 typedef struct Step {
-    // function to run the step
-    key_value_pair (*get_kvp)(void);
+    // name of the metric in the output
+    const char* key;
+
+    // returns the value, heap allocated (it is freed by the job
+    // runner), or NULL if the value could not be collected
+    char* (*handler)(void);
+
+    // like handler, for steps that depend on the JobContext
+    char* (*ctx_handler)(const JobContext* ctx);
+
+    // adds the values of a JOB_VALUE_OBJECT or JOB_VALUE_ARRAY step
+    void (*emit)(JobEmitter* e);
 
-    // pointer to the next step in the job
-    struct Step* next;
+    // JOB_VALUE_* type of the value
+    int type;
+
+    // unit of the value, NULL if it has none
+    const char* unit;
+
+    // JOB_FLAG_* flags
+    int flags;
+
+    // longest time collect_job() waits for the step, in
+    // milliseconds, 0 to always wait for it. See StepState.
+    unsigned int budget_ms;
 } Step;
 
+struct job_budget_work;
+
 /**
- * Initialize a step with Step.next==NULL
+ * Runtime state of a Step with a time budget, one per step of
+ * a Job defined with DEFINE_JOB().
  *
- * @param get_kvp the get_kvp function to initialize the step.
- * @return Step* - pointer to the initialized step.
- * @return NULL if step init failed.
+ * A step with a budget runs on a workqueue, and collect_job()
+ * waits for it for at most budget_ms. Collectors that arrive
+ * while an attempt is running wait for the same attempt until its
+ * deadline. A step that runs over is served from its last good
+ * value and marked stale, and carries on in the background. Its
+ * value is kept as the last good value once it finishes, and the
+ * next run of the job tries again.
+ *
+ * Protected by a lock in job.c.
  */
-Step* step_init(key_value_pair (*get_kvp)(void));
+typedef struct StepState {
+    // attempt that is running, NULL if none
+    struct job_budget_work* pending;
+
+    // last value the step returned, valid if has_last is set
+    key_value_pair last;
+    bool has_last;
+} StepState;
 
 /**
- * A Job is composed of a title and a list steps.
+ * A Job is composed of a title and an array of steps, run in order.
  */
 typedef struct Job {
     // title for the job
-    char* job_title;
-    
-    // The 'head' step is the first step to 
-    // run in the job
-    Step* head;
+    const char* job_title;
+
+    // the steps of the job
+    const Step* steps;
 
     int step_count;
+
+    // budget state of each step, NULL to ignore step budgets
+    StepState* state;
 } Job;
 
 /**
- * Initialize a job, by title and first function
- * to run in the job.
+ * Initializer for one Step in a DEFINE_JOB() table.
+ *
+ * Further Step fields can be set after the unit, e.g.
  *
- * @param title The title of the Job to initialize.
- * @param head_func the function for the first step in the Job.
- * @return a pointer to the initialized Job,
- *         NULL if job_init failed
+ *     JOB_STEP("processes", count_processes, JOB_VALUE_NUMBER, NULL, .budget_ms = 20)
  */
-Job* job_init(char* title, key_value_pair (*head_func)(void));
+#define JOB_STEP(_key, _handler, _type, _unit, ...) \
+    { .key = (_key), .handler = (_handler), .type = (_type), .unit = (_unit), __VA_ARGS__ }
 
 /**
- * Add a step to the job.
- * 
- * @param job - the job to add the function pointer to.
- * @param get_kvp_func - the function for the step to add
+ * Initializer for a Step whose handler is passed the JobContext
+ * the job is collected for, NULL if it has none.
  */
-void append_step_to_job(Job* job, key_value_pair (*get_kvp_func)(void));
+#define JOB_STEP_CTX(_key, _handler, _type, _unit, ...) \
+    { .key = (_key), .ctx_handler = (_handler), .type = (_type), .unit = (_unit), __VA_ARGS__ }
+
+/**
+ * Initializer for a multi-value Step in a DEFINE_JOB() table.
+ * _type is JOB_VALUE_OBJECT or JOB_VALUE_ARRAY.
+ */
+#define JOB_STEP_EMIT(_key, _emit, _type, ...) \
+    { .key = (_key), .emit = (_emit), .type = (_type), __VA_ARGS__ }
+
+/**
+ * Initializers for steps that run on a workqueue, concurrently
+ * with the job's other steps. collect_job() waits for them before
+ * it returns, so a job takes as long as its slowest step instead
+ * of the sum of its steps.
+ *
+ * The handler runs in a kworker, not in the task collecting the
+ * job, so it must not depend on the current task.
+ */
+#define JOB_STEP_ASYNC(_key, _handler, _type, _unit, ...) \
+    JOB_STEP(_key, _handler, _type, _unit, .flags = JOB_FLAG_ASYNC, __VA_ARGS__)
+
+#define JOB_STEP_EMIT_ASYNC(_key, _emit, _type, ...) \
+    JOB_STEP_EMIT(_key, _emit, _type, .flags = JOB_FLAG_ASYNC, __VA_ARGS__)
+
+/**
+ * Initializer for a step whose value is a number that only grows,
+ * e.g. a time or an event count, so that it is written as a
+ * counter in Prometheus output. Values emitted by multi-value steps
+ * are marked with job_emit_counter() instead.
+ */
+#define JOB_STEP_COUNTER(_key, _handler, _unit, ...) \
+    JOB_STEP(_key, _handler, JOB_VALUE_NUMBER, _unit, .flags = JOB_FLAG_COUNTER, __VA_ARGS__)
+
+/**
+ * Define a Job from a static table of steps, e.g.
+ *
+ *     DEFINE_JOB(memory_job, "memory",
+ *         JOB_STEP("Total RAM", get_total_ram, JOB_VALUE_NUMBER, "kB"),
+ *         JOB_STEP("Free RAM", get_free_ram, JOB_VALUE_NUMBER, "kB"));
+ *
+ * defines const Job memory_job. The table is built at compile time,
+ * so running the job does no work to construct it. The StepState
+ * of each step is defined alongside it.
+ */
+#define DEFINE_JOB(_name, _title, ...) \
+    static const Step _name##_steps[] = { __VA_ARGS__ }; \
+    static StepState _name##_state[ARRAY_SIZE(_name##_steps)]; \
+    const Job _name = { \
+        .job_title = (_title), \
+        .steps = _name##_steps, \
+        .step_count = ARRAY_SIZE(_name##_steps), \
+        .state = _name##_state, \
+    }
+
+/**
+ * The values collected by running a Job, one key_value_pair
+ * per Step, in Step order.
+ *
+ * The values, and the children of multi-value steps, are heap
+ * allocated and owned by the JobResult.
+ */
+typedef struct JobResult {
+    // title of the job that was run
+    const char* job_title;
+
+    // collected key-value pairs
+    key_value_pair* kvps;
+
+    // time taken by the step for each key-value pair, in nanoseconds
+    u64* step_ns;
+
+    int kvp_count;
+
+    // time taken to run the whole job, in nanoseconds
+    u64 duration_ns;
+
+    // CLOCK_MONOTONIC and CLOCK_REALTIME time the job started, in nanoseconds
+    u64 timestamp_ns;
+    u64 realtime_ns;
+
+    // sequence number of the sample within its category, the first
+    // is 1. 0 if the result is not a sample, and has no metadata in
+    // its serialized form.
+    u64 seq;
+} JobResult;
+
+/**
+ * Per-reader state for delta output.
+ *
+ * Remembers the last value sent for each Step of a Job, so that
+ * only values that have changed are serialized. Every
+ * keyframe_interval runs the full document is sent instead.
+ */
+typedef struct JobDelta {
+    // title of the job the remembered values belong to, a copy
+    // owned by the JobDelta, as the job can be unregistered
+    char* job_title;
+
+    // last value sent for each step, NULL if not sent yet
+    char** last_values;
+
+    int value_count;
+
+    // send a full document every keyframe_interval runs
+    int keyframe_interval;
+
+    // number of documents serialized against this JobDelta
+    unsigned long run_count;
+} JobDelta;
 
 /**
  * Runs the job (gets the key-value information for each step)
@@ -78,26 +303,151 @@ void append_step_to_job(Job* job, key_value_pair (*get_kvp_func)(void));
  * @param j - pointer to the job to run.
  * @return string buffer that contains job data in key-value form.
  */
-char* run_job(Job* j);
+char* run_job(const Job* j);
+
+/**
+ * Run each step in the job and collect the results.
+ *
+ * @param j - pointer to the job to run.
+ * @return JobResult* - the collected values, NULL on error.
+ */
+JobResult* collect_job(const Job* j);
+
+/**
+ * Run each step in the job for a context, and collect the results.
+ *
+ * @param j - pointer to the job to run.
+ * @param ctx - what the job is collected for, passed to its steps.
+ * @return JobResult* - the collected values, NULL on error.
+ */
+JobResult* collect_job_ctx(const Job* j, const JobContext* ctx);
 
 /**
- * Get a pointer to the job for the current_info_type.
- * 
- * @return pointer to the job for current_info_type.
+ * Add a value to the object or array being emitted.
+ *
+ * @param e - the emitter passed to the step.
+ * @param key - name of the value, a string that outlives the
+ *              JobResult (e.g. a literal). Ignored in arrays.
+ * @param value - the value, heap allocated. The emitter takes
+ *                ownership, even on error. NULL values are left
+ *                out of the output.
+ * @param type - JOB_VALUE_STRING or JOB_VALUE_NUMBER.
+ * @param unit - unit of the value, NULL if it has none.
  */
-Job* get_current_job(void);
+void job_emit_value(JobEmitter* e, const char* key, char* value, int type, const char* unit);
+void job_emit_counter(JobEmitter* e, const char* key, char* value, const char* unit);
 
 /**
- * Set the value of the current info type to 1 of
- * 3 values:
- * 
- * 1. CPU
- * 2. MEMORY
- * 3. DISK
- * 
- * @return 0 if success, -1 on error.
+ * Open a nested object or array, closed with job_emit_end().
+ *
+ * @param e - the emitter passed to the step.
+ * @param key - name of the object or array. Ignored in arrays.
+ * @param type - JOB_VALUE_OBJECT or JOB_VALUE_ARRAY.
+ */
+void job_emit_begin(JobEmitter* e, const char* key, int type);
+
+/**
+ * Close the object or array opened by the last job_emit_begin().
+ *
+ * @param e - the emitter passed to the step.
+ */
+void job_emit_end(JobEmitter* e);
+
+/**
+ * Read values of every online CPU on that CPU, so that per-CPU
+ * data is read locally instead of pulling its cache lines over
+ * to the collecting CPU.
+ *
+ * fn is called once on each online CPU, from an IPI with
+ * interrupts off, so it must not sleep or allocate. Hold
+ * cpus_read_lock() around the call and the use of the slots,
+ * so the online CPUs do not change in between.
+ *
+ * @param fn - fills in the slot of the CPU it runs on.
+ * @param slot_size - size of one CPU's slot.
+ * @return array of nr_cpu_ids slots, indexed by CPU, which the
+ *         caller frees with kfree(). NULL on allocation failure.
+ */
+void* job_collect_per_cpu(void (*fn)(void* slot), size_t slot_size);
+
+/**
+ * Wait for steps of a job that ran over their budget, and keep
+ * their values as the last good values, e.g. so that the next run
+ * of the job is served them. Nothing is freed, the job can still
+ * be collected.
+ *
+ * @param j - the job.
+ */
+void job_wait_budgets(const Job* j);
+
+/**
+ * Wait for steps of a job that ran over their budget, and free
+ * their last good values. Call before the job goes away, e.g.
+ * when it is unregistered, once nothing collects it any more.
+ *
+ * @param j - the job.
+ */
+void job_flush_budgets(const Job* j);
+
+/**
+ * Free a JobResult and the values it owns.
+ *
+ * @param r - the JobResult to free.
+ */
+void free_job_result(JobResult* r);
+
+/**
+ * Copy a JobResult and the values it owns.
+ *
+ * @param r - the JobResult to copy.
+ * @return the copy, freed with free_job_result(), NULL on error.
+ */
+JobResult* copy_job_result(const JobResult* r);
+
+/**
+ * Free the value and children of a key_value_pair, and clear it,
+ * e.g. to drop a value from a copied JobResult.
+ *
+ * @param kvp - the key_value_pair.
+ */
+void job_free_kvp(key_value_pair* kvp);
+
+/**
+ * Serialize a JobResult as a JSON object.
+ *
+ * @param r - the JobResult to serialize.
+ * @param d - delta state for the reader, or NULL to serialize
+ *            every value.
+ * @return string buffer that contains job data in key-value form,
+ *         NULL on error.
+ */
+char* serialize_job_result(JobResult* r, JobDelta* d);
+
+/**
+ * Serialize a JobResult in the Prometheus text exposition format,
+ * one metric per value, named sysinfo_<job title>_<key> with a
+ * suffix for the value's base unit.
+ *
+ * @param r - the JobResult to serialize.
+ * @return string buffer that contains the metrics, NULL on error.
+ */
+char* serialize_job_result_prometheus(const JobResult* r);
+
+/**
+ * Initialize delta state for a reader.
+ *
+ * @param keyframe_interval - send a full document every
+ *                            keyframe_interval runs (minimum 1).
+ * @return JobDelta* - the initialized delta state, NULL on error.
+ */
+JobDelta* job_delta_init(int keyframe_interval);
+
+/**
+ * Free delta state and the values it remembers.
+ *
+ * @param d - the JobDelta to free.
  */
-int set_current_info_type(int value);
+void free_job_delta(JobDelta* d);
 
 
 #endif
\ No newline at end of file
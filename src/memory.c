@@ -1,7 +1,7 @@
 /**
  * memory.c
  * 
- * Configures and gets memory job.
+ * Defines the memory job.
  * 
  * @author Danny Quinn
  */
@@ -12,101 +12,50 @@
 #include "job.h"
 #include "memory.h" 
 
-static key_value_pair get_total_ram(void)
+static char* get_total_ram(void)
 {
     struct sysinfo si;
     si_meminfo(&si);
 
-    key_value_pair kvp;
-    kvp.key = "Total RAM";
-    kvp.value = kasprintf(GFP_KERNEL, "%lu kB", si.totalram * (si.mem_unit / 1024));
-
-    if (!kvp.value) {
-        kvp.key = NULL;
-        kvp.value = NULL;
-    }
-
-    return kvp;
+    return kasprintf(GFP_KERNEL, "%lu", si.totalram * (si.mem_unit / 1024));
 }
 
-static key_value_pair get_free_ram(void)
+static char* get_free_ram(void)
 {
     struct sysinfo si;
     si_meminfo(&si);
 
-    key_value_pair kvp;
-    kvp.key = "Free RAM";
-    kvp.value = kasprintf(GFP_KERNEL, "%lu kB", si.freeram * (si.mem_unit / 1024));
-
-    if (!kvp.value) {
-        kvp.key = NULL;
-        kvp.value = NULL;
-    }
-
-    return kvp;
+    return kasprintf(GFP_KERNEL, "%lu", si.freeram * (si.mem_unit / 1024));
 }
 
-static key_value_pair get_buffer_ram(void)
+static char* get_buffer_ram(void)
 {
     struct sysinfo si;
     si_meminfo(&si);
 
-    key_value_pair kvp;
-    kvp.key = "Buffered RAM";
-    kvp.value = kasprintf(GFP_KERNEL, "%lu kB", si.bufferram * (si.mem_unit / 1024));
-
-    if (!kvp.value) {
-        kvp.key = NULL;
-        kvp.value = NULL;
-    }
-
-    return kvp;
+    return kasprintf(GFP_KERNEL, "%lu", si.bufferram * (si.mem_unit / 1024));
 }
 
-static key_value_pair get_total_swap(void)
+static char* get_total_swap(void)
 {
     struct sysinfo si;
     si_meminfo(&si);
 
-    key_value_pair kvp;
-    kvp.key = "Total Swap";
-    kvp.value = kasprintf(GFP_KERNEL, "%lu kB", si.totalswap * (si.mem_unit / 1024));
-
-    if (!kvp.value) {
-        kvp.key = NULL;
-        kvp.value = NULL;
-    }
-
-    return kvp;
+    return kasprintf(GFP_KERNEL, "%lu", si.totalswap * (si.mem_unit / 1024));
 }
 
-static key_value_pair get_free_swap(void)
+static char* get_free_swap(void)
 {
     struct sysinfo si;
     si_meminfo(&si);
 
-    key_value_pair kvp;
-    kvp.key = "Free Swap";
-    kvp.value = kasprintf(GFP_KERNEL, "%lu kB", si.freeswap * (si.mem_unit / 1024));
-
-    if (!kvp.value) {
-        kvp.key = NULL;
-        kvp.value = NULL;
-    }
-
-    return kvp;
+    return kasprintf(GFP_KERNEL, "%lu", si.freeswap * (si.mem_unit / 1024));
 }
 
-Job* get_memory_job(void)
-{
-    Job* memory = job_init("memory", get_total_ram);
-    if (!memory)
-        return NULL;
-
-    append_step_to_job(memory, get_free_ram);
-    append_step_to_job(memory, get_total_swap);
-    append_step_to_job(memory, get_buffer_ram);
-    append_step_to_job(memory, get_free_swap);
-
-    return memory;
-}
\ No newline at end of file
+DEFINE_JOB(memory_job, "memory",
+    JOB_STEP("Total RAM", get_total_ram, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("Free RAM", get_free_ram, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("Total Swap", get_total_swap, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("Buffered RAM", get_buffer_ram, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("Free Swap", get_free_swap, JOB_VALUE_NUMBER, "kB"),
+);
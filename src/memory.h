@@ -2,6 +2,7 @@
 #define MEMORY_H
 
 #include "job.h"
-Job* get_memory_job(void);
 
-#endif
\ No newline at end of file
+extern const Job memory_job;
+
+#endif
@@ -0,0 +1,335 @@
+/**
+ * netlink.c
+ *
+ * The "sysinfo" generic netlink family. Samples are multicast to
+ * the listeners of their category's group and of the "samples"
+ * group, encoded as netlink attributes, and a category can be
+ * collected on demand with SYSINFO_NL_CMD_GET. See
+ * sysinfo_netlink.h.
+ *
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <net/genetlink.h>
+#include <net/netlink.h>
+#include <net/net_namespace.h>
+#include "registry.h"
+#include "netlink.h"
+
+// multicast group of every sample, the groups of categories are numbered by id
+#define SYSINFO_NL_GROUP_ALL 0
+
+static const struct nla_policy sysinfo_nl_policy[SYSINFO_NL_ATTR_MAX + 1] = {
+    [SYSINFO_NL_ATTR_CATEGORY] = { .type = NLA_U32 },
+};
+
+static int sysinfo_nl_get(struct sk_buff* skb, struct genl_info* info);
+
+static const struct genl_small_ops sysinfo_nl_ops[] = {
+    {
+        .cmd = SYSINFO_NL_CMD_GET,
+        .validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+        .doit = sysinfo_nl_get,
+    },
+};
+
+// "samples", then one group per category id, named when the module loads
+static struct genl_multicast_group sysinfo_nl_groups[SYSINFO_MAX_CATEGORIES + 1];
+
+static struct genl_family sysinfo_nl_family __ro_after_init = {
+    .name = SYSINFO_NL_FAMILY_NAME,
+    .version = SYSINFO_NL_VERSION,
+    .maxattr = SYSINFO_NL_ATTR_MAX,
+    .policy = sysinfo_nl_policy,
+    .module = THIS_MODULE,
+    // collecting a job can take a while, do not hold up other families
+    .parallel_ops = true,
+    .small_ops = sysinfo_nl_ops,
+    .n_small_ops = ARRAY_SIZE(sysinfo_nl_ops),
+    .resv_start_op = SYSINFO_NL_CMD_SAMPLE + 1,
+    .mcgrps = sysinfo_nl_groups,
+    .n_mcgrps = ARRAY_SIZE(sysinfo_nl_groups),
+};
+
+static bool sysinfo_nl_registered;              // the family was registered when the module loaded
+
+/**
+ * @brief size of a value encoded by sysinfo_nl_put_value(),
+ *        without its own attribute header.
+ */
+static
+size_t
+sysinfo_nl_value_size(const key_value_pair* kvp)
+{
+    size_t size = nla_total_size(sizeof(u32));
+
+    if (kvp->key != NULL)
+        size += nla_total_size(strlen(kvp->key) + 1);
+    if (kvp->unit != NULL)
+        size += nla_total_size(strlen(kvp->unit) + 1);
+    if (kvp->value != NULL)
+        size += max(nla_total_size_64bit(sizeof(s64)), nla_total_size(strlen(kvp->value) + 1));
+    if (kvp->stale)
+        size += nla_total_size(0);
+
+    for (int i = 0; i < kvp->child_count; i++)
+        size += nla_total_size(sysinfo_nl_value_size(&kvp->children[i]));
+
+    return size;
+}
+
+/**
+ * @brief check that a value was collected, as values that were
+ *        not are left out, like in the JSON document.
+ */
+static
+bool
+sysinfo_nl_has_value(const key_value_pair* kvp)
+{
+    return kvp->value != NULL || kvp->type == JOB_VALUE_OBJECT || kvp->type == JOB_VALUE_ARRAY;
+}
+
+/**
+ * @brief encode a value, and its children, as a nested attribute.
+ *
+ * Numbers are encoded as s64, unless they do not fit, and other
+ * values as strings.
+ *
+ * @param skb - the message.
+ * @param attr - type of the nested attribute.
+ * @param kvp - the value.
+ *
+ * @return 0 on success, -EMSGSIZE if the message is full.
+ */
+static
+int
+sysinfo_nl_put_value(struct sk_buff* skb,
+                     int attr,
+                     const key_value_pair* kvp)
+{
+    struct nlattr* nest = nla_nest_start(skb, attr);
+    s64 number;
+    int err;
+
+    if (nest == NULL)
+        return -EMSGSIZE;
+
+    err = (kvp->key != NULL && nla_put_string(skb, SYSINFO_NL_VALUE_KEY, kvp->key)) ||
+          nla_put_u32(skb, SYSINFO_NL_VALUE_TYPE, kvp->type) ||
+          (kvp->unit != NULL && nla_put_string(skb, SYSINFO_NL_VALUE_UNIT, kvp->unit)) ||
+          (kvp->stale && nla_put_flag(skb, SYSINFO_NL_VALUE_STALE));
+
+    if (!err && kvp->value != NULL)
+    {
+        if (kvp->type == JOB_VALUE_NUMBER && kstrtos64(kvp->value, 10, &number) == 0)
+            err = nla_put_s64(skb, SYSINFO_NL_VALUE_NUMBER, number, SYSINFO_NL_VALUE_PAD);
+        else
+            err = nla_put_string(skb, SYSINFO_NL_VALUE_TEXT, kvp->value);
+    }
+
+    for (int i = 0; !err && i < kvp->child_count; i++)
+        err = sysinfo_nl_put_value(skb, SYSINFO_NL_VALUE_CHILD, &kvp->children[i]);
+
+    if (err)
+    {
+        nla_nest_cancel(skb, nest);
+        return -EMSGSIZE;
+    }
+
+    nla_nest_end(skb, nest);
+    return 0;
+}
+
+/**
+ * @brief Encode a JobResult as a SYSINFO_NL_CMD_SAMPLE message.
+ *
+ * @param r - the values.
+ * @param id - id of the category the values are of.
+ * @param portid - port of the requester, 0 to multicast.
+ * @param seq - sequence number of the request, 0 to multicast.
+ *
+ * @return the message, NULL on allocation failure.
+ */
+struct sk_buff*
+sysinfo_netlink_build(const JobResult* r,
+                      int id,
+                      u32 portid,
+                      u32 seq)
+{
+    size_t size = nla_total_size(sizeof(u32)) +
+                  nla_total_size(strlen(r->job_title) + 1) +
+                  4 * nla_total_size_64bit(sizeof(u64));
+    struct sk_buff* skb;
+    void* hdr;
+    int err;
+
+    for (int i = 0; i < r->kvp_count; i++)
+        size += nla_total_size(sysinfo_nl_value_size(&r->kvps[i]));
+
+    skb = genlmsg_new(size, GFP_KERNEL);
+    if (skb == NULL)
+        return NULL;
+
+    hdr = genlmsg_put(skb, portid, seq, &sysinfo_nl_family, 0, SYSINFO_NL_CMD_SAMPLE);
+    if (hdr == NULL)
+    {
+        nlmsg_free(skb);
+        return NULL;
+    }
+
+    // results collected on demand are not samples, and have no sequence number
+    err = nla_put_u32(skb, SYSINFO_NL_ATTR_CATEGORY, id) ||
+          nla_put_string(skb, SYSINFO_NL_ATTR_TITLE, r->job_title) ||
+          (r->seq != 0 && nla_put_u64_64bit(skb, SYSINFO_NL_ATTR_SEQ, r->seq, SYSINFO_NL_ATTR_PAD)) ||
+          nla_put_u64_64bit(skb, SYSINFO_NL_ATTR_MONOTONIC_NS, r->timestamp_ns, SYSINFO_NL_ATTR_PAD) ||
+          nla_put_u64_64bit(skb, SYSINFO_NL_ATTR_REALTIME_NS, r->realtime_ns, SYSINFO_NL_ATTR_PAD) ||
+          nla_put_u64_64bit(skb, SYSINFO_NL_ATTR_DURATION_NS, r->duration_ns, SYSINFO_NL_ATTR_PAD);
+
+    for (int i = 0; !err && i < r->kvp_count; i++)
+    {
+        if (sysinfo_nl_has_value(&r->kvps[i]))
+            err = sysinfo_nl_put_value(skb, SYSINFO_NL_ATTR_VALUE, &r->kvps[i]);
+    }
+
+    // the message was sized for every value, so this is not expected
+    if (err)
+    {
+        pr_err("sysinfo netlink message of %s does not fit\n", r->job_title);
+        nlmsg_free(skb);
+        return NULL;
+    }
+
+    genlmsg_end(skb, hdr);
+    return skb;
+}
+
+/**
+ * @brief Check whether a category's multicast group has listeners,
+ *        so that it is worth sampling.
+ *
+ * @param id - id of the category.
+ */
+bool
+sysinfo_netlink_has_listeners(int id)
+{
+    return sysinfo_nl_registered &&
+           id > 0 && id <= SYSINFO_MAX_CATEGORIES &&
+           genl_has_listeners(&sysinfo_nl_family, &init_net, id);
+}
+
+/**
+ * @brief Multicast a sample to the listeners of its category, and
+ *        of every sample. Does nothing without listeners.
+ *
+ * @param r - the sample's values.
+ * @param id - id of the category sampled.
+ */
+void
+sysinfo_netlink_publish(const JobResult* r,
+                        int id)
+{
+    bool to_category = sysinfo_netlink_has_listeners(id);
+    bool to_all = sysinfo_nl_registered && genl_has_listeners(&sysinfo_nl_family, &init_net, SYSINFO_NL_GROUP_ALL);
+    struct sk_buff* skb;
+    struct sk_buff* copy;
+
+    if (!to_category && !to_all)
+        return;
+
+    skb = sysinfo_netlink_build(r, id, 0, 0);
+    if (skb == NULL)
+        return;
+
+    // each multicast consumes its message
+    if (to_category && to_all)
+    {
+        copy = skb_clone(skb, GFP_KERNEL);
+        if (copy != NULL)
+            genlmsg_multicast(&sysinfo_nl_family, copy, 0, SYSINFO_NL_GROUP_ALL, GFP_KERNEL);
+    }
+
+    genlmsg_multicast(&sysinfo_nl_family, skb, 0, to_category ? id : SYSINFO_NL_GROUP_ALL, GFP_KERNEL);
+}
+
+/**
+ * @brief handle SYSINFO_NL_CMD_GET: collect a category now, and
+ *        reply with its values.
+ *
+ * @param skb - the request.
+ * @param info - the request's attributes and sender.
+ *
+ * @return 0 on success, -ENOENT if there is no such category,
+ *         -ENOMEM if it could not be collected.
+ */
+static
+int
+sysinfo_nl_get(struct sk_buff* skb,
+               struct genl_info* info)
+{
+    struct sysinfo_category* cat;
+    struct sk_buff* reply;
+    JobResult* r;
+
+    if (info->attrs[SYSINFO_NL_ATTR_CATEGORY] != NULL)
+        cat = registry_find(nla_get_u32(info->attrs[SYSINFO_NL_ATTR_CATEGORY]));
+    else
+        cat = registry_get_current();
+
+    if (cat == NULL)
+    {
+        GENL_SET_ERR_MSG(info, "no sysinfo category with that id");
+        return -ENOENT;
+    }
+
+    r = collect_job(cat->job);
+    if (r == NULL)
+    {
+        registry_put(cat);
+        return -ENOMEM;
+    }
+
+    reply = sysinfo_netlink_build(r, cat->id, info->snd_portid, info->snd_seq);
+    free_job_result(r);
+    registry_put(cat);
+    if (reply == NULL)
+        return -ENOMEM;
+
+    return genlmsg_reply(reply, info);
+}
+
+/**
+ * @brief Register the generic netlink family.
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int
+sysinfo_netlink_init(void)
+{
+    int err;
+
+    strscpy(sysinfo_nl_groups[SYSINFO_NL_GROUP_ALL].name, SYSINFO_NL_GROUP_SAMPLES, GENL_NAMSIZ);
+    for (int id = 1; id <= SYSINFO_MAX_CATEGORIES; id++)
+        snprintf(sysinfo_nl_groups[id].name, GENL_NAMSIZ, SYSINFO_NL_GROUP_CATEGORY, id);
+
+    err = genl_register_family(&sysinfo_nl_family);
+    if (err)
+        return err;
+
+    sysinfo_nl_registered = true;
+    return 0;
+}
+
+/**
+ * @brief Unregister the generic netlink family, once nothing is
+ *        sampled any more.
+ */
+void
+sysinfo_netlink_exit(void)
+{
+    if (sysinfo_nl_registered)
+        genl_unregister_family(&sysinfo_nl_family);
+    sysinfo_nl_registered = false;
+}
@@ -0,0 +1,16 @@
+#ifndef NETLINK_H
+#define NETLINK_H
+
+#include <linux/types.h>
+#include "job.h"
+#include "sysinfo_netlink.h"
+
+struct sk_buff;
+
+int sysinfo_netlink_init(void);
+void sysinfo_netlink_exit(void);
+bool sysinfo_netlink_has_listeners(int id);
+void sysinfo_netlink_publish(const JobResult* r, int id);
+struct sk_buff* sysinfo_netlink_build(const JobResult* r, int id, u32 portid, u32 seq);
+
+#endif
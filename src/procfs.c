@@ -3,6 +3,11 @@
  * 
  * Functions for the /proc filesystem for this device.
  * 
+ * /proc/sysinfo is a directory with one entry per registered
+ * sysinfo category, and a stats entry for the module itself. Every
+ * entry is a seq_file, so output of any size is streamed to the
+ * reader in page sized chunks by seq_read().
+ * 
  * @author Mikey Fennelly
  */
 
@@ -15,94 +20,270 @@
 
 #include "sysinfo_dev.h"                    // sysinfo device funcitons
 #include "job.h"                            // job functions
+#include "registry.h"                       // registered categories
+#include "stats.h"                          // module statistics
 
-#define PROC_FILE_NAME "sysinfo"
-#define EOF 0
-#define PROCFS_MAX_SIZE 256
+#define PROC_STATS_FILE_NAME "stats"
+// longest name of a nested value, e.g. cpus.3.frequency
+#define PROC_VALUE_PATH_LEN 64
 
-char* current_info_type;                    // global var to store current_info_type
-int device_read_count;                      // number of times the /dev node has been read
+/**
+ * Per-open state of a category entry: the values collected
+ * when the entry was opened, so that every chunk of the output
+ * comes from the same run of the job.
+ */
+struct proc_category_iter {
+    struct sysinfo_category* category;      // referenced while the result is held
+    JobResult* result;
+};
+
+// /proc/sysinfo directory entry in kernel for this module
+static struct proc_dir_entry *proc_dir;
 
 // prototypes
-ssize_t sysinfo_proc_read(struct file *file, char __user *user_buffer, size_t available_bytes, loff_t *offset);
-int append_to_proc(struct seq_file *m, void *v);
-int sysinfo_proc_open(struct inode *inode, struct file *file);
 int __init char_device_proc_init(void);
-void __exit char_device_proc_exit(void);
+void char_device_proc_exit(void);
+
+/**
+ * @brief seq_file start, returns the key_value_pair at *pos.
+ * 
+ * @param m - the seq_file being read.
+ * @param pos - index of the key_value_pair to start at.
+ * 
+ * @return pointer to the key_value_pair, NULL past the last one.
+ */
+static
+void*
+category_seq_start(struct seq_file *m,
+                   loff_t *pos)
+{
+    struct proc_category_iter* iter = m->private;
+
+    if (*pos >= iter->result->kvp_count)
+        return NULL;
+
+    return &iter->result->kvps[*pos];
+}
 
 /**
- * @brief called when userspace file reads /proc/sysinfo
+ * @brief seq_file next, moves to the key_value_pair after v.
+ */
+static
+void*
+category_seq_next(struct seq_file *m,
+                  void *v,
+                  loff_t *pos)
+{
+    (*pos)++;
+    return category_seq_start(m, pos);
+}
+
+/**
+ * @brief seq_file stop, nothing to release between chunks.
+ */
+static
+void
+category_seq_stop(struct seq_file *m,
+                  void *v)
+{
+}
+
+/**
+ * @brief write a value as a line, or the values in an object or
+ * array as one line each.
  * 
- * @param file - pointer to /proc file struct in kernel space
- * @param user_buffer - buffer which the function data will be copied
- * @param available_bytes - number of bytes the reader is allowed to read
- * @param offset - offset for start of read within the file.
- *                 This is passed by the VFS layer whenever the function is called. 
- *                 Persists in the fd managed by the kernel.
+ * Nested values are named by their path, e.g. cpus.0.frequency.
  * 
- * @return size of the read in bytes
+ * @param m - the seq_file being read.
+ * @param path - name of the value.
+ * @param kvp - the value to write.
+ * @param stale - the value is the step's last good value, served
+ *                because the step ran over its time budget.
  */
-ssize_t
-sysinfo_proc_read(struct file *file,
-                  char __user *user_buffer,
-                  size_t available_bytes,
-                  loff_t *offset)
+static
+void
+category_seq_show_value(struct seq_file *m,
+                        const char* path,
+                        const key_value_pair* kvp,
+                        bool stale)
 {
-    char read_buf[PROCFS_MAX_SIZE];
-    int msg_len;
+    char child_path[PROC_VALUE_PATH_LEN];
 
-    // if starting the read, get the current_info_type
-    // this prevents multiple get_current_info_type calls
-    if (*offset == 0)
+    if (kvp->type != JOB_VALUE_OBJECT && kvp->type != JOB_VALUE_ARRAY)
     {
-        current_info_type = get_current_job()->job_title;
-        device_read_count = get_times_read();
-
-        // write to read_buf
-        // store count of bytes written in 'n'
-        msg_len = snprintf(read_buf, PROCFS_MAX_SIZE, "read_count: %d\ncurrent_info_type: %s\n", device_read_count, current_info_type);
-        if (msg_len <= 0)
-        {
-            pr_err("Could not write data to read_buf\n");
-            return -EFAULT;
-        }
+        // skip steps that failed to produce a value
+        if (kvp->value != NULL)
+            seq_printf(m, "%s: %s%s%s%s\n", path, kvp->value,
+                       kvp->unit ? " " : "", kvp->unit ? kvp->unit : "",
+                       stale ? " (stale)" : "");
+        return;
     }
 
-    // when the offset value is greater then the length of the
-    // string to copy, EOF condition has been met.
-    if (*offset >= msg_len)
+    for (int i = 0; i < kvp->child_count; i++)
     {
-        printk("EOF condition reached\n");
-        return EOF;
+        const key_value_pair* child = &kvp->children[i];
+
+        if (child->key != NULL)
+            snprintf(child_path, sizeof(child_path), "%s.%s", path, child->key);
+        else
+            snprintf(child_path, sizeof(child_path), "%s.%d", path, i);
+        category_seq_show_value(m, child_path, child, stale);
     }
+}
 
-    // copy n bytes from read_buf, starting at offset position within read_buf
-    int ret = copy_to_user(user_buffer, &read_buf + *offset, msg_len);
-    if (ret != 0)
+/**
+ * @brief seq_file show, writes one key_value_pair.
+ */
+static
+int
+category_seq_show(struct seq_file *m,
+                  void *v)
+{
+    key_value_pair* kvp = v;
+
+    if (kvp->key != NULL)
+        category_seq_show_value(m, kvp->key, kvp, kvp->stale);
+
+    return 0;
+}
+
+static const struct seq_operations category_seq_ops = {
+    .start = category_seq_start,
+    .next = category_seq_next,
+    .stop = category_seq_stop,
+    .show = category_seq_show,
+};
+
+/**
+ * @brief function to run when a category entry is opened.
+ * 
+ * Runs the category's job once and keeps the result for
+ * the lifetime of the open file.
+ * 
+ * @param inode - pointer to proc file inode.
+ * @param file - the file being opened.
+ * 
+ * @return status code
+ */
+static
+int
+category_proc_open(struct inode *inode,
+                   struct file *file)
+{
+    struct sysinfo_category* category = pde_data(inode);
+    struct proc_category_iter* iter;
+
+    iter = __seq_open_private(file, &category_seq_ops, sizeof(struct proc_category_iter));
+    if (iter == NULL)
+        return -ENOMEM;
+
+    // the entry is removed before the category is freed, so it is valid here
+    registry_get(category);
+    iter->category = category;
+
+    iter->result = collect_job(category->job);
+    if (iter->result == NULL)
     {
-        pr_err("An error occurred copying internal buffer in /proc read() to user space buffer\n");
-        return -EFAULT;
+        pr_err("Could not run job for /proc/%s/%s\n", PROC_FILE_NAME, category->job->job_title);
+        registry_put(category);
+        seq_release_private(inode, file);
+        return -ENOMEM;
     }
 
-    // update the offset to track read progress
-    *offset += msg_len;
+    return 0;
+}
 
-    return msg_len;
-};
+/**
+ * @brief function to run when a category entry is closed.
+ */
+static
+int
+category_proc_release(struct inode *inode,
+                      struct file *file)
+{
+    struct seq_file *m = file->private_data;
+    struct proc_category_iter* iter = m->private;
 
-// proc file entry in kernel for this file
-struct proc_dir_entry *proc_entry;
+    free_job_result(iter->result);
+    registry_put(iter->category);
+    return seq_release_private(inode, file);
+}
 
-static const struct proc_ops proc_ops = {
-    .proc_read = sysinfo_proc_read,
-    .proc_open = sysinfo_proc_open,
+static const struct proc_ops category_proc_ops = {
+    .proc_open = category_proc_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = category_proc_release,
 };
 
 /**
- * @brief function to initialize /proc file
+ * @brief show the module stats entry.
+ * 
+ * @param m - the seq_file being read.
+ * @param v - unused.
+ * 
+ * @return status code
+ */
+static
+int
+stats_proc_show(struct seq_file *m,
+                void *v)
+{
+    struct sysinfo_category* category = registry_get_current();
+
+    seq_printf(m, "current_info_type: %s\n", category ? category->job->job_title : "none");
+    registry_put(category);
+    stats_show(m);
+
+    return 0;
+}
+
+/**
+ * @brief add the entry for a category to /proc/sysinfo.
+ * 
+ * @param category - the category, freed only after the entry
+ *                   is removed with procfs_remove_category().
+ * 
+ * @return the entry, NULL if it could not be created.
+ */
+struct proc_dir_entry*
+procfs_add_category(struct sysinfo_category* category)
+{
+    const char* name = category->job->job_title;
+    struct proc_dir_entry* entry;
+
+    if (proc_dir == NULL || strcmp(name, PROC_STATS_FILE_NAME) == 0)
+    {
+        pr_warn("No /proc/%s entry for category %s\n", PROC_FILE_NAME, name);
+        return NULL;
+    }
+
+    entry = proc_create_data(name, 0444, proc_dir, &category_proc_ops, category);
+    if (entry == NULL)
+        pr_warn("Failed to create /proc/%s/%s\n", PROC_FILE_NAME, name);
+
+    return entry;
+}
+
+/**
+ * @brief remove the entry for a category from /proc/sysinfo.
+ * 
+ * Waits for running opens and reads, and releases every file
+ * that has the entry open.
+ * 
+ * @param entry - the entry, may be NULL.
+ */
+void
+procfs_remove_category(struct proc_dir_entry* entry)
+{
+    proc_remove(entry);
+}
+
+/**
+ * @brief function to initialize /proc files
  * 
- * Creates a proc entry in kernel space. Sets permissions 
- * and operations on that file.
+ * Creates the /proc/sysinfo directory and the stats entry.
+ * Categories add their entries when they are registered.
  * 
  * @return int status code
  */
@@ -110,51 +291,37 @@ int
 __init
 char_device_proc_init(void)
 {
-    // Create the proc file at /proc/PROC_FILE_NAME.
-    // Pass NULL as pointer for parent proc directory, as this is a child file of /proc
-    proc_entry = proc_create(PROC_FILE_NAME, 0666, NULL, &proc_ops);
-    if (!proc_entry) {
+    // Create the directory at /proc/PROC_FILE_NAME.
+    // Pass NULL as pointer for parent proc directory, as this is a child of /proc
+    proc_dir = proc_mkdir(PROC_FILE_NAME, NULL);
+    if (!proc_dir) {
         pr_err("Failed to create /proc/%s\n", PROC_FILE_NAME);
         // entry will fail if system runs out of memory
         return -ENOMEM;
     }
 
+    if (!proc_create_single(PROC_STATS_FILE_NAME, 0444, proc_dir, stats_proc_show))
+    {
+        pr_err("Failed to create entries in /proc/%s\n", PROC_FILE_NAME);
+        proc_remove(proc_dir);
+        proc_dir = NULL;
+        return -ENOMEM;
+    }
+
     pr_info("/proc/%s created\n", PROC_FILE_NAME);
     return 0;
 };
 
 /**
- * @brief function to remove /proc file
+ * @brief function to remove /proc files, when the module unloads
+ *        or fails to load.
  */
 void
-__exit
 char_device_proc_exit(void)
 {
-    // Remove the proc file
-    proc_remove(proc_entry);
+    // Remove the directory and every entry in it
+    proc_remove(proc_dir);
     pr_info("/proc/%s removed\n", PROC_FILE_NAME);
 };
 
-int
-append_to_proc(struct seq_file *m,
-               void *v)
-{
-    return 0;
-};
-
-/**
- * @brief function to run when proc file is opened.
- * 
- * @param inode - pointer to proc file inode.
- * @param file - function to call on open of proc file.
- * 
- * @return status code
- */
-int
-sysinfo_proc_open(struct inode *inode,
-             struct file *file)
-{
-    return single_open(file, append_to_proc, NULL);
-}
-
-MODULE_LICENSE("GPL");
\ No newline at end of file
+MODULE_LICENSE("GPL");
@@ -7,10 +7,11 @@
 
 #define PROC_FILE_NAME "sysinfo"
 
-ssize_t sysinfo_proc_read(struct file *file, char *whatever_char, size_t whatever_size,  loff_t *offset);
-int append_to_proc(struct seq_file *m, void *v);
-int my_proc_open(struct inode *inode, struct file *file);
+struct sysinfo_category;
+
 int char_device_proc_init(void);
 void char_device_proc_exit(void);
+struct proc_dir_entry* procfs_add_category(struct sysinfo_category* category);
+void procfs_remove_category(struct proc_dir_entry* entry);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,346 @@
+/**
+ * registry.c
+ * 
+ * The registry of sysinfo categories. The cpu, memory, disk, cgroup
+ * and irq jobs are registered when the module loads, and other
+ * modules can register jobs of their own with
+ * register_sysinfo_job(), to publish their counters through
+ * /dev/sysinfo and /proc/sysinfo.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "disk.h"
+#include "cgroup.h"
+#include "irq.h"
+#include "procfs.h"
+#include "sampler.h"
+#include "registry.h"
+
+static DEFINE_IDR(registry_idr);                // registered categories, by id
+static DEFINE_MUTEX(registry_mutex);            // protects registry_idr and current_id
+static int current_id = SYSINFO_CATEGORY_CPU;   // id of the category read from the device
+
+/**
+ * @brief wake up the unregister waiting for the last reference.
+ */
+static
+void
+registry_release(struct kref *ref)
+{
+    struct sysinfo_category* cat = container_of(ref, struct sysinfo_category, ref);
+
+    complete(&cat->released);
+}
+
+/**
+ * @brief take a reference on a category.
+ * 
+ * @param cat - the category, which the caller must already hold
+ *              a reference on or keep registered.
+ */
+void
+registry_get(struct sysinfo_category* cat)
+{
+    kref_get(&cat->ref);
+}
+
+/**
+ * @brief drop a reference on a category.
+ * 
+ * @param cat - the category, may be NULL.
+ */
+void
+registry_put(struct sysinfo_category* cat)
+{
+    if (cat != NULL)
+        kref_put(&cat->ref, registry_release);
+}
+
+/**
+ * @brief get the category read from the device.
+ * 
+ * @return pointer to the category with a reference held for the
+ *         caller, NULL if it is not registered.
+ */
+struct sysinfo_category*
+registry_get_current(void)
+{
+    struct sysinfo_category* cat;
+
+    mutex_lock(&registry_mutex);
+    cat = idr_find(&registry_idr, current_id);
+    if (cat != NULL)
+        registry_get(cat);
+    mutex_unlock(&registry_mutex);
+
+    return cat;
+}
+
+/**
+ * @brief get a category by id.
+ * 
+ * @param id - id of the category.
+ * 
+ * @return pointer to the category with a reference held for the
+ *         caller, NULL if no category has that id.
+ */
+struct sysinfo_category*
+registry_find(int id)
+{
+    struct sysinfo_category* cat;
+
+    mutex_lock(&registry_mutex);
+    cat = id > 0 ? idr_find(&registry_idr, id) : NULL;
+    if (cat != NULL)
+        registry_get(cat);
+    mutex_unlock(&registry_mutex);
+
+    return cat;
+}
+
+/**
+ * @brief set the category read from the device.
+ * 
+ * @param id - id of the category.
+ * 
+ * @return 0 on success, -ENOENT if no category has that id.
+ */
+int
+registry_set_current(int id)
+{
+    int err = 0;
+
+    mutex_lock(&registry_mutex);
+    if (id > 0 && idr_find(&registry_idr, id) != NULL)
+        current_id = id;
+    else
+        err = -ENOENT;
+    mutex_unlock(&registry_mutex);
+
+    return err;
+}
+
+/**
+ * @brief describe the registered categories, in id order.
+ * 
+ * @param infos - array to fill in.
+ * @param max - number of entries in infos.
+ * 
+ * @return number of registered categories, which can be more
+ *         than max.
+ */
+int
+registry_list(struct sysinfo_category_info* infos,
+              int max)
+{
+    struct sysinfo_category* cat;
+    int count = 0;
+    int id;
+
+    mutex_lock(&registry_mutex);
+    idr_for_each_entry(&registry_idr, cat, id)
+    {
+        if (count < max)
+        {
+            struct sysinfo_category_info* info = &infos[count];
+
+            memset(info, 0, sizeof(struct sysinfo_category_info));
+            info->id = id;
+            info->step_count = cat->job->step_count;
+            info->flags = id == current_id ? SYSINFO_CATEGORY_CURRENT : 0;
+            strscpy(info->name, cat->job->job_title, sizeof(info->name));
+        }
+        count++;
+    }
+    mutex_unlock(&registry_mutex);
+
+    return count;
+}
+
+/**
+ * @brief check that a job title can name a category.
+ * 
+ * Titles name the category's /proc/sysinfo entry, so they
+ * must be a valid file name.
+ */
+static
+bool
+registry_title_valid(const char* title)
+{
+    return title != NULL &&
+           title[0] != '\0' &&
+           strnlen(title, SYSINFO_CATEGORY_NAME_LEN) < SYSINFO_CATEGORY_NAME_LEN &&
+           strchr(title, '/') == NULL;
+}
+
+/**
+ * @brief Register a job as a sysinfo category.
+ * 
+ * @param job - the job, usually defined with DEFINE_JOB().
+ * 
+ * @return id of the category, -EINVAL if the job's title is not
+ *         valid, -EEXIST if a category already has that title,
+ *         -ENOSPC if SYSINFO_MAX_CATEGORIES are registered,
+ *         -ENOMEM on allocation failure.
+ */
+int
+register_sysinfo_job(const Job* job)
+{
+    struct sysinfo_category* cat;
+    struct sysinfo_category* other;
+    int id;
+
+    if (job == NULL || !registry_title_valid(job->job_title))
+        return -EINVAL;
+
+    cat = kzalloc(sizeof(struct sysinfo_category), GFP_KERNEL);
+    if (cat == NULL)
+        return -ENOMEM;
+    kref_init(&cat->ref);
+    init_completion(&cat->released);
+    atomic64_set(&cat->sample_seq, 0);
+    cat->job = job;
+
+    mutex_lock(&registry_mutex);
+    idr_for_each_entry(&registry_idr, other, id)
+    {
+        if (strcmp(other->job->job_title, job->job_title) == 0)
+        {
+            mutex_unlock(&registry_mutex);
+            kfree(cat);
+            return -EEXIST;
+        }
+    }
+
+    id = idr_alloc(&registry_idr, cat, 1, SYSINFO_MAX_CATEGORIES + 1, GFP_KERNEL);
+    if (id < 0)
+    {
+        mutex_unlock(&registry_mutex);
+        kfree(cat);
+        return id;
+    }
+    cat->id = id;
+
+    // without a /proc entry the category can still be read from the device
+    cat->proc = procfs_add_category(cat);
+    mutex_unlock(&registry_mutex);
+
+    pr_info("Registered sysinfo category %s with id %d\n", job->job_title, id);
+    return id;
+}
+EXPORT_SYMBOL_GPL(register_sysinfo_job);
+
+/**
+ * @brief remove a category, and wait until it is no longer used.
+ * 
+ * @param id - id of the category.
+ * @param resample - take a new sample if the category was being
+ *                   read from the device.
+ * 
+ * @return true if the category was registered.
+ */
+static
+bool
+registry_remove(int id,
+                bool resample)
+{
+    struct sysinfo_category* cat;
+    bool was_current;
+
+    mutex_lock(&registry_mutex);
+    cat = id > 0 ? idr_remove(&registry_idr, id) : NULL;
+    was_current = cat != NULL && current_id == id;
+    if (was_current)
+        current_id = SYSINFO_CATEGORY_CPU;
+    mutex_unlock(&registry_mutex);
+
+    if (cat == NULL)
+        return false;
+
+    // closes open /proc entries, which drops their references
+    procfs_remove_category(cat->proc);
+
+    // readers move on to the cpu category straight away
+    if (was_current && resample)
+        sampler_sample_now();
+    // the latest sample can still be of this category if no new one could be taken
+    sampler_drop_category(cat);
+
+    registry_put(cat);
+    wait_for_completion(&cat->released);
+
+    // nothing collects the job any more, wait for steps that ran over their budget
+    job_flush_budgets(cat->job);
+
+    pr_info("Unregistered sysinfo category %s\n", cat->job->job_title);
+    kfree(cat);
+
+    return true;
+}
+
+/**
+ * @brief Unregister a category.
+ * 
+ * @param id - id returned by register_sysinfo_job().
+ */
+void
+unregister_sysinfo_job(int id)
+{
+    if (!registry_remove(id, true))
+        pr_warn("No sysinfo category with id %d to unregister\n", id);
+}
+EXPORT_SYMBOL_GPL(unregister_sysinfo_job);
+
+/**
+ * @brief register the built in categories.
+ * 
+ * Registered in order into an empty registry, so their ids are
+ * SYSINFO_CATEGORY_CPU, SYSINFO_CATEGORY_MEMORY,
+ * SYSINFO_CATEGORY_DISK, SYSINFO_CATEGORY_CGROUP,
+ * SYSINFO_CATEGORY_CGROUP_TOP and SYSINFO_CATEGORY_IRQ.
+ * 
+ * @return 0 on success, negative error code otherwise.
+ */
+int
+registry_init(void)
+{
+    static const Job* const builtin_jobs[] = { &cpu_job, &memory_job, &disk_job, &cgroup_job, &cgroup_top_job, &irq_job };
+
+    for (int i = 0; i < ARRAY_SIZE(builtin_jobs); i++)
+    {
+        int id = register_sysinfo_job(builtin_jobs[i]);
+        if (id < 0)
+        {
+            pr_err("Could not register sysinfo category %s (%d)\n", builtin_jobs[i]->job_title, id);
+            registry_exit();
+            return id;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief unregister every category.
+ * 
+ * Called once sampling has stopped. Modules that registered
+ * categories use this module's symbols, so are unloaded first,
+ * and only the built in categories are left.
+ */
+void
+registry_exit(void)
+{
+    for (int id = 1; id <= SYSINFO_MAX_CATEGORIES; id++)
+        registry_remove(id, false);
+
+    idr_destroy(&registry_idr);
+}
@@ -0,0 +1,61 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/types.h>
+#include "job.h"
+#include "sysinfo_ioctl.h"
+
+struct proc_dir_entry;
+
+/**
+ * A registered sysinfo category: a job that can be read from
+ * /dev/sysinfo and from its entry in /proc/sysinfo.
+ *
+ * Categories are reference counted. Samples and open /proc
+ * entries hold a reference while they use the job's values, and
+ * unregistering waits until the last one is dropped, so the
+ * module that registered the job can then be unloaded.
+ */
+struct sysinfo_category {
+    struct kref ref;
+    int id;                                     // SYSINFO_CATEGORY_* or a dynamic id
+    const Job* job;                             // the category's job, owned by the registering module
+    struct proc_dir_entry* proc;                // entry in /proc/sysinfo, NULL if it could not be created
+    struct completion released;                 // completed when the last reference is dropped
+    atomic64_t sample_seq;                      // sequence number of the category's last sample
+};
+
+/**
+ * Register a job as a sysinfo category.
+ *
+ * The job's title names the category, and must be unique,
+ * shorter than SYSINFO_CATEGORY_NAME_LEN and not contain '/'.
+ * The job must stay valid until unregister_sysinfo_job() returns.
+ *
+ * @param job - the job, usually defined with DEFINE_JOB().
+ * @return id of the category, or negative error code.
+ */
+int register_sysinfo_job(const Job* job);
+
+/**
+ * Unregister a category. Readers of the category are switched
+ * to the cpu category. Waits until no sample or open file uses
+ * the category's values any more.
+ *
+ * @param id - id returned by register_sysinfo_job().
+ */
+void unregister_sysinfo_job(int id);
+
+int registry_init(void);
+void registry_exit(void);
+struct sysinfo_category* registry_get_current(void);
+struct sysinfo_category* registry_find(int id);
+void registry_get(struct sysinfo_category* cat);
+void registry_put(struct sysinfo_category* cat);
+int registry_set_current(int id);
+int registry_list(struct sysinfo_category_info* infos, int max);
+
+#endif
@@ -0,0 +1,413 @@
+/**
+ * sampler.c
+ * 
+ * Periodic sampling, independent of reads on the device.
+ * Runs every sample_interval_ms milliseconds on the system
+ * workqueue, evaluates the registered alert thresholds and,
+ * while the device is open, publishes a sample of the current
+ * category for readers to share. Categories with netlink
+ * listeners are sampled and multicast to them.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include "alert.h"
+#include "instrument.h"
+#include "netlink.h"
+#include "stats.h"
+#include "sysinfo_trace.h"
+#include "sampler.h"
+
+// shortest interval between samples, in milliseconds
+#define SAMPLER_MIN_INTERVAL_MS 10
+
+static unsigned int sample_interval_ms = 1000;
+module_param(sample_interval_ms, uint, 0644);
+MODULE_PARM_DESC(sample_interval_ms, "Interval between samples in milliseconds (default 1000)");
+
+static void sampler_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(sampler_work, sampler_work_fn);
+
+static struct kmem_cache* sample_cache;        // struct sysinfo_sample
+static struct sysinfo_sample* latest_sample;    // most recent sample, NULL before the first one
+static DEFINE_SPINLOCK(latest_sample_lock);     // protects latest_sample
+static atomic64_t latest_seq = ATOMIC64_INIT(0);    // sequence number of latest_sample
+static DEFINE_MUTEX(sample_mutex);              // serializes taking and publishing samples
+static DECLARE_WAIT_QUEUE_HEAD(sample_wait);    // readers waiting for the next sample
+static atomic_t reader_count = ATOMIC_INIT(0);  // number of open files on the device
+static const JobContext sample_ctx = { .sampled = true };   // samples keep the baselines of deltas
+
+/**
+ * @brief free a sample once its last reference is dropped.
+ */
+static
+void
+sample_release(struct kref *ref)
+{
+    struct sysinfo_sample* sample = container_of(ref, struct sysinfo_sample, ref);
+
+    free_job_result(sample->result);
+    snapshot_put(sample->snapshot);
+    registry_put(sample->category);
+    kmem_cache_free(sample_cache, sample);
+}
+
+/**
+ * @brief drop a reference on a sample.
+ * 
+ * @param sample - the sample, may be NULL.
+ */
+void
+sample_put(struct sysinfo_sample* sample)
+{
+    if (sample != NULL)
+        kref_put(&sample->ref, sample_release);
+}
+
+/**
+ * @brief run the current category's job and serialize it into
+ *        a new sample.
+ * 
+ * @return pointer to the sample with one reference held,
+ *         NULL on error.
+ */
+static
+struct sysinfo_sample*
+sample_create(void)
+{
+    struct sysinfo_sample* sample;
+    char* data;
+    u64 start_ns;
+
+    sample = kmem_cache_zalloc(sample_cache, GFP_KERNEL);
+    if (sample == NULL)
+        return NULL;
+    kref_init(&sample->ref);
+
+    sample->category = registry_get_current();
+    if (sample->category == NULL)
+    {
+        pr_err("No sysinfo category to sample\n");
+        sample_put(sample);
+        return NULL;
+    }
+
+    sample->result = collect_job_ctx(sample->category->job, &sample_ctx);
+    if (sample->result == NULL)
+    {
+        pr_err("Could not collect sample of current job\n");
+        sample_put(sample);
+        return NULL;
+    }
+    instrument_job(sample->result);
+    // numbered per category, so readers can tell when they missed a sample
+    sample->result->seq = atomic64_inc_return(&sample->category->sample_seq);
+
+    start_ns = ktime_get_ns();
+    data = serialize_job_result(sample->result, NULL);
+    instrument_serialize(ktime_get_ns() - start_ns);
+    if (data == NULL)
+    {
+        sample_put(sample);
+        return NULL;
+    }
+
+    sample->snapshot = snapshot_create(data, strlen(data));
+    kfree(data);
+    if (sample->snapshot == NULL)
+    {
+        sample_put(sample);
+        return NULL;
+    }
+
+    return sample;
+}
+
+/**
+ * @brief take a sample now and publish it to readers.
+ * 
+ * Used by the sampler work, and when the current category
+ * changes so that readers see the new job straight away.
+ * 
+ * @return 0 on success, -ENOMEM if the sample could not be taken.
+ */
+int
+sampler_sample_now(void)
+{
+    struct sysinfo_sample* sample;
+    struct sysinfo_sample* old;
+
+    mutex_lock(&sample_mutex);
+    sample = sample_create();
+    if (sample == NULL)
+    {
+        mutex_unlock(&sample_mutex);
+        return -ENOMEM;
+    }
+
+    // latest_sample holds a reference, this function keeps its own until it is done
+    kref_get(&sample->ref);
+    spin_lock(&latest_sample_lock);
+    old = latest_sample;
+    sample->seq = atomic64_read(&latest_seq) + 1;
+    latest_sample = sample;
+    atomic64_set(&latest_seq, sample->seq);
+    spin_unlock(&latest_sample_lock);
+    mutex_unlock(&sample_mutex);
+
+    trace_sysinfo_sample_publish(sample->result->job_title, sample->seq, sample->snapshot->len);
+    sample_put(old);
+    stats_inc(STATS_SAMPLES);
+    wake_up_interruptible_all(&sample_wait);
+
+    // netlink listeners get the same sample as readers of the device
+    sysinfo_netlink_publish(sample->result, sample->category->id);
+    sample_put(sample);
+
+    return 0;
+}
+
+/**
+ * @brief drop the latest sample if it is of a category.
+ * 
+ * Used when a category is unregistered, so that the latest sample
+ * does not keep it in use. Readers wait for the next sample.
+ * 
+ * @param cat - the category being unregistered.
+ */
+void
+sampler_drop_category(struct sysinfo_category* cat)
+{
+    struct sysinfo_sample* old = NULL;
+
+    spin_lock(&latest_sample_lock);
+    if (latest_sample != NULL && latest_sample->category == cat)
+    {
+        old = latest_sample;
+        latest_sample = NULL;
+    }
+    spin_unlock(&latest_sample_lock);
+
+    sample_put(old);
+}
+
+/**
+ * @brief get the most recent sample.
+ * 
+ * @return pointer to the sample with a reference held for the
+ *         caller, NULL if no sample has been taken yet.
+ */
+struct sysinfo_sample*
+sampler_get_latest(void)
+{
+    struct sysinfo_sample* sample;
+
+    spin_lock(&latest_sample_lock);
+    sample = latest_sample;
+    if (sample != NULL)
+        kref_get(&sample->ref);
+    spin_unlock(&latest_sample_lock);
+
+    return sample;
+}
+
+/**
+ * @brief get the sequence number of the most recent sample.
+ * 
+ * @return sequence number, 0 if no sample has been taken yet.
+ */
+u64
+sampler_latest_seq(void)
+{
+    return atomic64_read(&latest_seq);
+}
+
+/**
+ * @brief wait for a sample newer than seen_seq.
+ * 
+ * @param seen_seq - sequence number of the last sample the reader saw.
+ * @param nonblock - return -EAGAIN instead of waiting.
+ * 
+ * @return 0 once a newer sample exists, -EAGAIN if nonblock is set
+ *         and there is none, -ERESTARTSYS if interrupted.
+ */
+int
+sampler_wait_for_sample(u64 seen_seq,
+                        bool nonblock)
+{
+    if (sampler_latest_seq() != seen_seq)
+        return 0;
+
+    if (nonblock)
+        return -EAGAIN;
+
+    if (wait_event_interruptible(sample_wait, sampler_latest_seq() != seen_seq))
+        return -ERESTARTSYS;
+
+    return 0;
+}
+
+/**
+ * @brief get the wait queue woken on every new sample, for poll().
+ */
+wait_queue_head_t*
+sampler_waitqueue(void)
+{
+    return &sample_wait;
+}
+
+/**
+ * @brief register an open file, so samples of the job are taken.
+ * 
+ * The first reader takes a sample straight away, so that its
+ * first read does not wait for the next interval.
+ */
+void
+sampler_add_reader(void)
+{
+    if (atomic_inc_return(&reader_count) == 1)
+        sampler_sample_now();
+}
+
+/**
+ * @brief unregister an open file.
+ */
+void
+sampler_remove_reader(void)
+{
+    atomic_dec(&reader_count);
+}
+
+/**
+ * @brief sample the categories with netlink listeners, and
+ *        multicast the samples to them.
+ * 
+ * @param skip_id - id of a category already sampled, and
+ *                  multicast, this interval. 0 if none.
+ */
+static
+void
+sampler_sample_listeners(int skip_id)
+{
+    struct sysinfo_category* cat;
+    JobResult* r;
+
+    for (int id = 1; id <= SYSINFO_MAX_CATEGORIES; id++)
+    {
+        if (id == skip_id || !sysinfo_netlink_has_listeners(id))
+            continue;
+
+        cat = registry_find(id);
+        if (cat == NULL)
+            continue;
+
+        // numbered with the category's other samples, under the same lock
+        mutex_lock(&sample_mutex);
+        r = collect_job_ctx(cat->job, &sample_ctx);
+        if (r != NULL)
+        {
+            instrument_job(r);
+            r->seq = atomic64_inc_return(&cat->sample_seq);
+        }
+        mutex_unlock(&sample_mutex);
+
+        if (r != NULL)
+        {
+            sysinfo_netlink_publish(r, id);
+            stats_inc(STATS_SAMPLES);
+            free_job_result(r);
+        }
+        registry_put(cat);
+    }
+}
+
+/**
+ * @brief take one sample and schedule the next.
+ * 
+ * @param work - the sampler work item.
+ */
+static
+void
+sampler_work_fn(struct work_struct *work)
+{
+    unsigned int interval_ms = max_t(unsigned int, READ_ONCE(sample_interval_ms), SAMPLER_MIN_INTERVAL_MS);
+    struct sysinfo_sample* sample;
+    int sampled_id = 0;
+
+    alert_evaluate();
+
+    // only sample the job while someone can read it
+    if (atomic_read(&reader_count) > 0 && sampler_sample_now() == 0)
+    {
+        sample = sampler_get_latest();
+        if (sample != NULL)
+            sampled_id = sample->category->id;
+        sample_put(sample);
+    }
+
+    sampler_sample_listeners(sampled_id);
+
+    schedule_delayed_work(&sampler_work, msecs_to_jiffies(interval_ms));
+}
+
+/**
+ * @brief create the slab cache for samples.
+ * 
+ * Called when the module loads, before anything can be sampled.
+ * 
+ * @return 0 on success, -ENOMEM if the cache could not be created.
+ */
+int
+sampler_cache_init(void)
+{
+    sample_cache = KMEM_CACHE(sysinfo_sample, 0);
+    if (sample_cache == NULL)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/**
+ * @brief destroy the slab cache for samples, once sampling has
+ *        stopped and every sample has been put.
+ */
+void
+sampler_cache_exit(void)
+{
+    kmem_cache_destroy(sample_cache);
+    sample_cache = NULL;
+}
+
+/**
+ * @brief start sampling.
+ */
+void
+sampler_init(void)
+{
+    schedule_delayed_work(&sampler_work, 0);
+}
+
+/**
+ * @brief stop sampling, waiting for a running sample to finish,
+ *        and drop the latest sample.
+ */
+void
+sampler_exit(void)
+{
+    cancel_delayed_work_sync(&sampler_work);
+
+    spin_lock(&latest_sample_lock);
+    sample_put(latest_sample);
+    latest_sample = NULL;
+    spin_unlock(&latest_sample_lock);
+}
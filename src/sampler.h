@@ -0,0 +1,36 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <linux/kref.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include "job.h"
+#include "registry.h"
+#include "snapshot.h"
+
+/**
+ * One sample of the current job, shared by every reader.
+ */
+struct sysinfo_sample {
+    struct kref ref;
+    u64 seq;                                    // sequence number across categories, the first sample is 1
+    struct sysinfo_category* category;          // category sampled, referenced while result is held
+    JobResult* result;                          // values collected for the sample
+    struct sysinfo_snapshot* snapshot;          // result serialized as a full document
+};
+
+int sampler_cache_init(void);
+void sampler_cache_exit(void);
+void sampler_init(void);
+void sampler_exit(void);
+void sampler_add_reader(void);
+void sampler_remove_reader(void);
+int sampler_sample_now(void);
+struct sysinfo_sample* sampler_get_latest(void);
+void sample_put(struct sysinfo_sample* sample);
+void sampler_drop_category(struct sysinfo_category* cat);
+u64 sampler_latest_seq(void);
+int sampler_wait_for_sample(u64 seen_seq, bool nonblock);
+wait_queue_head_t* sampler_waitqueue(void);
+
+#endif
@@ -0,0 +1,511 @@
+/**
+ * scope.c
+ *
+ * Scopes the values a reader gets to its container. The reader's
+ * cgroup and pid namespace are found when it opens the device,
+ * and once it asks for container scope, the cpu and memory
+ * categories are limited to what its cgroup can use, like lxcfs
+ * does for /proc files.
+ *
+ * Samples are shared by every reader, so a scoped reader gets a
+ * copy of the sample with the scoped values changed.
+ *
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+#include <linux/pid_namespace.h>
+#include <linux/cgroup.h>
+#include <linux/namei.h>
+#include <linux/dcache.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+#include "cgroup.h"
+#include "cpu.h"
+#include "memory.h"
+#include "scope.h"
+
+/**
+ * Limits of a cgroup and its ancestors, and its use.
+ */
+struct scope_limits {
+    u64 memory_max;                             // lowest memory.max, in bytes, U64_MAX if none
+    u64 swap_max;                               // lowest memory.swap.max, in bytes, U64_MAX if none
+    u64 cpus;                                   // lowest cpu.max quota, in whole CPUs, U64_MAX if none
+    u64 memory_current;                         // memory used by the cgroup, in bytes
+    u64 swap_current;                           // swap used by the cgroup, in bytes
+};
+
+/**
+ * @brief find the reader's cgroup in the cgroup2 hierarchy.
+ *
+ * A reader in a cgroup namespace is scoped to the root of its
+ * namespace, which is its container's cgroup even when the reader
+ * runs in a child of it. Other readers are scoped to their own
+ * cgroup.
+ *
+ * @param scope - the reader's scope, the cgroup is set on success.
+ */
+static
+void
+scope_find_cgroup(struct sysinfo_scope* scope)
+{
+#ifdef CONFIG_CGROUPS
+    struct cgroup_namespace* ns = current->nsproxy->cgroup_ns;
+    struct cgroup* cgrp;
+    struct path root;
+    char* buf;
+    int len;
+
+    // the hierarchy as mounted when the module loaded, not the reader's own mount
+    if (sysinfo_cgroup_root(&root) != 0)
+        return;
+
+    buf = kmalloc(PATH_MAX, GFP_KERNEL);
+    if (buf == NULL)
+    {
+        path_put(&root);
+        return;
+    }
+
+    rcu_read_lock();
+    cgrp = ns->root_cset->dfl_cgrp;
+    if (cgroup_parent(cgrp) != NULL)
+        scope->flags |= SYSINFO_SCOPE_CGROUP_NS;
+    else
+        cgrp = task_dfl_cgroup(current);
+    len = cgroup_path(cgrp, buf, PATH_MAX);
+    rcu_read_unlock();
+
+    // the path starts with '/', and is looked up relative to the root
+    if (len > 0 && len < PATH_MAX)
+    {
+        int err = 0;
+
+        if (buf[1] == '\0')
+        {
+            scope->cgroup = root;
+            path_get(&scope->cgroup);
+        }
+        else
+        {
+            err = vfs_path_lookup(root.dentry, root.mnt, buf + 1, LOOKUP_DIRECTORY, &scope->cgroup);
+        }
+
+        if (err == 0)
+        {
+            scope->cgroup_path = kstrdup(buf, GFP_KERNEL);
+            scope->flags |= SYSINFO_SCOPE_CGROUP_FOUND;
+        }
+    }
+
+    kfree(buf);
+    path_put(&root);
+#endif
+}
+
+/**
+ * @brief Find the cgroup and pid namespace of the task opening
+ *        the device.
+ *
+ * Files start in host scope. A reader whose cgroup cannot be
+ * found can only use host scope.
+ *
+ * @return the scope of the new file, NULL on allocation failure.
+ */
+struct sysinfo_scope*
+scope_create(void)
+{
+    struct sysinfo_scope* scope = kzalloc(sizeof(struct sysinfo_scope), GFP_KERNEL);
+    if (scope == NULL)
+        return NULL;
+
+    scope->scope = SYSINFO_SCOPE_HOST;
+    scope->pid_ns_level = task_active_pid_ns(current)->level;
+    if (scope->pid_ns_level > 0)
+        scope->flags |= SYSINFO_SCOPE_PID_NS;
+
+    scope_find_cgroup(scope);
+
+    return scope;
+}
+
+/**
+ * @brief Free the scope of a file.
+ *
+ * @param scope - the scope, may be NULL.
+ */
+void
+scope_destroy(struct sysinfo_scope* scope)
+{
+    if (scope == NULL)
+        return;
+
+    if (scope->cgroup.mnt != NULL)
+        path_put(&scope->cgroup);
+    kfree(scope->cgroup_path);
+    kfree(scope);
+}
+
+/**
+ * @brief Get the cgroup a reader can select cgroups below: the
+ *        root of its cgroup namespace, or the whole hierarchy for
+ *        readers on the host.
+ *
+ * @param scope - the reader's scope.
+ * @param root - set to the cgroup's directory, with a reference
+ *               held for the caller to drop with path_put().
+ *
+ * @return 0 on success, -ENOENT if there is no cgroup2 hierarchy,
+ *         or if the reader is in a cgroup namespace whose root was
+ *         not found.
+ */
+int
+scope_cgroup_root(const struct sysinfo_scope* scope,
+                  struct path* root)
+{
+    if (!(scope->flags & SYSINFO_SCOPE_CGROUP_NS))
+        return sysinfo_cgroup_root(root);
+
+    if (scope->cgroup.mnt == NULL)
+        return -ENOENT;
+
+    *root = scope->cgroup;
+    path_get(root);
+    return 0;
+}
+
+/**
+ * @brief Set the scope of a file.
+ *
+ * @param scope - the file's scope.
+ * @param value - SYSINFO_SCOPE_HOST or SYSINFO_SCOPE_CONTAINER.
+ *
+ * @return 0 on success, -EINVAL if value is not a scope, -ENOENT
+ *         for container scope if the reader's cgroup was not found.
+ */
+int
+scope_set(struct sysinfo_scope* scope,
+          u32 value)
+{
+    if (value != SYSINFO_SCOPE_HOST && value != SYSINFO_SCOPE_CONTAINER)
+        return -EINVAL;
+
+    if (value == SYSINFO_SCOPE_CONTAINER && scope->cgroup.mnt == NULL)
+        return -ENOENT;
+
+    scope->scope = value;
+    return 0;
+}
+
+/**
+ * @brief Describe the scope of a file.
+ *
+ * @param scope - the file's scope.
+ * @param info - filled in with the scope.
+ */
+void
+scope_get_info(const struct sysinfo_scope* scope,
+               struct sysinfo_scope_info* info)
+{
+    memset(info, 0, sizeof(struct sysinfo_scope_info));
+    info->scope = scope->scope;
+    info->flags = scope->flags;
+    info->pid_ns_level = scope->pid_ns_level;
+    if (scope->cgroup_path != NULL)
+        strscpy(info->cgroup, scope->cgroup_path, sizeof(info->cgroup));
+}
+
+/**
+ * @brief read a number from a cgroup interface file.
+ *
+ * @return the number, or none if the file is missing or has no
+ *         limit ("max").
+ */
+static
+u64
+scope_read_u64(const struct path* dir,
+               const char* name,
+               u64 none)
+{
+    char* text = sysinfo_cgroup_read_value(dir, name);
+    u64 value;
+
+    if (text == NULL || kstrtou64(text, 10, &value) != 0)
+        value = none;
+    kfree(text);
+
+    return value;
+}
+
+/**
+ * @brief read the CPU quota of a cgroup, from cpu.max.
+ *
+ * @return the quota rounded up to whole CPUs, U64_MAX if none.
+ */
+static
+u64
+scope_read_cpus(const struct path* dir)
+{
+    char* text = sysinfo_cgroup_read_value(dir, "cpu.max");
+    u64 quota;
+    u64 period;
+    u64 cpus = U64_MAX;
+
+    // "max 100000" has no quota
+    if (text != NULL && sscanf(text, "%llu %llu", &quota, &period) == 2 && period > 0)
+        cpus = max_t(u64, DIV_ROUND_UP_ULL(quota, period), 1);
+    kfree(text);
+
+    return cpus;
+}
+
+/**
+ * @brief read the limits of the reader's cgroup and its ancestors,
+ *        as the lowest limit on the way to the root applies.
+ */
+static
+void
+scope_read_limits(const struct sysinfo_scope* scope,
+                  struct scope_limits* limits)
+{
+    struct path root;
+    struct path dir;
+
+    limits->memory_max = U64_MAX;
+    limits->swap_max = U64_MAX;
+    limits->cpus = U64_MAX;
+    limits->memory_current = scope_read_u64(&scope->cgroup, "memory.current", 0);
+    limits->swap_current = scope_read_u64(&scope->cgroup, "memory.swap.current", 0);
+
+    if (sysinfo_cgroup_root(&root) != 0)
+        return;
+
+    // the root cgroup has no limits of its own
+    dir = scope->cgroup;
+    path_get(&dir);
+    while (dir.dentry != root.dentry && !IS_ROOT(dir.dentry))
+    {
+        struct dentry* parent;
+
+        limits->memory_max = min(limits->memory_max, scope_read_u64(&dir, "memory.max", U64_MAX));
+        limits->swap_max = min(limits->swap_max, scope_read_u64(&dir, "memory.swap.max", U64_MAX));
+        limits->cpus = min(limits->cpus, scope_read_cpus(&dir));
+
+        parent = dget_parent(dir.dentry);
+        dput(dir.dentry);
+        dir.dentry = parent;
+    }
+    path_put(&dir);
+    path_put(&root);
+}
+
+/**
+ * @brief find a top level value of a JobResult by key.
+ *
+ * @return the value, NULL if the result has none.
+ */
+static
+key_value_pair*
+scope_find(JobResult* r,
+           const char* key)
+{
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        if (r->kvps[i].key != NULL && strcmp(r->kvps[i].key, key) == 0)
+            return &r->kvps[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief get a top level number of a JobResult.
+ *
+ * @return 0 on success, -ENOENT if the result has no such number.
+ */
+static
+int
+scope_get_number(JobResult* r,
+                 const char* key,
+                 u64* value)
+{
+    key_value_pair* kvp = scope_find(r, key);
+
+    if (kvp == NULL || kvp->value == NULL)
+        return -ENOENT;
+
+    return kstrtou64(kvp->value, 10, value);
+}
+
+/**
+ * @brief replace a top level number of a JobResult. The value is
+ *        left out if it cannot be allocated.
+ */
+static
+void
+scope_set_number(JobResult* r,
+                 const char* key,
+                 u64 value)
+{
+    key_value_pair* kvp = scope_find(r, key);
+
+    if (kvp == NULL)
+        return;
+
+    kfree(kvp->value);
+    kvp->value = kasprintf(GFP_KERNEL, "%llu", value);
+}
+
+/**
+ * @brief scope a total and free pair of memory values, in kB, to
+ *        a cgroup's limit and use, in bytes.
+ */
+static
+void
+scope_memory_pair(JobResult* r,
+                  const char* total_key,
+                  const char* free_key,
+                  u64 max,
+                  u64 current)
+{
+    u64 total;
+    u64 free;
+    u64 used = current / 1024;
+
+    if (scope_get_number(r, total_key, &total) != 0)
+        return;
+
+    total = min(total, max / 1024);
+    scope_set_number(r, total_key, total);
+
+    if (scope_get_number(r, free_key, &free) == 0)
+        scope_set_number(r, free_key, min(free, total > used ? total - used : 0));
+}
+
+/**
+ * @brief limit the memory category to the memory the cgroup can
+ *        use.
+ *
+ * @param r - the memory category's result.
+ * @param limits - the limits and use of the cgroup.
+ */
+static
+void
+scope_memory(JobResult* r,
+             const struct scope_limits* limits)
+{
+    scope_memory_pair(r, "Total RAM", "Free RAM", limits->memory_max, limits->memory_current);
+    scope_memory_pair(r, "Total Swap", "Free Swap", limits->swap_max, limits->swap_current);
+}
+
+/**
+ * @brief check whether an element of the cpus array is of a CPU
+ *        in the mask, by its "cpu" label.
+ */
+static
+bool
+scope_cpu_in_mask(const key_value_pair* element,
+                  const struct cpumask* mask)
+{
+    unsigned int cpu;
+
+    for (int i = 0; i < element->child_count; i++)
+    {
+        const key_value_pair* kvp = &element->children[i];
+
+        if (kvp->type == JOB_VALUE_LABEL && kvp->value != NULL && strcmp(kvp->key, "cpu") == 0)
+            return kstrtouint(kvp->value, 10, &cpu) == 0 && cpu < nr_cpu_ids && cpumask_test_cpu(cpu, mask);
+    }
+
+    return true;
+}
+
+/**
+ * @brief limit the cpu category to the CPUs the cgroup can run on,
+ *        and the number of cores to its CPU quota.
+ *
+ * @param r - the cpu category's result.
+ * @param scope - the scope of the reader.
+ * @param limits - the limits and use of the cgroup.
+ */
+static
+void
+scope_cpu(JobResult* r,
+          const struct sysinfo_scope* scope,
+          const struct scope_limits* limits)
+{
+    key_value_pair* cpus = scope_find(r, "cpus");
+    cpumask_var_t mask;
+    char* text;
+    u64 cores;
+    int kept = 0;
+
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return;
+
+    // without the cpuset controller the cgroup can run on every CPU
+    text = sysinfo_cgroup_read_value(&scope->cgroup, "cpuset.cpus.effective");
+    if (text == NULL || text[0] == '\0' || cpulist_parse(text, mask) != 0)
+        cpumask_copy(mask, cpu_online_mask);
+    cpumask_and(mask, mask, cpu_online_mask);
+    kfree(text);
+
+    cores = min_t(u64, max(cpumask_weight(mask), 1U), limits->cpus);
+    scope_set_number(r, "cpu_cores", cores);
+
+    if (cpus != NULL && cpus->type == JOB_VALUE_ARRAY)
+    {
+        for (int i = 0; i < cpus->child_count; i++)
+        {
+            if (scope_cpu_in_mask(&cpus->children[i], mask))
+                cpus->children[kept++] = cpus->children[i];
+            else
+                job_free_kvp(&cpus->children[i]);
+        }
+        cpus->child_count = kept;
+    }
+
+    free_cpumask_var(mask);
+}
+
+/**
+ * @brief Scope a sample's values to a reader's container.
+ *
+ * @param scope - the reader's scope, may be NULL.
+ * @param r - the sample's values.
+ *
+ * @return a scoped copy of r, freed by the caller with
+ *         free_job_result(). NULL if r is not changed by the
+ *         scope, ERR_PTR(-ENOMEM) on allocation failure.
+ */
+JobResult*
+scope_apply(const struct sysinfo_scope* scope,
+            const JobResult* r)
+{
+    struct scope_limits limits;
+    JobResult* scoped;
+
+    if (scope == NULL || scope->scope != SYSINFO_SCOPE_CONTAINER)
+        return NULL;
+
+    // other categories are the same in every scope
+    if (r->job_title != cpu_job.job_title && r->job_title != memory_job.job_title)
+        return NULL;
+
+    scoped = copy_job_result(r);
+    if (scoped == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    scope_read_limits(scope, &limits);
+    if (r->job_title == cpu_job.job_title)
+        scope_cpu(scoped, scope, &limits);
+    else
+        scope_memory(scoped, &limits);
+
+    return scoped;
+}
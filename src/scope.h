@@ -0,0 +1,31 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include <linux/path.h>
+#include <linux/types.h>
+#include "job.h"
+#include "sysinfo_ioctl.h"
+
+/**
+ * What the device knows about the reader of a file, found when
+ * the file is opened, and whether its values are scoped to the
+ * reader's container.
+ *
+ * Protected by the device's read mutex once the file is open.
+ */
+struct sysinfo_scope {
+    struct path cgroup;                         // cgroup values are scoped to, .mnt is NULL if not found
+    char* cgroup_path;                          // its path in the cgroup2 hierarchy, NULL if not found
+    u32 flags;                                  // SYSINFO_SCOPE_* found when the file was opened
+    u32 pid_ns_level;                           // depth of the reader's pid namespace, 0 for the host
+    u32 scope;                                  // SYSINFO_SCOPE_HOST or SYSINFO_SCOPE_CONTAINER
+};
+
+struct sysinfo_scope* scope_create(void);
+void scope_destroy(struct sysinfo_scope* scope);
+int scope_set(struct sysinfo_scope* scope, u32 value);
+int scope_cgroup_root(const struct sysinfo_scope* scope, struct path* root);
+void scope_get_info(const struct sysinfo_scope* scope, struct sysinfo_scope_info* info);
+JobResult* scope_apply(const struct sysinfo_scope* scope, const JobResult* r);
+
+#endif
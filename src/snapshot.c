@@ -0,0 +1,279 @@
+/**
+ * snapshot.c
+ * 
+ * Page backed, reference counted documents. Readers copy out of
+ * the pages with read() and readv(), and splice() and sendfile() move the
+ * pages themselves into a pipe without copying.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
+#include "snapshot.h"
+
+// snapshots of up to this many pages come from snapshot_cache, larger ones from kmalloc
+#define SNAPSHOT_CACHE_PAGES 16
+
+static void snapshot_release(struct kref *ref);
+static void snapshot_spd_release(struct splice_pipe_desc *spd, unsigned int i);
+
+static struct kmem_cache* snapshot_cache;       // snapshots of up to SNAPSHOT_CACHE_PAGES pages
+
+// pipe buffers hold a page reference, dropped when the pipe is done with the page
+static const struct pipe_buf_operations snapshot_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+/**
+ * @brief create the slab cache for snapshots.
+ * 
+ * Samples of the built in categories are a few pages, so most
+ * snapshots fit an object of SNAPSHOT_CACHE_PAGES pages.
+ * 
+ * @return 0 on success, -ENOMEM if the cache could not be created.
+ */
+int
+snapshot_init(void)
+{
+    snapshot_cache = kmem_cache_create("sysinfo_snapshot",
+                                       sizeof(struct sysinfo_snapshot) +
+                                       SNAPSHOT_CACHE_PAGES * sizeof(struct page *),
+                                       0, 0, NULL);
+    if (snapshot_cache == NULL)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/**
+ * @brief destroy the slab cache for snapshots, once every
+ *        snapshot has been put.
+ */
+void
+snapshot_exit(void)
+{
+    kmem_cache_destroy(snapshot_cache);
+    snapshot_cache = NULL;
+}
+
+/**
+ * @brief check whether the snapshot of a document comes from
+ *        snapshot_cache.
+ */
+static
+bool
+snapshot_cached(size_t len)
+{
+    return DIV_ROUND_UP(len, PAGE_SIZE) <= SNAPSHOT_CACHE_PAGES;
+}
+
+/**
+ * @brief copy a document into a new snapshot.
+ * 
+ * @param data - the document to copy.
+ * @param len - number of bytes in data.
+ * 
+ * @return pointer to the snapshot with one reference held,
+ *         NULL on allocation failure.
+ */
+struct sysinfo_snapshot*
+snapshot_create(const char* data,
+                size_t len)
+{
+    unsigned int nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+    struct sysinfo_snapshot* snap;
+
+    if (snapshot_cached(len))
+        snap = kmem_cache_zalloc(snapshot_cache, GFP_KERNEL);
+    else
+        snap = kzalloc(struct_size(snap, pages, nr_pages), GFP_KERNEL);
+    if (snap == NULL)
+        return NULL;
+
+    kref_init(&snap->ref);
+    snap->len = len;
+
+    for (unsigned int i = 0; i < nr_pages; i++)
+    {
+        size_t start = (size_t)i * PAGE_SIZE;
+        struct page *page = alloc_page(GFP_KERNEL);
+        if (page == NULL)
+        {
+            pr_err("Could not allocate snapshot page\n");
+            snapshot_put(snap);
+            return NULL;
+        }
+
+        memcpy(page_address(page), data + start, min_t(size_t, len - start, PAGE_SIZE));
+        snap->pages[i] = page;
+        snap->nr_pages++;
+    }
+
+    return snap;
+}
+
+/**
+ * @brief take a reference on a snapshot.
+ * 
+ * @param snap - the snapshot.
+ */
+void
+snapshot_get(struct sysinfo_snapshot* snap)
+{
+    kref_get(&snap->ref);
+}
+
+/**
+ * @brief drop a reference on a snapshot, freeing it on the last one.
+ * 
+ * @param snap - the snapshot, may be NULL.
+ */
+void
+snapshot_put(struct sysinfo_snapshot* snap)
+{
+    if (snap != NULL)
+        kref_put(&snap->ref, snapshot_release);
+}
+
+/**
+ * @brief free a snapshot once its last reference is dropped.
+ * 
+ * Pages still in a pipe are freed when the pipe drops them.
+ */
+static
+void
+snapshot_release(struct kref *ref)
+{
+    struct sysinfo_snapshot* snap = container_of(ref, struct sysinfo_snapshot, ref);
+
+    for (unsigned int i = 0; i < snap->nr_pages; i++)
+        put_page(snap->pages[i]);
+
+    if (snapshot_cached(snap->len))
+        kmem_cache_free(snapshot_cache, snap);
+    else
+        kfree(snap);
+}
+
+/**
+ * @brief copy part of a snapshot into an iov_iter.
+ * 
+ * Fills the segments of the iterator in order, straight from the
+ * snapshot pages, until the iterator or the snapshot is exhausted.
+ * 
+ * @param snap - the snapshot to copy from.
+ * @param to - the iterator to copy to.
+ * @param pos - offset in the snapshot to start copying from.
+ * 
+ * @return number of bytes copied, 0 at the end of the snapshot,
+ *         -EFAULT if nothing could be copied to the iterator.
+ */
+ssize_t
+snapshot_copy_to_iter(struct sysinfo_snapshot* snap,
+                      struct iov_iter *to,
+                      loff_t pos)
+{
+    size_t count;
+    size_t copied = 0;
+
+    if (pos >= snap->len)
+        return 0;
+
+    count = min_t(size_t, iov_iter_count(to), snap->len - pos);
+    while (copied < count)
+    {
+        struct page *page = snap->pages[pos >> PAGE_SHIFT];
+        size_t offset = offset_in_page(pos);
+        size_t n = min_t(size_t, count - copied, PAGE_SIZE - offset);
+        size_t done = copy_page_to_iter(page, offset, n, to);
+
+        copied += done;
+        pos += done;
+
+        // a short copy means a segment of the iterator faulted
+        if (done < n)
+            break;
+    }
+
+    if (copied == 0 && count > 0)
+        return -EFAULT;
+
+    return copied;
+}
+
+/**
+ * @brief drop the reference on a page that was not moved into the pipe.
+ */
+static
+void
+snapshot_spd_release(struct splice_pipe_desc *spd,
+                     unsigned int i)
+{
+    put_page(spd->pages[i]);
+}
+
+/**
+ * @brief move part of a snapshot into a pipe without copying.
+ * 
+ * Each page is handed to the pipe with its own page reference.
+ * At most PIPE_DEF_BUFFERS pages are moved per call.
+ * 
+ * @param snap - the snapshot to splice from.
+ * @param ppos - offset in the snapshot, advanced by the bytes spliced.
+ * @param pipe - the pipe to splice to, locked by the caller.
+ * @param len - maximum number of bytes to splice.
+ * 
+ * @return number of bytes spliced, 0 at the end of the snapshot,
+ *         or negative error code from splice_to_pipe().
+ */
+ssize_t
+snapshot_splice_read(struct sysinfo_snapshot* snap,
+                     loff_t *ppos,
+                     struct pipe_inode_info *pipe,
+                     size_t len)
+{
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS] = {};
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages = 0,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &snapshot_pipe_buf_ops,
+        .spd_release = snapshot_spd_release,
+    };
+    loff_t pos = *ppos;
+    ssize_t ret;
+
+    if (pos >= snap->len)
+        return 0;
+
+    len = min_t(size_t, len, snap->len - pos);
+    while (len > 0 && spd.nr_pages < PIPE_DEF_BUFFERS)
+    {
+        struct page *page = snap->pages[pos >> PAGE_SHIFT];
+        unsigned int offset = offset_in_page(pos);
+        unsigned int n = min_t(size_t, len, PAGE_SIZE - offset);
+
+        get_page(page);
+        pages[spd.nr_pages] = page;
+        partial[spd.nr_pages].offset = offset;
+        partial[spd.nr_pages].len = n;
+        spd.nr_pages++;
+
+        pos += n;
+        len -= n;
+    }
+
+    ret = splice_to_pipe(pipe, &spd);
+    if (ret > 0)
+        *ppos += ret;
+
+    return ret;
+}
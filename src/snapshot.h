@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <linux/kref.h>
+#include <linux/mm_types.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/types.h>
+#include <linux/uio.h>
+
+/**
+ * An immutable document held in whole pages, so that it can be
+ * handed to a pipe by reference instead of being copied.
+ *
+ * Snapshots are reference counted. Pipes hold their own reference
+ * on each page they were given, so a snapshot can be put while its
+ * pages are still in a pipe.
+ */
+struct sysinfo_snapshot {
+    struct kref ref;
+    size_t len;                                 // number of bytes in the document
+    unsigned int nr_pages;                      // number of pages in pages
+    struct page *pages[];                       // pages holding the document
+};
+
+int snapshot_init(void);
+void snapshot_exit(void);
+struct sysinfo_snapshot* snapshot_create(const char* data, size_t len);
+void snapshot_get(struct sysinfo_snapshot* snap);
+void snapshot_put(struct sysinfo_snapshot* snap);
+ssize_t snapshot_copy_to_iter(struct sysinfo_snapshot* snap, struct iov_iter *to, loff_t pos);
+ssize_t snapshot_splice_read(struct sysinfo_snapshot* snap, loff_t *ppos, struct pipe_inode_info *pipe, size_t len);
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * stats.c
+ * 
+ * Module statistics. Counters are kept per CPU, so that
+ * counting a read never contends with readers on other CPUs,
+ * and summed over every CPU when they are reported.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/errno.h>
+#include <linux/seq_file.h>
+#include "sysinfo_dev.h"
+#include "stats.h"
+
+DEFINE_PER_CPU(u64, stats_counters[STATS_COUNTER_COUNT]);
+
+// names of the counters in /proc/sysinfo/stats
+static const char* const stats_names[STATS_COUNTER_COUNT] = {
+    [STATS_READS] = "reads",
+    [STATS_BYTES_SERVED] = "bytes_served",
+    [STATS_IOCTLS] = "ioctls",
+    [STATS_OPENS] = "opens",
+    [STATS_SAMPLES] = "samples",
+    [STATS_RING_OVERRUNS] = "ring_overruns",
+    [STATS_ERRORS_FAULT] = "errors_fault",
+    [STATS_ERRORS_NOMEM] = "errors_nomem",
+    [STATS_ERRORS_AGAIN] = "errors_again",
+    [STATS_ERRORS_BUSY] = "errors_busy",
+    [STATS_ERRORS_INVAL] = "errors_inval",
+    [STATS_ERRORS_OTHER] = "errors_other",
+};
+
+/**
+ * @brief count an error returned to user space, by type.
+ * 
+ * Interrupted waits are restarted by the kernel and are not counted.
+ * 
+ * @param err - the negative error code.
+ */
+void
+stats_error(long err)
+{
+    switch (err)
+    {
+    case -ERESTARTSYS:
+        break;
+    case -EFAULT:
+        stats_inc(STATS_ERRORS_FAULT);
+        break;
+    case -ENOMEM:
+        stats_inc(STATS_ERRORS_NOMEM);
+        break;
+    case -EAGAIN:
+        stats_inc(STATS_ERRORS_AGAIN);
+        break;
+    case -EBUSY:
+        stats_inc(STATS_ERRORS_BUSY);
+        break;
+    case -EINVAL:
+        stats_inc(STATS_ERRORS_INVAL);
+        break;
+    default:
+        stats_inc(STATS_ERRORS_OTHER);
+        break;
+    }
+}
+
+/**
+ * @brief sum a counter over every CPU.
+ * 
+ * @param c - the counter.
+ * 
+ * @return total of the counter since the module was loaded.
+ */
+u64
+stats_read(enum stats_counter c)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu(stats_counters[c], cpu);
+
+    return sum;
+}
+
+/**
+ * @brief fill in the statistics returned by SYSINFO_IOC_GET_STATS.
+ * 
+ * @param out - the statistics to fill in.
+ */
+void
+stats_get(struct sysinfo_stats* out)
+{
+    out->uptime_ns = get_time_since_loading_ns();
+    out->reads = stats_read(STATS_READS);
+    out->bytes_served = stats_read(STATS_BYTES_SERVED);
+    out->ioctls = stats_read(STATS_IOCTLS);
+    out->opens = stats_read(STATS_OPENS);
+    out->samples = stats_read(STATS_SAMPLES);
+    out->ring_overruns = stats_read(STATS_RING_OVERRUNS);
+    out->errors_fault = stats_read(STATS_ERRORS_FAULT);
+    out->errors_nomem = stats_read(STATS_ERRORS_NOMEM);
+    out->errors_again = stats_read(STATS_ERRORS_AGAIN);
+    out->errors_busy = stats_read(STATS_ERRORS_BUSY);
+    out->errors_inval = stats_read(STATS_ERRORS_INVAL);
+    out->errors_other = stats_read(STATS_ERRORS_OTHER);
+}
+
+/**
+ * @brief write every counter to a seq_file, one per line.
+ * 
+ * @param m - the seq_file to write to.
+ */
+void
+stats_show(struct seq_file *m)
+{
+    seq_printf(m, "uptime_ns: %llu\n", get_time_since_loading_ns());
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+        seq_printf(m, "%s: %llu\n", stats_names[i], stats_read(i));
+}
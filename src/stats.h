@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <linux/percpu.h>
+#include <linux/types.h>
+#include "sysinfo_ioctl.h"
+
+struct seq_file;
+
+/**
+ * Module statistics counters, one slot of the per-CPU
+ * stats_counters array each.
+ */
+enum stats_counter {
+    STATS_READS,
+    STATS_BYTES_SERVED,
+    STATS_IOCTLS,
+    STATS_OPENS,
+    STATS_SAMPLES,
+    STATS_RING_OVERRUNS,
+    STATS_ERRORS_FAULT,
+    STATS_ERRORS_NOMEM,
+    STATS_ERRORS_AGAIN,
+    STATS_ERRORS_BUSY,
+    STATS_ERRORS_INVAL,
+    STATS_ERRORS_OTHER,
+    STATS_COUNTER_COUNT
+};
+
+DECLARE_PER_CPU(u64, stats_counters[STATS_COUNTER_COUNT]);
+
+/**
+ * Add n to a counter on this CPU.
+ */
+static inline void stats_add(enum stats_counter c, u64 n)
+{
+    this_cpu_add(stats_counters[c], n);
+}
+
+/**
+ * Add one to a counter on this CPU.
+ */
+static inline void stats_inc(enum stats_counter c)
+{
+    this_cpu_inc(stats_counters[c]);
+}
+
+void stats_error(long err);
+u64 stats_read(enum stats_counter c);
+void stats_get(struct sysinfo_stats* out);
+void stats_show(struct seq_file *m);
+
+#endif
@@ -21,20 +21,28 @@
 #include <linux/errno.h>                        // error macros
 #include <linux/mutex.h>                        // mutual exclusion utilities
 #include <linux/ioctl.h>                        // ioctl function prototypes
+#include <linux/slab.h>                         // kernel memory allocation
+#include <linux/poll.h>                         // poll() definitions
+#include <linux/uio.h>                          // iov_iter for vectored reads
+#include <linux/splice.h>                       // splice flags
+#include <kunit/visibility.h>                   // VISIBLE_IF_KUNIT
 
 // sysinfo device specific headers
 #include "./procfs.h"                           // proc filesystem utilities
+#include "sysinfo_dev.h"                        // sysinfo device functions
 #include "job.h"                                // types and macros for Job API
-
-// ioctl definitions
-#define SET_CIT_CPU _IOW('C',CPU, int)          // set the current_info_type to cpu
-#define SET_CIT_MEM _IOW('M', MEMORY, int)      // set the current_info_type to memory
-#define SET_CIT_DISK _IOW('D', DISK, int)       // // set the current_info_type to disk
-
-// device definitions
-#define DEVICE_NAME "sysinfo"
-
-#define DEV_BUF_MAX_SIZE 256
+#include "registry.h"                           // registered categories
+#include "sysinfo_ioctl.h"                      // ioctl definitions
+#include "alert.h"                              // threshold alerts
+#include "sampler.h"                            // periodic sampling
+#include "snapshot.h"                           // page backed documents
+#include "instrument.h"                         // hot path instrumentation
+#include "stats.h"                              // per-CPU module statistics
+#include "cgroup.h"                             // cgroup categories
+#include "irq.h"                                // irq category
+#include "scope.h"                              // container scope of readers
+#include "netlink.h"                            // generic netlink family
+#include "sysinfo_trace.h"                      // tracepoints
 
 #ifndef EOF
 #define EOF 0
@@ -45,17 +53,58 @@ static dev_t dev_num;                           // device number - major and min
 static struct cdev sysinfo_cdev;                // character device struct
 static struct class *sysinfo_dev_class;         // pointer to the device class in kernel space for this device
 static ktime_t start_time;                      // record start time in this var
-static int times_read = 0;                      // counter for the amount of times read() called on this device
-static DEFINE_MUTEX(device_read_mutex);         // mutex to ensure mutual exclusion on times_read increments
+static DEFINE_MUTEX(device_read_mutex);         // mutex to ensure mutual exclusion on reader state
 static bool device_open = false;                // true if user space application has opened device and not closed yet, else false
 static DEFINE_MUTEX(device_mutex);              // mutex to ensure mutual exclusion over processes that can open device
+static struct kmem_cache* sysinfo_file_cache;   // per-open-file state, struct sysinfo_file
+
+/**
+ * Per-open-file state, stored in file->private_data.
+ */
+struct sysinfo_file {
+    struct sysinfo_snapshot* snapshot;          // document being served to this reader
+    u64 seen_seq;                               // sequence number of the last sample read
+    char job_title[SYSINFO_CATEGORY_NAME_LEN];  // title of the job the snapshot belongs to
+    JobDelta* delta;                            // last values sent, NULL unless delta output is on
+    u32 format;                                 // SYSINFO_FORMAT_* of the documents read
+    struct alert_watch* watch;                  // alert thresholds, NULL until one is registered
+    struct sysinfo_scope* scope;                // the reader's cgroup and namespaces, found on open
+    struct sysinfo_cgroup_view* cgroup;         // cgroup selected for the cgroup categories, NULL if none
+};
 
 // function prototypes
 int __init sysinfo_cdev_init(void);
 void __exit sysinfo_cdev_exit(void);
-int get_times_read(void);
-int get_time_since_loading_ns(void);
-ssize_t sysinfo_read(struct file *filp, char __user *user_buffer, size_t count, loff_t *f_pos);
+u64 get_times_read(void);
+u64 get_time_since_loading_ns(void);
+ssize_t sysinfo_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t sysinfo_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+/**
+ * @brief select the root of a reader's cgroup namespace for the
+ *        cgroup categories, so a reader in a container is never
+ *        served the host's cgroups.
+ * 
+ * The file is left without a selection if the root is not found,
+ * and is then refused the cgroup categories until it selects one.
+ * 
+ * @param sf - state of the file being opened.
+ */
+static
+void
+sysinfo_select_cgroup_ns_root(struct sysinfo_file* sf)
+{
+    struct path root;
+
+    if (!(sf->scope->flags & SYSINFO_SCOPE_CGROUP_NS))
+        return;
+
+    if (scope_cgroup_root(sf->scope, &root) != 0)
+        return;
+
+    sysinfo_cgroup_select(&sf->cgroup, &root, -1, "", SYSINFO_CGROUP_SORT_CPU);
+    path_put(&root);
+}
 
 /**
  * @brief function to run when device is opened.
@@ -78,12 +127,37 @@ sysinfo_open(struct inode *inode,
         // unlock the device_mutex if the device has not been reset to closed
         mutex_unlock(&device_mutex);
         pr_err("sysinfo: device already in use\n");
+        stats_error(-EBUSY);
         return -EBUSY; // return device busy error
     }
 
+    struct sysinfo_file* sf = kmem_cache_zalloc(sysinfo_file_cache, GFP_KERNEL);
+    if (sf == NULL)
+    {
+        mutex_unlock(&device_mutex);
+        stats_error(-ENOMEM);
+        return -ENOMEM;
+    }
+
+    // the opening task is the reader, find its container now
+    sf->scope = scope_create();
+    if (sf->scope == NULL)
+    {
+        kmem_cache_free(sysinfo_file_cache, sf);
+        mutex_unlock(&device_mutex);
+        stats_error(-ENOMEM);
+        return -ENOMEM;
+    }
+    sysinfo_select_cgroup_ns_root(sf);
+    fp->private_data = sf;
+
     device_open = true;
     mutex_unlock(&device_mutex);
 
+    // samples of the current job are taken while the device is open
+    sampler_add_reader();
+    stats_inc(STATS_OPENS);
+
     printk(KERN_INFO "Device %s opened\n", DEVICE_NAME);
     return 0;
 }
@@ -104,6 +178,15 @@ sysinfo_release(struct inode *inode,
 {
     printk(KERN_INFO "release\n");
 
+    struct sysinfo_file* sf = filep->private_data;
+    sampler_remove_reader();
+    alert_watch_destroy(sf->watch);
+    snapshot_put(sf->snapshot);
+    free_job_delta(sf->delta);
+    scope_destroy(sf->scope);
+    sysinfo_cgroup_view_destroy(sf->cgroup);
+    kmem_cache_free(sysinfo_file_cache, sf);
+
     mutex_lock(&device_mutex);
     device_open = false;
     mutex_unlock(&device_mutex);
@@ -112,101 +195,343 @@ sysinfo_release(struct inode *inode,
 }
 
 /**
- * @brief function to handle /dev node read.
+ * @brief store the latest sample as the reader's snapshot.
  * 
- * @param filp - pointer to the current device file.
- * @param user_buffer - pointer in buffer in user ction is to write to userspace.
- * @param f_pos - pointer to current position in the file.
+ * Without delta output the reader shares the sample's document.
+ * In delta mode only values changed since the reader's last
+ * sample are serialized into a snapshot of its own, and readers
+ * of the Prometheus format get the sample serialized in that
+ * format. Readers in container scope get a snapshot of their own
+ * of the sample's scoped values, and readers that selected a
+ * cgroup get the cgroup categories collected for that cgroup.
+ * Readers in a cgroup namespace start with the root of their
+ * namespace selected, and are never given the shared sample of a
+ * cgroup category, which describes the host's cgroups.
  * 
- * @return the amount of bytes read by this device read.
+ * Called with device_read_mutex held, when a reader starts
+ * reading or splicing from offset 0.
+ * 
+ * @param sf - state of the file being read.
+ * 
+ * @return 0 on success, negative error code otherwise.
  */
-ssize_t
-sysinfo_read(struct file *filp,
-             char __user *user_buffer,
-             size_t count,
-             loff_t *offset)
+static
+int
+sysinfo_refresh_snapshot(struct sysinfo_file* sf)
 {
-    ssize_t bytes_copied;           // num bytes copied to user space this read
-    Job* current_job;               // pointer to Job of current_info_type
-    char* current_job_data;         // sysinfo string returned from running job
-    ssize_t current_job_data_size;  // number of bytes in string returned from running job
+    struct sysinfo_sample* sample;              // latest sample of the current job
+    struct sysinfo_snapshot* snapshot;          // document for this reader
+    JobResult* scoped;                          // values of the reader only, NULL if the sample's
+    JobResult* result;                          // values serialized for this reader
+    char* current_job_data;                     // sysinfo string serialized for this reader
+    u64 start_ns;
 
-    mutex_lock(&device_read_mutex);
-    // if this is the first read...
-    if (*offset == 0)
+    sample = sampler_get_latest();
+    if (sample == NULL)
     {
-        // increment the times_read counter
-        times_read++;
-        
-        // get the current job
-        current_job = get_current_job();
-        if (current_job == NULL)
-        {
-            pr_err("current_job pointer is NULL\n");
-            return -EFAULT;
-        }
+        pr_err("sysinfo device has no sample yet\n");
+        return -EAGAIN;
+    }
+
+    // the cgroup the reader selected is collected for it, other values are scoped
+    if (sf->cgroup == NULL && (sf->scope->flags & SYSINFO_SCOPE_CGROUP_NS) &&
+        sysinfo_cgroup_is_sample(sample->result))
+        scoped = ERR_PTR(-EPERM);               // the shared sample shows the host's cgroups
+    else
+        scoped = sysinfo_cgroup_collect(sf->cgroup, sample->result);
+    if (scoped == NULL)
+        scoped = scope_apply(sf->scope, sample->result);
+    if (IS_ERR(scoped))
+    {
+        sample_put(sample);
+        return PTR_ERR(scoped);
+    }
+    result = scoped != NULL ? scoped : sample->result;
 
-        // use the current_job to retrieve sysinfo for current moment in time.
-        // store job data in character buffer.
-        current_job_data = run_job(current_job);
+    if (sf->format == SYSINFO_FORMAT_JSON && sf->delta == NULL && scoped == NULL)
+    {
+        // share the sample's full document
+        snapshot = sample->snapshot;
+        snapshot_get(snapshot);
+    }
+    else
+    {
+        start_ns = ktime_get_ns();
+        if (sf->format == SYSINFO_FORMAT_PROMETHEUS)
+            current_job_data = serialize_job_result_prometheus(result);
+        else
+            current_job_data = serialize_job_result(result, sf->delta);
+        instrument_serialize(ktime_get_ns() - start_ns);
+        free_job_result(scoped);
         if (current_job_data == NULL)
         {
             pr_err("current_job_data pointer is null\n");
+            sample_put(sample);
             return -EFAULT;
         }
 
-        current_job_data_size = strlen(current_job_data);
-        if (current_job_data_size <= 0)
+        snapshot = snapshot_create(current_job_data, strlen(current_job_data));
+        kfree(current_job_data);
+        if (snapshot == NULL)
         {
-            pr_err("sysinfo device retrieved no data\n");
-            return -EAGAIN;
+            sample_put(sample);
+            return -ENOMEM;
         }
     }
-    mutex_unlock(&device_read_mutex);
 
-    // if the offset value is out of bounds of current_job_data_size
-    // EOF condition has been reached.
-    if (*offset >= current_job_data_size)
+    // replace the reader's snapshot with the new document
+    snapshot_put(sf->snapshot);
+    sf->snapshot = snapshot;
+    sf->seen_seq = sample->seq;
+    // copied, as the category can be unregistered while the file is open
+    strscpy(sf->job_title, sample->result->job_title, sizeof(sf->job_title));
+    sample_put(sample);
+
+    return 0;
+}
+
+/**
+ * @brief read the reader's snapshot into an iov_iter.
+ * 
+ * Fills the segments of the iterator straight from the reader's
+ * snapshot, so a readv() can split the document across buffers.
+ * 
+ * @param iocb - the I/O control block, holding the file and position.
+ * @param to - iterator over the user space buffers to fill.
+ * 
+ * @return the amount of bytes read by this device read.
+ */
+static
+ssize_t
+sysinfo_do_read_iter(struct kiocb *iocb,
+                     struct iov_iter *to)
+{
+    struct sysinfo_file* sf = iocb->ki_filp->private_data;
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    ssize_t bytes_copied;           // num bytes copied to user space this read
+    u64 start_ns;
+    int err;
+
+    // files with alert thresholds read events instead of documents,
+    // until the thresholds are cleared
+    if (alert_watch_active(sf->watch))
     {
-        printk("EOF condition reached\n");
-        return EOF;
+        bytes_copied = alert_read_iter(sf->watch, to, nonblock);
+        if (bytes_copied != -ENODATA)
+            return bytes_copied;
     }
 
-    char read_buf[DEV_BUF_MAX_SIZE];
+    // if this is the first read, wait for a sample this file has not
+    // read yet, or tell a non-blocking reader to come back later
+    if (iocb->ki_pos == 0)
+    {
+        err = sampler_wait_for_sample(sf->seen_seq, nonblock);
+        if (err)
+            return err;
+    }
 
-    // write contents of current_job_data into read_buf up to n bytes
-    // where n = DEV_BUF_MAX_SIZE
-    int n = snprintf(read_buf, DEV_BUF_MAX_SIZE, current_job_data);
-    if (n <= 0)
+    start_ns = ktime_get_ns();
+    mutex_lock(&device_read_mutex);
+    // if this is the first read, take a new snapshot
+    if (iocb->ki_pos == 0)
     {
-        pr_err("Could not write data to read_buf\n");
-        return -EFAULT;
+        err = sysinfo_refresh_snapshot(sf);
+        if (err)
+        {
+            mutex_unlock(&device_read_mutex);
+            return err;
+        }
     }
-    int bytes_written = n;
 
-    // Copy the retrieved data to user space
-    bytes_copied = copy_to_user(user_buffer, &read_buf + *offset, n);
-    if (bytes_copied != 0)
+    // if there is no snapshot, or the offset value is out of bounds
+    // of the snapshot, EOF condition has been reached.
+    if (sf->snapshot == NULL || iocb->ki_pos >= sf->snapshot->len)
+    {
+        mutex_unlock(&device_read_mutex);
+        printk("EOF condition reached\n");
+        return EOF;
+    }
+
+    // Copy the snapshot to the user space buffers
+    bytes_copied = snapshot_copy_to_iter(sf->snapshot, to, iocb->ki_pos);
+    if (bytes_copied > 0)
+        trace_sysinfo_read_copy(sf->job_title, sf->seen_seq, iocb->ki_pos, bytes_copied);
+    mutex_unlock(&device_read_mutex);
+    if (bytes_copied < 0)
     {
         pr_err("An error occurred copying internal buffer in /dev read() to user space buffer\n");
-        return -EFAULT;
+        return bytes_copied;
     }
 
     // increment the offset position by bytes_copied
-    *offset += bytes_written;
+    iocb->ki_pos += bytes_copied;
+    instrument_read(ktime_get_ns() - start_ns, bytes_copied);
+
+    return bytes_copied;
+}
+
+/**
+ * @brief function to handle /dev node read(), readv() and io_uring reads.
+ * 
+ * Counts the read, and the bytes served or the error returned.
+ * 
+ * @param iocb - the I/O control block, holding the file and position.
+ * @param to - iterator over the user space buffers to fill.
+ * 
+ * @return the amount of bytes read by this device read.
+ */
+ssize_t
+sysinfo_read_iter(struct kiocb *iocb,
+                  struct iov_iter *to)
+{
+    ssize_t ret = sysinfo_do_read_iter(iocb, to);
+
+    stats_inc(STATS_READS);
+    if (ret > 0)
+        stats_add(STATS_BYTES_SERVED, ret);
+    else if (ret < 0)
+        stats_error(ret);
+
+    return ret;
+}
+
+/**
+ * @brief splice the reader's snapshot into a pipe.
+ * 
+ * Moves the pages of the reader's snapshot into the pipe,
+ * without copying the document.
+ * 
+ * @param filp - pointer to the current device file.
+ * @param ppos - pointer to current position in the file.
+ * @param pipe - the pipe to splice to.
+ * @param len - maximum number of bytes to splice.
+ * @param flags - splice flags.
+ * 
+ * @return the amount of bytes spliced, or negative error code.
+ */
+static
+ssize_t
+sysinfo_do_splice_read(struct file *filp,
+                       loff_t *ppos,
+                       struct pipe_inode_info *pipe,
+                       size_t len,
+                       unsigned int flags)
+{
+    struct sysinfo_file* sf = filp->private_data;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+    u64 start_ns;
+    ssize_t ret;
+
+    // alert events are records, they are only returned by read()
+    if (alert_watch_active(sf->watch))
+        return -EINVAL;
+
+    if (*ppos == 0)
+    {
+        ret = sampler_wait_for_sample(sf->seen_seq, nonblock);
+        if (ret)
+            return ret;
+    }
 
-    return bytes_written;
+    start_ns = ktime_get_ns();
+    mutex_lock(&device_read_mutex);
+    if (*ppos == 0)
+    {
+        ret = sysinfo_refresh_snapshot(sf);
+        if (ret)
+        {
+            mutex_unlock(&device_read_mutex);
+            return ret;
+        }
+    }
+
+    ret = 0;
+    if (sf->snapshot != NULL)
+        ret = snapshot_splice_read(sf->snapshot, ppos, pipe, len);
+    if (ret > 0)
+        trace_sysinfo_read_copy(sf->job_title, sf->seen_seq, *ppos - ret, ret);
+    mutex_unlock(&device_read_mutex);
+
+    if (ret > 0)
+        instrument_read(ktime_get_ns() - start_ns, ret);
+
+    return ret;
+}
+
+/**
+ * @brief function to handle splice() and sendfile() from the /dev node.
+ * 
+ * Counts the read, and the bytes served or the error returned.
+ * 
+ * @param filp - pointer to the current device file.
+ * @param ppos - pointer to current position in the file.
+ * @param pipe - the pipe to splice to.
+ * @param len - maximum number of bytes to splice.
+ * @param flags - splice flags.
+ * 
+ * @return the amount of bytes spliced, or negative error code.
+ */
+ssize_t
+sysinfo_splice_read(struct file *filp,
+                    loff_t *ppos,
+                    struct pipe_inode_info *pipe,
+                    size_t len,
+                    unsigned int flags)
+{
+    ssize_t ret = sysinfo_do_splice_read(filp, ppos, pipe, len, flags);
+
+    stats_inc(STATS_READS);
+    if (ret > 0)
+        stats_add(STATS_BYTES_SERVED, ret);
+    else if (ret < 0)
+        stats_error(ret);
+
+    return ret;
+}
+
+/**
+ * @brief function to handle poll() on the /dev node.
+ * 
+ * Files are readable when there is a sample they have not read
+ * yet. Files with alert thresholds are readable when events are
+ * pending.
+ * 
+ * @param filp - pointer to the current device file.
+ * @param wait - poll table to register the wait queue with.
+ * 
+ * @return mask of events ready on the file.
+ */
+static
+__poll_t
+sysinfo_poll(struct file *filp,
+             struct poll_table_struct *wait)
+{
+    struct sysinfo_file* sf = filp->private_data;
+
+    if (!alert_watch_active(sf->watch))
+    {
+        poll_wait(filp, sampler_waitqueue(), wait);
+        if (sampler_latest_seq() != sf->seen_seq)
+            return EPOLLIN | EPOLLRDNORM;
+        return 0;
+    }
+
+    poll_wait(filp, &sf->watch->wait, wait);
+    if (alert_events_pending(sf->watch))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
 }
 
 /**
  * @brief get the number of times the /dev node has beed read
  * 
- * @return number of times the device has been read.
+ * @return number of read() and splice() calls on the device.
  */
-int
+u64
 get_times_read(void) 
 {
-    return times_read;
+    return stats_read(STATS_READS);
 }
 
 /**
@@ -214,43 +539,237 @@ get_times_read(void)
  * 
  * @return number of nanoseconds since device loading
  */
-int
+u64
 get_time_since_loading_ns(void)
 {
     // get the time after this function is called
     ktime_t current_time = ktime_get();
     // calculate the delta since module load
-    int time_diff = ktime_to_ns(current_time) - ktime_to_ns(start_time); 
-    
-    return time_diff;
+    return ktime_to_ns(ktime_sub(current_time, start_time));
 }
 
 /**
- * @brief ioctl handler, used to toggle between sysinfo modes.
+ * @brief set the category read from the device, and take a
+ *        sample of it so readers see it straight away.
+ * 
+ * @param id - id of the category.
+ * 
+ * @return 0 on success, -ENOENT if no category has that id.
+ */
+static
+int
+sysinfo_set_category(u32 id)
+{
+    int err;
+
+    if (id > SYSINFO_MAX_CATEGORIES)
+        return -ENOENT;
+
+    err = registry_set_current(id);
+    if (err)
+        return err;
+
+    sampler_sample_now();
+    return 0;
+}
+
+/**
+ * @brief select the cgroup of the cgroup categories for a file,
+ *        below the root of the reader's cgroup namespace. It is
+ *        collected from the next read from offset 0.
+ * 
+ * @param sf - state of the file.
+ * @param arg - user pointer to a struct sysinfo_cgroup_select.
+ * 
+ * @return 0 on success, negative error code otherwise.
+ */
+static
+int
+sysinfo_set_cgroup(struct sysinfo_file* sf,
+                   unsigned long arg)
+{
+    struct sysinfo_cgroup_select select;
+    struct path root;
+    char* path = NULL;
+    int err;
+
+    if (copy_from_user(&select, (void __user *)arg, sizeof(select)))
+        return -EFAULT;
+
+    if (select.fd < 0)
+    {
+        // no path selects the root cgroup
+        if (select.path != 0)
+            path = strndup_user(u64_to_user_ptr(select.path), PATH_MAX);
+        else
+            path = kstrdup("", GFP_KERNEL);
+        if (IS_ERR(path))
+            return PTR_ERR(path);
+        if (path == NULL)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&device_read_mutex);
+    err = scope_cgroup_root(sf->scope, &root);
+    if (err == 0)
+    {
+        err = sysinfo_cgroup_select(&sf->cgroup, &root, select.fd, path, select.sort);
+        path_put(&root);
+    }
+    mutex_unlock(&device_read_mutex);
+    kfree(path);
+
+    return err;
+}
+
+/**
+ * @brief carry out an ioctl command on the device.
  * 
  * @param file - pointer to this device structure in kernel space.
  * @param cmd - represents the type of ioctl operation to perform.
+ * @param arg - argument to the command.
  * 
  * @return long status code - 0 on success, non-zero value 
  *         relevant to error otherwise.
  */
 static
 long
-sysinfo_ioctl(struct file *file,
-              unsigned int cmd,
-              unsigned long arg)
+sysinfo_do_ioctl(struct file *file,
+                 unsigned int cmd,
+                 unsigned long arg)
 {
+    struct sysinfo_file* sf = file->private_data;
+    struct sysinfo_threshold threshold;
+    struct sysinfo_stats stats;
+    struct sysinfo_category_list list;
+    struct sysinfo_category_info* infos;
+    struct sysinfo_scope_info scope_info;
+    int keyframe_interval;
+    u32 category_id;
+    u32 format;
+    u32 scope;
+    int count;
+    int err;
+
     // change the current_info_type to parameter from icoctl write
     switch (cmd)
     {
     case SET_CIT_CPU:
-        set_current_info_type(CPU);
-        break;
+        return sysinfo_set_category(SYSINFO_CATEGORY_CPU);
     case SET_CIT_MEM:
-        set_current_info_type(MEMORY);
-        break;
+        return sysinfo_set_category(SYSINFO_CATEGORY_MEMORY);
     case SET_CIT_DISK:
-        set_current_info_type(DISK);
+        return sysinfo_set_category(SYSINFO_CATEGORY_DISK);
+    case SYSINFO_IOC_SET_CATEGORY:
+        if (get_user(category_id, (u32 __user *)arg))
+            return -EFAULT;
+        return sysinfo_set_category(category_id);
+    case SYSINFO_IOC_LIST_CATEGORIES:
+        if (copy_from_user(&list, (void __user *)arg, sizeof(list)))
+            return -EFAULT;
+
+        list.count = min_t(u32, list.count, SYSINFO_MAX_CATEGORIES);
+        infos = kcalloc(max_t(u32, list.count, 1), sizeof(struct sysinfo_category_info), GFP_KERNEL);
+        if (infos == NULL)
+            return -ENOMEM;
+
+        count = registry_list(infos, list.count);
+        if (copy_to_user(u64_to_user_ptr(list.categories), infos,
+                         min_t(u32, count, list.count) * sizeof(struct sysinfo_category_info)))
+        {
+            kfree(infos);
+            return -EFAULT;
+        }
+        kfree(infos);
+
+        list.count = count;
+        if (copy_to_user((void __user *)arg, &list, sizeof(list)))
+            return -EFAULT;
+        break;
+    case SYSINFO_IOC_SET_DELTA:
+        if (get_user(keyframe_interval, (int __user *)arg))
+            return -EFAULT;
+        if (keyframe_interval < 0)
+            return -EINVAL;
+
+        mutex_lock(&device_read_mutex);
+        free_job_delta(sf->delta);
+        sf->delta = NULL;
+        if (keyframe_interval > 0)
+        {
+            sf->delta = job_delta_init(keyframe_interval);
+            if (sf->delta == NULL)
+            {
+                mutex_unlock(&device_read_mutex);
+                return -ENOMEM;
+            }
+        }
+        mutex_unlock(&device_read_mutex);
+        break;
+    case SYSINFO_IOC_SET_FORMAT:
+        if (get_user(format, (u32 __user *)arg))
+            return -EFAULT;
+        if (format != SYSINFO_FORMAT_JSON && format != SYSINFO_FORMAT_PROMETHEUS)
+            return -EINVAL;
+
+        // the next read from offset 0 takes a document in the new format
+        mutex_lock(&device_read_mutex);
+        sf->format = format;
+        mutex_unlock(&device_read_mutex);
+        break;
+    case SYSINFO_IOC_SET_CGROUP:
+        return sysinfo_set_cgroup(sf, arg);
+    case SYSINFO_IOC_SET_SCOPE:
+        if (get_user(scope, (u32 __user *)arg))
+            return -EFAULT;
+
+        // like the format, applies from the next read from offset 0
+        mutex_lock(&device_read_mutex);
+        err = scope_set(sf->scope, scope);
+        mutex_unlock(&device_read_mutex);
+        return err;
+    case SYSINFO_IOC_GET_SCOPE:
+        mutex_lock(&device_read_mutex);
+        scope_get_info(sf->scope, &scope_info);
+        mutex_unlock(&device_read_mutex);
+
+        if (copy_to_user((void __user *)arg, &scope_info, sizeof(scope_info)))
+            return -EFAULT;
+        break;
+    case SYSINFO_IOC_ADD_THRESHOLD:
+        if (copy_from_user(&threshold, (void __user *)arg, sizeof(threshold)))
+            return -EFAULT;
+
+        mutex_lock(&device_read_mutex);
+        if (sf->watch == NULL)
+        {
+            sf->watch = alert_watch_create();
+            if (sf->watch == NULL)
+            {
+                mutex_unlock(&device_read_mutex);
+                return -ENOMEM;
+            }
+        }
+        mutex_unlock(&device_read_mutex);
+
+        err = alert_add_threshold(sf->watch, &threshold);
+        if (err)
+            return err;
+
+        // return the id assigned to the threshold
+        if (copy_to_user((void __user *)arg, &threshold, sizeof(threshold)))
+            return -EFAULT;
+        break;
+    case SYSINFO_IOC_CLEAR_THRESHOLDS:
+        mutex_lock(&device_read_mutex);
+        if (sf->watch != NULL)
+            alert_clear_thresholds(sf->watch);
+        mutex_unlock(&device_read_mutex);
+        break;
+    case SYSINFO_IOC_GET_STATS:
+        stats_get(&stats);
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
         break;
     default:
         return -EINVAL;
@@ -259,18 +778,167 @@ sysinfo_ioctl(struct file *file,
     return 0;
 };
 
-// file_operations for this module
-static struct file_operations fops = {
+/**
+ * @brief ioctl handler, used to toggle between sysinfo modes.
+ * 
+ * Counts the ioctl, and the error returned if any.
+ * 
+ * @param file - pointer to this device structure in kernel space.
+ * @param cmd - represents the type of ioctl operation to perform.
+ * @param arg - argument to the command.
+ * 
+ * @return long status code - 0 on success, non-zero value 
+ *         relevant to error otherwise.
+ */
+static
+long
+sysinfo_ioctl(struct file *file,
+              unsigned int cmd,
+              unsigned long arg)
+{
+    long ret = sysinfo_do_ioctl(file, cmd, arg);
+
+    stats_inc(STATS_IOCTLS);
+    if (ret < 0)
+        stats_error(ret);
+
+    return ret;
+}
+
+// file_operations for this module, visible to the KUnit tests
+VISIBLE_IF_KUNIT const struct file_operations sysinfo_fops = {
     .owner = THIS_MODULE,
     .open = sysinfo_open,
     .release = sysinfo_release,
     .unlocked_ioctl = sysinfo_ioctl,
-    .read = sysinfo_read
+    .read_iter = sysinfo_read_iter,
+    .splice_read = sysinfo_splice_read,
+    .poll = sysinfo_poll
 };
 
+/**
+ * @brief create the slab caches for per-file state, samples and
+ *        snapshots.
+ * 
+ * Dedicated caches keep the objects read on every sample out of
+ * the shared kmalloc buckets, and show them in /proc/slabinfo.
+ * 
+ * @return 0 on success, -ENOMEM if a cache could not be created.
+ */
+static
+int
+__init
+sysinfo_caches_init(void)
+{
+    sysinfo_file_cache = KMEM_CACHE(sysinfo_file, 0);
+    if (sysinfo_file_cache == NULL)
+        return -ENOMEM;
+
+    if (snapshot_init() != 0)
+    {
+        kmem_cache_destroy(sysinfo_file_cache);
+        return -ENOMEM;
+    }
+
+    if (sampler_cache_init() != 0)
+    {
+        snapshot_exit();
+        kmem_cache_destroy(sysinfo_file_cache);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief destroy the slab caches, once every object in them has
+ *        been freed.
+ */
+static
+void
+sysinfo_caches_exit(void)
+{
+    sampler_cache_exit();
+    snapshot_exit();
+    kmem_cache_destroy(sysinfo_file_cache);
+}
+
+/**
+ * @brief set up everything the device serves: the /proc files,
+ *        the categories, netlink, instrumentation and sampling.
+ * 
+ * @return 0 on success, negative error code if the categories
+ *         could not be registered.
+ */
+static
+int
+__init
+sysinfo_services_init(void)
+{
+    int err;
+
+    // create the /proc fs on module init
+    char_device_proc_init();
+
+    // find the cgroup2 hierarchy in the namespaces of the task loading the module
+    if (sysinfo_cgroup_init() != 0)
+        pr_info("No cgroup2 hierarchy found, cgroup values are left out\n");
+
+    // register the built in categories, which adds their /proc entries
+    err = registry_init();
+    if (err)
+    {
+        pr_err("Failed to register sysinfo categories\n");
+        sysinfo_cgroup_exit();
+        char_device_proc_exit();
+        return err;
+    }
+
+    // push samples to netlink listeners, the device works without it
+    if (sysinfo_netlink_init() != 0)
+        pr_err("Failed to register sysinfo netlink family\n");
+
+    // start timing the hot path, before anything is sampled
+    instrument_init();
+
+    // start periodic sampling for readers and alert thresholds
+    sampler_init();
+
+    return 0;
+}
+
+/**
+ * @brief stop sampling, and tear down what
+ *        sysinfo_services_init() set up.
+ */
+static
+void
+sysinfo_services_exit(void)
+{
+    // stop sampling first, it collects the categories
+    sampler_exit();
+
+    // no more samples to multicast, or requests for the categories
+    sysinfo_netlink_exit();
+
+    // unregister the categories, then unload the /proc file for this module
+    registry_exit();
+    char_device_proc_exit();
+
+    // nothing collects the cgroup and irq categories any more
+    sysinfo_cgroup_exit();
+    irq_exit();
+
+    // remove the debugfs files once nothing can be timed any more
+    instrument_exit();
+}
+
 /**
  * @brief handler for event of device being loaded into kernel space.
  * 
+ * The device node is created last, once the categories and the
+ * sampler it reads from are ready.
+ * 
  * @return integer status code - 0 on success, non-zero value 
  *         relevant to error otherwise.
  */
@@ -284,17 +952,35 @@ sysinfo_cdev_init(void)
     // variable to store return values from functions
     int err_ret;
 
+    // caches for the objects allocated on every open and sample
+    err_ret = sysinfo_caches_init();
+    if (err_ret < 0)
+    {
+        pr_err("Failed to create sysinfo slab caches\n");
+        return err_ret;
+    }
+
+    // everything a reader of the device can reach
+    err_ret = sysinfo_services_init();
+    if (err_ret < 0)
+    {
+        sysinfo_caches_exit();
+        return err_ret;
+    }
+
     // allocate a character device in kernel space
     err_ret = alloc_chrdev_region(&dev_num, 0, 1, DEVICE_NAME);
     if (err_ret < 0)
     {
         printk(KERN_WARNING "Failed to allocate major\n");
+        sysinfo_services_exit();
+        sysinfo_caches_exit();
         return -EFAULT;
     }
     printk(KERN_INFO "Allocated Major: %d, Minor: %d\n", MAJOR(dev_num), MINOR(dev_num));
 
     // initialize char device
-    cdev_init(&sysinfo_cdev, &fops);
+    cdev_init(&sysinfo_cdev, &sysinfo_fops);
     sysinfo_cdev.owner = THIS_MODULE;
 
     // add dev to kernel
@@ -305,6 +991,8 @@ sysinfo_cdev_init(void)
 
         // unregister the character device
         unregister_chrdev_region(dev_num, 1);
+        sysinfo_services_exit();
+        sysinfo_caches_exit();
 
         return err_ret;
     }
@@ -318,12 +1006,14 @@ sysinfo_cdev_init(void)
         cdev_del(&sysinfo_cdev); 
         // unregister the character device by major/minor
         unregister_chrdev_region(dev_num, 1);
+        sysinfo_services_exit();
+        sysinfo_caches_exit();
         
         return PTR_ERR(sysinfo_dev_class);
     }
 
-    // create a device node in /dev directory
-    if (device_create(sysinfo_dev_class, NULL, dev_num, NULL, DEVICE_NAME) == NULL)
+    // create a device node in /dev directory, last, as it can be opened straight away
+    if (IS_ERR(device_create(sysinfo_dev_class, NULL, dev_num, NULL, DEVICE_NAME)))
     {
         pr_err("Failed to create device\n");
         // destroy the device class
@@ -332,13 +1022,12 @@ sysinfo_cdev_init(void)
         cdev_del(&sysinfo_cdev);
         // unregister character device via major/minor
         unregister_chrdev_region(dev_num, 1);
+        sysinfo_services_exit();
+        sysinfo_caches_exit();
 
         return -EFAULT;
     }
 
-    // create the /proc fs on module init
-    char_device_proc_init();
-
     printk(KERN_INFO "Sysinfo char dev initialized\n");
     return 0;
 };
@@ -353,7 +1042,7 @@ void
 __exit
 sysinfo_cdev_exit(void)
 {
-    // remove the device from the kernel
+    // remove the device from the kernel, so nothing new opens it
     int major;
     major = MAJOR(dev_num);
     device_destroy(sysinfo_dev_class, MKDEV(major, 0)); // destroy device
@@ -361,8 +1050,11 @@ sysinfo_cdev_exit(void)
     cdev_del(&sysinfo_cdev); // delete character device
     unregister_chrdev_region(MKDEV(major, 0), 1); // unregister the major and minor number of device from kernel
 
-    // unload the /proc file for this module
-    char_device_proc_exit();
+    // stop sampling and unregister the categories
+    sysinfo_services_exit();
+
+    // every sample, snapshot and open file has been freed
+    sysinfo_caches_exit();
     
     printk(KERN_INFO "Module unloaded\n");
     return;
@@ -1,11 +1,18 @@
 #ifndef SYSINFO_DEV_H
 #define SYSINFO_DEV_H
 
+#include <linux/types.h>
+
 #define DEVICE_NAME "sysinfo"
 
 int sysinfo_cdev_init(void);
 void sysinfo_cdev_exit(void);
-int get_times_read(void);
-int get_time_since_loading_ns(void);
+u64 get_times_read(void);
+u64 get_time_since_loading_ns(void);
+
+#if IS_ENABLED(CONFIG_KUNIT)
+struct file_operations;
+extern const struct file_operations sysinfo_fops;
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef SYSINFO_IOCTL_H
+#define SYSINFO_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// set the current_info_type (values match the SYSINFO_CATEGORY_* ids below)
+#define SET_CIT_CPU _IOW('C', 1, int)           // set the current_info_type to cpu
+#define SET_CIT_MEM _IOW('M', 2, int)           // set the current_info_type to memory
+#define SET_CIT_DISK _IOW('D', 3, int)          // set the current_info_type to disk
+
+// magic number for per-file sysinfo ioctls
+#define SYSINFO_IOC_MAGIC 'S'
+
+/*
+ * Turn delta output on or off for this file.
+ * The argument is the keyframe interval: every n-th read returns
+ * the full document, the others only values that changed since
+ * the previous read on this file. 0 turns delta output off.
+ */
+#define SYSINFO_IOC_SET_DELTA _IOW(SYSINFO_IOC_MAGIC, 1, int)
+
+// metrics a threshold can watch
+#define SYSINFO_METRIC_FREE_RAM_KB 1            // free RAM in kB
+#define SYSINFO_METRIC_CPU_IDLE_PCT 2           // idle time of all online CPUs, in percent
+
+// direction in which a threshold is crossed
+#define SYSINFO_THRESHOLD_BELOW 0
+#define SYSINFO_THRESHOLD_ABOVE 1
+
+/*
+ * A threshold registered with SYSINFO_IOC_ADD_THRESHOLD.
+ *
+ * The threshold fires when the metric goes below (or above) value,
+ * and is re-armed once the metric is back past value by at least
+ * hysteresis. SYSINFO_IOC_ADD_THRESHOLD fails with EINVAL if the
+ * re-arm level, value + hysteresis below or value - hysteresis
+ * above, does not fit in 64 bits.
+ */
+struct sysinfo_threshold {
+    __u32 metric;                               // SYSINFO_METRIC_*
+    __u32 direction;                            // SYSINFO_THRESHOLD_*
+    __s64 value;                                // level that fires the threshold
+    __s64 hysteresis;                           // distance back past value that re-arms it
+    __u32 id;                                   // set by the device, reported in events
+    __u32 reserved;
+};
+
+// state reported in an alert event
+#define SYSINFO_ALERT_FIRED 1
+#define SYSINFO_ALERT_CLEARED 2
+
+/*
+ * Record returned by read() on a file with thresholds registered.
+ */
+struct sysinfo_alert_event {
+    __u64 timestamp_ns;                         // CLOCK_MONOTONIC time of the sample
+    __s64 value;                                // sampled value of the metric
+    __u32 id;                                   // id of the threshold
+    __u32 metric;                               // SYSINFO_METRIC_*
+    __u32 state;                                // SYSINFO_ALERT_*
+    __u32 reserved;
+};
+
+/*
+ * Register a threshold on this file. Once a file has thresholds,
+ * read() returns struct sysinfo_alert_event records and poll()
+ * reports readable when events are pending.
+ */
+#define SYSINFO_IOC_ADD_THRESHOLD _IOWR(SYSINFO_IOC_MAGIC, 2, struct sysinfo_threshold)
+
+// remove all thresholds from this file, read() returns documents again
+#define SYSINFO_IOC_CLEAR_THRESHOLDS _IO(SYSINFO_IOC_MAGIC, 3)
+
+/*
+ * Module statistics returned by SYSINFO_IOC_GET_STATS.
+ * Counters are totals since the module was loaded.
+ */
+struct sysinfo_stats {
+    __u64 uptime_ns;                            // time since the module was loaded
+    __u64 reads;                                // read() and splice() calls on the device
+    __u64 bytes_served;                         // bytes returned by those calls
+    __u64 ioctls;                               // ioctl() calls on the device
+    __u64 opens;                                // successful opens of the device
+    __u64 samples;                              // samples taken by the sampler
+    __u64 ring_overruns;                        // alert events dropped because a queue was full
+    __u64 errors_fault;                         // calls that failed with EFAULT
+    __u64 errors_nomem;                         // calls that failed with ENOMEM
+    __u64 errors_again;                         // calls that failed with EAGAIN
+    __u64 errors_busy;                          // calls that failed with EBUSY
+    __u64 errors_inval;                         // calls that failed with EINVAL
+    __u64 errors_other;                         // calls that failed with any other error
+};
+
+// get the module statistics
+#define SYSINFO_IOC_GET_STATS _IOR(SYSINFO_IOC_MAGIC, 4, struct sysinfo_stats)
+
+// longest category name, including the terminating NUL
+#define SYSINFO_CATEGORY_NAME_LEN 32
+
+// most categories that can be registered at once, built in ones included
+#define SYSINFO_MAX_CATEGORIES 64
+
+// ids of the built in categories, registered categories are numbered after these
+#define SYSINFO_CATEGORY_CPU 1
+#define SYSINFO_CATEGORY_MEMORY 2
+#define SYSINFO_CATEGORY_DISK 3
+#define SYSINFO_CATEGORY_CGROUP 4
+#define SYSINFO_CATEGORY_CGROUP_TOP 5
+#define SYSINFO_CATEGORY_IRQ 6
+
+// flags of a category
+#define SYSINFO_CATEGORY_CURRENT 1              // the category read from the device
+
+/*
+ * A category returned by SYSINFO_IOC_LIST_CATEGORIES.
+ */
+struct sysinfo_category_info {
+    __u32 id;                                   // id to pass to SYSINFO_IOC_SET_CATEGORY
+    __u32 step_count;                           // number of steps in the category's job
+    __u32 flags;                                // SYSINFO_CATEGORY_*
+    __u32 reserved;
+    char name[SYSINFO_CATEGORY_NAME_LEN];       // job title, also the name of its /proc/sysinfo entry
+};
+
+/*
+ * Argument of SYSINFO_IOC_LIST_CATEGORIES.
+ *
+ * Set categories to an array of count entries. On return count is
+ * the number of registered categories, which can be more than the
+ * number of entries filled in.
+ */
+struct sysinfo_category_list {
+    __u32 count;                                // in: entries in categories, out: categories registered
+    __u32 reserved;
+    __u64 categories;                           // pointer to struct sysinfo_category_info[count]
+};
+
+// list the registered categories, in id order
+#define SYSINFO_IOC_LIST_CATEGORIES _IOWR(SYSINFO_IOC_MAGIC, 5, struct sysinfo_category_list)
+
+// set the category read from the device, by id
+#define SYSINFO_IOC_SET_CATEGORY _IOW(SYSINFO_IOC_MAGIC, 6, __u32)
+
+// formats of the documents read from a file
+#define SYSINFO_FORMAT_JSON 0                   // one JSON object per sample, the default
+#define SYSINFO_FORMAT_PROMETHEUS 1             // Prometheus text exposition format
+
+/*
+ * Set the format of the documents read from this file, one of
+ * SYSINFO_FORMAT_*. Delta output only applies to JSON, Prometheus
+ * documents always have every value.
+ */
+#define SYSINFO_IOC_SET_FORMAT _IOW(SYSINFO_IOC_MAGIC, 7, __u32)
+
+// order of the children listed by the cgroup_top category
+#define SYSINFO_CGROUP_SORT_CPU 0               // most CPU time since the previous sample first
+#define SYSINFO_CGROUP_SORT_MEMORY 1            // most memory in use first
+
+/*
+ * Argument of SYSINFO_IOC_SET_CGROUP.
+ *
+ * The cgroup is a directory of the cgroup2 hierarchy, given by an
+ * open file descriptor, or if fd is negative by its path relative
+ * to the reader's root cgroup, e.g. "system.slice/docker.service".
+ * An empty path selects the root cgroup. A reader in a cgroup
+ * namespace can only select the root of its namespace and the
+ * cgroups below it.
+ */
+struct sysinfo_cgroup_select {
+    __s32 fd;                                   // file descriptor of the cgroup, or -1
+    __u32 sort;                                 // SYSINFO_CGROUP_SORT_*
+    __u64 path;                                 // pointer to the NUL terminated path, used if fd is -1
+};
+
+/*
+ * Select the cgroup reported by the cgroup and cgroup_top
+ * categories for the file the ioctl is called on.
+ */
+#define SYSINFO_IOC_SET_CGROUP _IOW(SYSINFO_IOC_MAGIC, 8, struct sysinfo_cgroup_select)
+
+// values a file reports
+#define SYSINFO_SCOPE_HOST 0                    // the whole machine, the default
+#define SYSINFO_SCOPE_CONTAINER 1               // limited to the reader's cgroup, like inside a container
+
+// what the device found about the reader when the file was opened
+#define SYSINFO_SCOPE_CGROUP_NS 1               // the reader is in a cgroup namespace
+#define SYSINFO_SCOPE_PID_NS 2                  // the reader is in a pid namespace
+#define SYSINFO_SCOPE_CGROUP_FOUND 4            // the reader's cgroup was found, values can be scoped
+
+// longest cgroup path in struct sysinfo_scope_info, including the terminating NUL
+#define SYSINFO_SCOPE_PATH_LEN 256
+
+/*
+ * Scope of a file, returned by SYSINFO_IOC_GET_SCOPE.
+ *
+ * A reader in a cgroup namespace is scoped to the root of its
+ * namespace, usually its container's cgroup, and other readers to
+ * their own cgroup.
+ */
+struct sysinfo_scope_info {
+    __u32 scope;                                // SYSINFO_SCOPE_HOST or SYSINFO_SCOPE_CONTAINER
+    __u32 flags;                                // SYSINFO_SCOPE_CGROUP_NS, _PID_NS and _CGROUP_FOUND
+    __u32 pid_ns_level;                         // depth of the reader's pid namespace, 0 for the host
+    __u32 reserved;
+    char cgroup[SYSINFO_SCOPE_PATH_LEN];        // path of the cgroup in the cgroup2 hierarchy, "" if not found
+};
+
+/*
+ * Set the scope of this file, one of SYSINFO_SCOPE_*. In container
+ * scope the cpu category reports the CPUs the cgroup can use, and
+ * the memory category the cgroup's memory limits and use.
+ */
+#define SYSINFO_IOC_SET_SCOPE _IOW(SYSINFO_IOC_MAGIC, 9, __u32)
+
+// get the scope of this file, and what was found about its reader
+#define SYSINFO_IOC_GET_SCOPE _IOR(SYSINFO_IOC_MAGIC, 10, struct sysinfo_scope_info)
+
+#endif
@@ -0,0 +1,869 @@
+/**
+ * sysinfo_kunit.c
+ * 
+ * KUnit tests for the collectors, the snapshot layer and the
+ * file operations of the /dev node. Built into the module when
+ * CONFIG_SYSINFO_KUNIT_TEST is set, see README.adoc for how to
+ * run them with kunit.py or on a running kernel.
+ * 
+ * The file operations are called directly on a struct file
+ * that is not backed by the /dev node, so the tests do not
+ * depend on udev or devtmpfs.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/atomic.h>
+#include <net/genetlink.h>
+
+#include "sysinfo_dev.h"                        // sysinfo_fops
+#include "sysinfo_ioctl.h"                      // ioctl definitions
+#include "job.h"                                // job functions
+#include "cpu.h"                                // cpu job
+#include "memory.h"                             // memory job
+#include "disk.h"                               // disk job
+#include "cgroup.h"                             // cgroup jobs
+#include "irq.h"                                // irq job
+#include "scope.h"                              // container scope of readers
+#include "netlink.h"                            // generic netlink family
+#include "registry.h"                           // registered categories
+#include "sampler.h"                            // sampler_sample_now()
+#include "snapshot.h"                           // page backed documents
+
+// largest document the tests read from the device
+#define SYSINFO_TEST_MAX_DOC (64 * 1024)
+// number of threads and iterations of the concurrent reader test
+#define SYSINFO_TEST_READERS 4
+#define SYSINFO_TEST_READER_ITERATIONS 200
+// number of steps of the job used by the large output test
+#define SYSINFO_TEST_LARGE_STEPS 2000
+
+/**
+ * A sysinfo category, with the title its job is expected to have.
+ */
+struct sysinfo_test_category {
+    const char* title;
+    const Job* job;
+};
+
+static const struct sysinfo_test_category sysinfo_test_categories[] = {
+    { "cpu", &cpu_job },
+    { "memory", &memory_job },
+    { "disk", &disk_job },
+    { "cgroup", &cgroup_job },
+    { "cgroup_top", &cgroup_top_job },
+    { "irq", &irq_job },
+};
+
+static
+void
+sysinfo_test_category_desc(const struct sysinfo_test_category* c,
+                           char* desc)
+{
+    strscpy(desc, c->title, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(sysinfo_test_category, sysinfo_test_categories, sysinfo_test_category_desc);
+
+/**
+ * @brief read from a file through sysinfo_fops.read_iter.
+ * 
+ * @param file - the file to read.
+ * @param buf - kernel buffer to read into.
+ * @param len - number of bytes to read at most.
+ * @param pos - offset to read from.
+ * 
+ * @return number of bytes read, or negative error code.
+ */
+static
+ssize_t
+sysinfo_test_read(struct file *file,
+                  char* buf,
+                  size_t len,
+                  loff_t pos)
+{
+    struct kiocb kiocb = { .ki_filp = file, .ki_pos = pos };
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+    return sysinfo_fops.read_iter(&kiocb, &iter);
+}
+
+/**
+ * @brief read the next document from a file.
+ * 
+ * Reads one byte at offset 0, which takes a new snapshot, and
+ * the rest of the snapshot from offset 1.
+ * 
+ * @param test - the running test.
+ * @param file - the file to read.
+ * @param len - set to the length of the document.
+ * 
+ * @return the document, freed when the test ends.
+ */
+static
+char*
+sysinfo_test_read_document(struct kunit *test,
+                           struct file *file,
+                           size_t* len)
+{
+    char* doc = kunit_kzalloc(test, SYSINFO_TEST_MAX_DOC, GFP_KERNEL);
+    loff_t pos = 1;
+    ssize_t n;
+
+    KUNIT_ASSERT_NOT_NULL(test, doc);
+    KUNIT_ASSERT_EQ(test, sysinfo_test_read(file, doc, 1, 0), 1);
+
+    while ((n = sysinfo_test_read(file, doc + pos, SYSINFO_TEST_MAX_DOC - 1 - pos, pos)) > 0)
+        pos += n;
+
+    KUNIT_ASSERT_EQ(test, n, 0);
+    *len = pos;
+    return doc;
+}
+
+/**
+ * @brief check a document is one JSON object.
+ */
+static
+void
+sysinfo_test_expect_object(struct kunit *test,
+                           const char* doc,
+                           size_t len)
+{
+    KUNIT_ASSERT_GE(test, len, 2);
+    KUNIT_EXPECT_EQ(test, doc[0], '{');
+    KUNIT_EXPECT_EQ(test, doc[len - 1], '}');
+}
+
+/*
+ * Collector tests.
+ */
+
+/**
+ * Each category has a table of steps with a key and handler
+ * each, collects a value for every step, and frees everything
+ * it allocated.
+ */
+static
+void
+sysinfo_test_job_construction(struct kunit *test)
+{
+    const struct sysinfo_test_category* c = test->param_value;
+    const Job* job = c->job;
+    JobResult* r;
+
+    KUNIT_EXPECT_STREQ(test, job->job_title, c->title);
+    KUNIT_ASSERT_GT(test, job->step_count, 0);
+    for (int i = 0; i < job->step_count; i++)
+    {
+        KUNIT_EXPECT_NOT_NULL(test, job->steps[i].key);
+        KUNIT_EXPECT_TRUE(test, job->steps[i].handler != NULL || job->steps[i].emit != NULL);
+    }
+
+    r = collect_job(job);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+    KUNIT_EXPECT_STREQ(test, r->job_title, c->title);
+    KUNIT_EXPECT_GT(test, r->kvp_count, 0);
+
+    for (int i = 0; i < r->kvp_count; i++)
+    {
+        KUNIT_EXPECT_STREQ(test, r->kvps[i].key, job->steps[i].key);
+        KUNIT_EXPECT_PTR_EQ(test, r->kvps[i].unit, job->steps[i].unit);
+    }
+
+    free_job_result(r);
+}
+
+/**
+ * Each category serializes to one JSON object.
+ */
+static
+void
+sysinfo_test_job_serialize(struct kunit *test)
+{
+    const struct sysinfo_test_category* c = test->param_value;
+    char* json = run_job(c->job);
+
+    KUNIT_ASSERT_NOT_NULL(test, json);
+    sysinfo_test_expect_object(test, json, strlen(json));
+    kfree(json);
+}
+
+static atomic_t sysinfo_test_slow_calls = ATOMIC_INIT(0);
+static DECLARE_COMPLETION(sysinfo_test_slow_release);  // completed by the test once per call to return
+
+static
+char*
+sysinfo_test_slow_step(void)
+{
+    int call = atomic_inc_return(&sysinfo_test_slow_calls);
+
+    wait_for_completion(&sysinfo_test_slow_release);
+    return kasprintf(GFP_KERNEL, "%d", call);
+}
+
+DEFINE_JOB(sysinfo_test_slow_job, "kunit_slow",
+    JOB_STEP("kunit_slow", sysinfo_test_slow_step, JOB_VALUE_NUMBER, NULL, .budget_ms = 10));
+
+/**
+ * A step that runs over its budget is served stale, first with
+ * no value, then with the value of the attempt that ran over.
+ */
+static
+void
+sysinfo_test_job_budget(struct kunit *test)
+{
+    JobResult* r;
+    char* json;
+
+    atomic_set(&sysinfo_test_slow_calls, 0);
+    reinit_completion(&sysinfo_test_slow_release);
+
+    // nothing to serve yet, the step is left out and listed as stale
+    r = collect_job(&sysinfo_test_slow_job);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+    KUNIT_EXPECT_TRUE(test, r->kvps[0].stale);
+    KUNIT_EXPECT_NULL(test, r->kvps[0].value);
+    json = serialize_job_result(r, NULL);
+    KUNIT_EXPECT_STREQ(test, json, "{\"" JOB_STALE_KEY "\":[\"kunit_slow\"]}");
+    kfree(json);
+    free_job_result(r);
+
+    // let the first attempt return, and a second one run over
+    complete(&sysinfo_test_slow_release);
+    job_wait_budgets(&sysinfo_test_slow_job);
+    r = collect_job(&sysinfo_test_slow_job);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+    KUNIT_EXPECT_TRUE(test, r->kvps[0].stale);
+    KUNIT_EXPECT_STREQ(test, r->kvps[0].value, "1");
+    free_job_result(r);
+
+    complete(&sysinfo_test_slow_release);
+    job_flush_budgets(&sysinfo_test_slow_job);
+    KUNIT_EXPECT_EQ(test, atomic_read(&sysinfo_test_slow_calls), 2);
+    KUNIT_EXPECT_FALSE(test, sysinfo_test_slow_job.state[0].has_last);
+}
+
+static struct kunit_case sysinfo_job_test_cases[] = {
+    KUNIT_CASE_PARAM(sysinfo_test_job_construction, sysinfo_test_category_gen_params),
+    KUNIT_CASE_PARAM(sysinfo_test_job_serialize, sysinfo_test_category_gen_params),
+    KUNIT_CASE(sysinfo_test_job_budget),
+    {}
+};
+
+static struct kunit_suite sysinfo_job_test_suite = {
+    .name = "sysinfo_job",
+    .test_cases = sysinfo_job_test_cases,
+};
+
+/*
+ * Snapshot tests.
+ */
+
+static
+char*
+sysinfo_test_step(void)
+{
+    return kstrdup("0123456789abcdef", GFP_KERNEL);
+}
+
+/**
+ * A document spanning many pages reads back intact, in one
+ * read, across page boundaries, and split over two segments.
+ */
+static
+void
+sysinfo_test_snapshot_large(struct kunit *test)
+{
+    struct sysinfo_snapshot* snap;
+    struct iov_iter iter;
+    struct kvec kv[2];
+    Job job = { .job_title = "kunit", .step_count = SYSINFO_TEST_LARGE_STEPS };
+    Step* steps;
+    size_t len;
+    char* json;
+    char* buf;
+
+    steps = kunit_kcalloc(test, SYSINFO_TEST_LARGE_STEPS, sizeof(Step), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, steps);
+    for (int i = 0; i < SYSINFO_TEST_LARGE_STEPS; i++)
+        steps[i] = (Step)JOB_STEP("kunit_key", sysinfo_test_step, JOB_VALUE_STRING, NULL);
+    job.steps = steps;
+
+    json = run_job(&job);
+    KUNIT_ASSERT_NOT_NULL(test, json);
+    len = strlen(json);
+    KUNIT_ASSERT_GT(test, len, 4 * PAGE_SIZE);
+
+    snap = snapshot_create(json, len);
+    KUNIT_ASSERT_NOT_NULL(test, snap);
+    KUNIT_EXPECT_EQ(test, snap->nr_pages, DIV_ROUND_UP(len, PAGE_SIZE));
+
+    buf = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+
+    // the whole document in one read
+    kv[0] = (struct kvec){ .iov_base = buf, .iov_len = len };
+    iov_iter_kvec(&iter, ITER_DEST, kv, 1, len);
+    KUNIT_EXPECT_EQ(test, snapshot_copy_to_iter(snap, &iter, 0), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, memcmp(buf, json, len), 0);
+
+    // a read across a page boundary
+    memset(buf, 0, len);
+    kv[0] = (struct kvec){ .iov_base = buf, .iov_len = 10 };
+    iov_iter_kvec(&iter, ITER_DEST, kv, 1, 10);
+    KUNIT_EXPECT_EQ(test, snapshot_copy_to_iter(snap, &iter, PAGE_SIZE - 5), 10);
+    KUNIT_EXPECT_EQ(test, memcmp(buf, json + PAGE_SIZE - 5, 10), 0);
+
+    // the rest of the document from an odd offset, into two segments
+    memset(buf, 0, len);
+    kv[0] = (struct kvec){ .iov_base = buf, .iov_len = 333 };
+    kv[1] = (struct kvec){ .iov_base = buf + 333, .iov_len = len - 333 };
+    iov_iter_kvec(&iter, ITER_DEST, kv, 2, len);
+    KUNIT_EXPECT_EQ(test, snapshot_copy_to_iter(snap, &iter, 17), (ssize_t)(len - 17));
+    KUNIT_EXPECT_EQ(test, memcmp(buf, json + 17, len - 17), 0);
+
+    // nothing past the end
+    iov_iter_kvec(&iter, ITER_DEST, kv, 1, 1);
+    KUNIT_EXPECT_EQ(test, snapshot_copy_to_iter(snap, &iter, len), 0);
+
+    snapshot_put(snap);
+    kfree(json);
+}
+
+static struct kunit_case sysinfo_snapshot_test_cases[] = {
+    KUNIT_CASE(sysinfo_test_snapshot_large),
+    {}
+};
+
+static struct kunit_suite sysinfo_snapshot_test_suite = {
+    .name = "sysinfo_snapshot",
+    .test_cases = sysinfo_snapshot_test_cases,
+};
+
+/*
+ * File operation tests. Every test starts with the device open
+ * in non-blocking mode, through a file in test->priv.
+ */
+
+static
+int
+sysinfo_dev_test_init(struct kunit *test)
+{
+    struct file *file = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+    int err;
+
+    if (file == NULL)
+        return -ENOMEM;
+
+    file->f_flags = O_RDONLY | O_NONBLOCK;
+    err = sysinfo_fops.open(NULL, file);
+    if (err)
+        return err;
+
+    test->priv = file;
+    return 0;
+}
+
+static
+void
+sysinfo_dev_test_exit(struct kunit *test)
+{
+    struct file *file = test->priv;
+
+    sysinfo_fops.release(NULL, file);
+    registry_set_current(SYSINFO_CATEGORY_CPU);
+}
+
+/**
+ * Stops the periodic sampler for the suite, so the tests decide
+ * when samples are taken, with sampler_sample_now().
+ */
+static
+int
+sysinfo_dev_test_suite_init(struct kunit_suite *suite)
+{
+    sampler_exit();
+    return 0;
+}
+
+static
+void
+sysinfo_dev_test_suite_exit(struct kunit_suite *suite)
+{
+    sampler_init();
+}
+
+/**
+ * The device can only be open once at a time.
+ */
+static
+void
+sysinfo_test_open_busy(struct kunit *test)
+{
+    struct file *other = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, other);
+    KUNIT_EXPECT_EQ(test, sysinfo_fops.open(NULL, other), -EBUSY);
+}
+
+/**
+ * A read at offset 0 takes a new sample once, then returns
+ * -EAGAIN in non-blocking mode until the next sample. The sampler
+ * is stopped for the suite, so none is taken in between.
+ */
+static
+void
+sysinfo_test_read_new_sample(struct kunit *test)
+{
+    struct file *file = test->priv;
+    char buf[16];
+    size_t len;
+    char* doc;
+
+    doc = sysinfo_test_read_document(test, file, &len);
+    sysinfo_test_expect_object(test, doc, len);
+    // samples carry their metadata first
+    KUNIT_EXPECT_EQ(test, strncmp(doc, "{\"" JOB_SEQ_KEY "\":\"", strlen(JOB_SEQ_KEY) + 5), 0);
+    KUNIT_EXPECT_NOT_NULL(test, strnstr(doc, "\"" JOB_REALTIME_KEY "\":\"", len));
+
+    KUNIT_EXPECT_EQ(test, sysinfo_test_read(file, buf, sizeof(buf), 0), -EAGAIN);
+
+    sampler_sample_now();
+    KUNIT_EXPECT_GT(test, sysinfo_test_read(file, buf, sizeof(buf), 0), 0);
+}
+
+static const size_t sysinfo_test_chunk_sizes[] = { 1, 7, 64, 4096 };
+
+static
+void
+sysinfo_test_chunk_desc(const size_t* chunk,
+                        char* desc)
+{
+    snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%zu bytes", *chunk);
+}
+
+KUNIT_ARRAY_PARAM(sysinfo_test_chunk, sysinfo_test_chunk_sizes, sysinfo_test_chunk_desc);
+
+/**
+ * Reads of any size, at any offset, return the matching part
+ * of the snapshot taken at offset 0.
+ */
+static
+void
+sysinfo_test_read_chunked(struct kunit *test)
+{
+    const size_t chunk = *(const size_t*)test->param_value;
+    struct file *file = test->priv;
+    char* buf;
+    size_t len;
+    char* doc;
+    loff_t pos;
+    ssize_t n;
+
+    doc = sysinfo_test_read_document(test, file, &len);
+    buf = kunit_kzalloc(test, chunk, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+
+    // the whole snapshot, chunk by chunk
+    for (pos = 1; pos < len; pos += n)
+    {
+        n = sysinfo_test_read(file, buf, chunk, pos);
+        KUNIT_ASSERT_EQ(test, n, (ssize_t)min_t(size_t, chunk, len - pos));
+        KUNIT_ASSERT_EQ(test, memcmp(buf, doc + pos, n), 0);
+    }
+
+    // single reads at arbitrary offsets
+    const loff_t offsets[] = { 1, len / 3, len / 2, len - 1 };
+    for (int i = 0; i < ARRAY_SIZE(offsets); i++)
+    {
+        n = sysinfo_test_read(file, buf, chunk, offsets[i]);
+        KUNIT_EXPECT_EQ(test, n, (ssize_t)min_t(size_t, chunk, len - offsets[i]));
+        if (n > 0)
+            KUNIT_EXPECT_EQ(test, memcmp(buf, doc + offsets[i], n), 0);
+    }
+
+    KUNIT_EXPECT_EQ(test, sysinfo_test_read(file, buf, chunk, len), 0);
+    KUNIT_EXPECT_EQ(test, sysinfo_test_read(file, buf, chunk, len + 100), 0);
+}
+
+/**
+ * The current_info_type ioctls switch the job, and take a new
+ * sample that the next read returns.
+ */
+static
+void
+sysinfo_test_ioctl_switch(struct kunit *test)
+{
+    static const struct {
+        unsigned int cmd;
+        const char* title;
+    } switches[] = {
+        { SET_CIT_MEM, "memory" },
+        { SET_CIT_DISK, "disk" },
+        { SET_CIT_CPU, "cpu" },
+    };
+    struct file *file = test->priv;
+    size_t len;
+    char* doc;
+
+    // read the sample taken on open
+    sysinfo_test_read_document(test, file, &len);
+
+    for (int i = 0; i < ARRAY_SIZE(switches); i++)
+    {
+        KUNIT_ASSERT_EQ(test, sysinfo_fops.unlocked_ioctl(file, switches[i].cmd, 0), 0);
+
+        struct sysinfo_category* category = registry_get_current();
+        KUNIT_ASSERT_NOT_NULL(test, category);
+        KUNIT_EXPECT_STREQ(test, category->job->job_title, switches[i].title);
+        registry_put(category);
+
+        // the ioctl took a new sample, so this does not return -EAGAIN
+        doc = sysinfo_test_read_document(test, file, &len);
+        sysinfo_test_expect_object(test, doc, len);
+    }
+
+    KUNIT_EXPECT_EQ(test, sysinfo_fops.unlocked_ioctl(file, _IO('x', 0), 0), -EINVAL);
+}
+
+static
+char*
+sysinfo_test_registered_value(void)
+{
+    return kstrdup("registered_value", GFP_KERNEL);
+}
+
+DEFINE_JOB(sysinfo_test_registered_job, "kunit_registered",
+    JOB_STEP("kunit_key", sysinfo_test_registered_value, JOB_VALUE_STRING, NULL),
+);
+
+DEFINE_JOB(sysinfo_test_invalid_job, "kunit/invalid");
+
+/**
+ * A registered job gets a new id, is listed, and can be read from
+ * the device. Unregistering it while it is being read switches
+ * readers back to the cpu category.
+ */
+static
+void
+sysinfo_test_register(struct kunit *test)
+{
+    struct sysinfo_category_info* infos;
+    struct sysinfo_category* category;
+    struct file *file = test->priv;
+    bool listed = false;
+    size_t len;
+    char* doc;
+    int count;
+    int id;
+
+    KUNIT_EXPECT_EQ(test, register_sysinfo_job(&sysinfo_test_invalid_job), -EINVAL);
+    KUNIT_EXPECT_EQ(test, register_sysinfo_job(&cpu_job), -EEXIST);
+
+    id = register_sysinfo_job(&sysinfo_test_registered_job);
+    KUNIT_ASSERT_GT(test, id, SYSINFO_CATEGORY_IRQ);
+
+    infos = kunit_kcalloc(test, SYSINFO_MAX_CATEGORIES, sizeof(struct sysinfo_category_info), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, infos);
+    count = registry_list(infos, SYSINFO_MAX_CATEGORIES);
+    KUNIT_EXPECT_GE(test, count, 7);
+    for (int i = 0; i < count; i++)
+    {
+        if (infos[i].id == id)
+        {
+            listed = true;
+            KUNIT_EXPECT_STREQ(test, infos[i].name, "kunit_registered");
+            KUNIT_EXPECT_EQ(test, infos[i].step_count, 1);
+        }
+    }
+    KUNIT_EXPECT_TRUE(test, listed);
+
+    // read the sample taken on open, then switch to the new category
+    sysinfo_test_read_document(test, file, &len);
+    KUNIT_ASSERT_EQ(test, registry_set_current(id), 0);
+    KUNIT_ASSERT_EQ(test, sampler_sample_now(), 0);
+    doc = sysinfo_test_read_document(test, file, &len);
+    KUNIT_EXPECT_NOT_NULL(test, strnstr(doc, "\"kunit_key\":\"registered_value\"", len));
+
+    unregister_sysinfo_job(id);
+    KUNIT_EXPECT_EQ(test, registry_set_current(id), -ENOENT);
+
+    category = registry_get_current();
+    KUNIT_ASSERT_NOT_NULL(test, category);
+    KUNIT_EXPECT_EQ(test, category->id, SYSINFO_CATEGORY_CPU);
+    registry_put(category);
+
+    // unregistering took a sample of the cpu category
+    doc = sysinfo_test_read_document(test, file, &len);
+    KUNIT_EXPECT_NULL(test, strnstr(doc, "kunit_key", len));
+}
+
+/**
+ * A cgroup can be selected by path below a root, and the cgroup
+ * categories are then collected for the selection in place of the
+ * sample. Skipped when there is no cgroup2 hierarchy mounted.
+ */
+static
+void
+sysinfo_test_cgroup_select(struct kunit *test)
+{
+    struct sysinfo_cgroup_view* view = NULL;
+    struct path root;
+    JobResult* sample;
+    JobResult* r;
+    int err;
+
+    err = sysinfo_cgroup_root(&root);
+    if (err != 0)
+        kunit_skip(test, "no cgroup2 hierarchy mounted (%d)", err);
+
+    KUNIT_EXPECT_EQ(test, sysinfo_cgroup_select(&view, &root, -1, "", SYSINFO_CGROUP_SORT_MEMORY + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, sysinfo_cgroup_select(&view, &root, -1, "kunit/does/not/exist", SYSINFO_CGROUP_SORT_CPU), -ENOENT);
+    KUNIT_EXPECT_NULL(test, view);
+
+    KUNIT_ASSERT_EQ(test, sysinfo_cgroup_select(&view, &root, -1, "", SYSINFO_CGROUP_SORT_MEMORY), 0);
+    KUNIT_ASSERT_NOT_NULL(test, view);
+    KUNIT_EXPECT_EQ(test, view->sort, (u32)SYSINFO_CGROUP_SORT_MEMORY);
+    path_put(&root);
+
+    // a sample of the cgroup category is collected again for the view
+    sample = collect_job(&cgroup_job);
+    KUNIT_ASSERT_NOT_NULL(test, sample);
+    sample->seq = 42;
+    r = sysinfo_cgroup_collect(view, sample);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, r);
+    KUNIT_EXPECT_EQ(test, r->seq, (u64)42);
+    KUNIT_EXPECT_STREQ(test, r->job_title, cgroup_job.job_title);
+    free_job_result(r);
+    free_job_result(sample);
+
+    // samples of other categories are left to the caller
+    sample = collect_job(&cpu_job);
+    KUNIT_ASSERT_NOT_NULL(test, sample);
+    KUNIT_EXPECT_NULL(test, sysinfo_cgroup_collect(view, sample));
+    KUNIT_EXPECT_NULL(test, sysinfo_cgroup_collect(NULL, sample));
+    free_job_result(sample);
+
+    sysinfo_cgroup_view_destroy(view);
+}
+
+/**
+ * The test's task is on the host, and in container scope the
+ * memory category reports no more memory than the host has.
+ * Partly skipped when the test's cgroup cannot be found.
+ */
+static
+void
+sysinfo_test_scope(struct kunit *test)
+{
+    struct sysinfo_scope* scope = scope_create();
+    JobResult* scoped;
+    JobResult* r;
+    u64 host_total;
+    u64 total;
+
+    KUNIT_ASSERT_NOT_NULL(test, scope);
+    KUNIT_EXPECT_EQ(test, scope->scope, SYSINFO_SCOPE_HOST);
+    KUNIT_EXPECT_EQ(test, scope->pid_ns_level, 0);
+    KUNIT_EXPECT_FALSE(test, scope->flags & SYSINFO_SCOPE_PID_NS);
+    KUNIT_EXPECT_EQ(test, scope_set(scope, SYSINFO_SCOPE_CONTAINER + 1), -EINVAL);
+
+    if (!(scope->flags & SYSINFO_SCOPE_CGROUP_FOUND))
+    {
+        KUNIT_EXPECT_EQ(test, scope_set(scope, SYSINFO_SCOPE_CONTAINER), -ENOENT);
+        scope_destroy(scope);
+        kunit_skip(test, "cgroup of the test not found");
+    }
+
+    r = collect_job(&memory_job);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+
+    // values are only changed in container scope
+    KUNIT_EXPECT_NULL(test, scope_apply(scope, r));
+    KUNIT_EXPECT_EQ(test, scope_set(scope, SYSINFO_SCOPE_CONTAINER), 0);
+
+    scoped = scope_apply(scope, r);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, scoped);
+    KUNIT_ASSERT_EQ(test, kstrtou64(r->kvps[0].value, 10, &host_total), 0);
+    KUNIT_ASSERT_EQ(test, kstrtou64(scoped->kvps[0].value, 10, &total), 0);
+    KUNIT_EXPECT_LE(test, total, host_total);
+
+    free_job_result(scoped);
+    free_job_result(r);
+    scope_destroy(scope);
+}
+
+/**
+ * A sample is encoded as a netlink message with its category,
+ * metadata and one nested attribute per step, in step order.
+ */
+static
+void
+sysinfo_test_netlink_build(struct kunit *test)
+{
+    struct sk_buff* skb;
+    struct nlmsghdr* nlh;
+    struct nlattr* attr;
+    struct nlattr* first = NULL;
+    JobResult* r;
+    int values = 0;
+    int rem;
+
+    KUNIT_EXPECT_FALSE(test, sysinfo_netlink_has_listeners(0));
+    KUNIT_EXPECT_FALSE(test, sysinfo_netlink_has_listeners(SYSINFO_MAX_CATEGORIES + 1));
+
+    r = collect_job(&cpu_job);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+    r->seq = 5;
+
+    skb = sysinfo_netlink_build(r, SYSINFO_CATEGORY_CPU, 0, 0);
+    KUNIT_ASSERT_NOT_NULL(test, skb);
+    nlh = nlmsg_hdr(skb);
+
+    attr = nlmsg_find_attr(nlh, GENL_HDRLEN, SYSINFO_NL_ATTR_CATEGORY);
+    KUNIT_ASSERT_NOT_NULL(test, attr);
+    KUNIT_EXPECT_EQ(test, nla_get_u32(attr), SYSINFO_CATEGORY_CPU);
+
+    attr = nlmsg_find_attr(nlh, GENL_HDRLEN, SYSINFO_NL_ATTR_TITLE);
+    KUNIT_ASSERT_NOT_NULL(test, attr);
+    KUNIT_EXPECT_STREQ(test, (char*)nla_data(attr), "cpu");
+
+    attr = nlmsg_find_attr(nlh, GENL_HDRLEN, SYSINFO_NL_ATTR_SEQ);
+    KUNIT_ASSERT_NOT_NULL(test, attr);
+    KUNIT_EXPECT_EQ(test, nla_get_u64(attr), 5);
+
+    nlmsg_for_each_attr(attr, nlh, GENL_HDRLEN, rem)
+    {
+        if (nla_type(attr) != SYSINFO_NL_ATTR_VALUE)
+            continue;
+        if (first == NULL)
+            first = attr;
+        values++;
+    }
+    KUNIT_EXPECT_EQ(test, values, r->kvp_count);
+
+    KUNIT_ASSERT_NOT_NULL(test, first);
+    attr = nla_find_nested(first, SYSINFO_NL_VALUE_KEY);
+    KUNIT_ASSERT_NOT_NULL(test, attr);
+    KUNIT_EXPECT_STREQ(test, (char*)nla_data(attr), r->kvps[0].key);
+
+    nlmsg_free(skb);
+    free_job_result(r);
+}
+
+/**
+ * State shared by the threads of the concurrent reader test.
+ */
+struct sysinfo_test_reader {
+    struct file *file;
+    const char* doc;
+    size_t len;
+    size_t chunk;
+    atomic_t* mismatches;
+    struct completion done;
+};
+
+static
+int
+sysinfo_test_reader_fn(void* arg)
+{
+    struct sysinfo_test_reader* r = arg;
+    char* buf = kmalloc(r->chunk, GFP_KERNEL);
+
+    for (int i = 0; buf != NULL && i < SYSINFO_TEST_READER_ITERATIONS; i++)
+    {
+        for (loff_t pos = 1; pos < r->len;)
+        {
+            ssize_t n = sysinfo_test_read(r->file, buf, r->chunk, pos);
+            if (n <= 0 || memcmp(buf, r->doc + pos, n) != 0)
+            {
+                atomic_inc(r->mismatches);
+                break;
+            }
+            pos += n;
+        }
+    }
+
+    if (buf == NULL)
+        atomic_inc(r->mismatches);
+    kfree(buf);
+    complete(&r->done);
+    return 0;
+}
+
+/**
+ * Readers on several threads read the same snapshot of one
+ * file at the same time, with different read sizes.
+ */
+static
+void
+sysinfo_test_concurrent_readers(struct kunit *test)
+{
+    struct sysinfo_test_reader readers[SYSINFO_TEST_READERS];
+    struct file *file = test->priv;
+    atomic_t mismatches = ATOMIC_INIT(0);
+    struct task_struct *task;
+    size_t len;
+    char* doc;
+
+    doc = sysinfo_test_read_document(test, file, &len);
+
+    for (int i = 0; i < SYSINFO_TEST_READERS; i++)
+    {
+        readers[i] = (struct sysinfo_test_reader){
+            .file = file,
+            .doc = doc,
+            .len = len,
+            .chunk = i * 13 + 1,
+            .mismatches = &mismatches,
+        };
+        init_completion(&readers[i].done);
+
+        task = kthread_run(sysinfo_test_reader_fn, &readers[i], "sysinfo_kunit_%d", i);
+        if (IS_ERR(task))
+        {
+            atomic_inc(&mismatches);
+            complete(&readers[i].done);
+        }
+    }
+
+    for (int i = 0; i < SYSINFO_TEST_READERS; i++)
+        wait_for_completion(&readers[i].done);
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&mismatches), 0);
+}
+
+static struct kunit_case sysinfo_dev_test_cases[] = {
+    KUNIT_CASE(sysinfo_test_open_busy),
+    KUNIT_CASE(sysinfo_test_read_new_sample),
+    KUNIT_CASE_PARAM(sysinfo_test_read_chunked, sysinfo_test_chunk_gen_params),
+    KUNIT_CASE(sysinfo_test_ioctl_switch),
+    KUNIT_CASE(sysinfo_test_register),
+    KUNIT_CASE(sysinfo_test_cgroup_select),
+    KUNIT_CASE(sysinfo_test_scope),
+    KUNIT_CASE(sysinfo_test_netlink_build),
+    KUNIT_CASE(sysinfo_test_concurrent_readers),
+    {}
+};
+
+static struct kunit_suite sysinfo_dev_test_suite = {
+    .name = "sysinfo_dev",
+    .suite_init = sysinfo_dev_test_suite_init,
+    .suite_exit = sysinfo_dev_test_suite_exit,
+    .init = sysinfo_dev_test_init,
+    .exit = sysinfo_dev_test_exit,
+    .test_cases = sysinfo_dev_test_cases,
+};
+
+kunit_test_suites(&sysinfo_job_test_suite, &sysinfo_snapshot_test_suite, &sysinfo_dev_test_suite);
@@ -0,0 +1,67 @@
+#ifndef SYSINFO_NETLINK_H
+#define SYSINFO_NETLINK_H
+
+/*
+ * Generic netlink interface of the sysinfo module.
+ *
+ * Samples are pushed to the multicast groups of the "sysinfo"
+ * family as SYSINFO_NL_CMD_SAMPLE messages, so many listeners are
+ * fed by one collection, without polling the device:
+ *
+ * - SYSINFO_NL_GROUP_SAMPLES ("samples") gets every sample taken.
+ * - "category<id>", e.g. "category2" for memory, gets the samples
+ *   of one category. The category is sampled every
+ *   sample_interval_ms while the group has a listener, whether or
+ *   not the device is open.
+ *
+ * SYSINFO_NL_CMD_GET collects a category on demand, and is
+ * answered with a SYSINFO_NL_CMD_SAMPLE message.
+ */
+
+#define SYSINFO_NL_FAMILY_NAME "sysinfo"
+#define SYSINFO_NL_VERSION 1
+
+// name of the group that gets every sample
+#define SYSINFO_NL_GROUP_SAMPLES "samples"
+// name of the group of a category, with the category's id
+#define SYSINFO_NL_GROUP_CATEGORY "category%d"
+
+enum sysinfo_nl_cmd {
+    SYSINFO_NL_CMD_UNSPEC,
+    SYSINFO_NL_CMD_GET,                         // collect a category now, SYSINFO_NL_ATTR_CATEGORY or the current one
+    SYSINFO_NL_CMD_SAMPLE,                      // a sample, multicast or in reply to SYSINFO_NL_CMD_GET
+    __SYSINFO_NL_CMD_MAX,
+};
+#define SYSINFO_NL_CMD_MAX (__SYSINFO_NL_CMD_MAX - 1)
+
+// attributes of a message
+enum sysinfo_nl_attr {
+    SYSINFO_NL_ATTR_UNSPEC,
+    SYSINFO_NL_ATTR_PAD,
+    SYSINFO_NL_ATTR_CATEGORY,                   // u32, id of the category
+    SYSINFO_NL_ATTR_TITLE,                      // string, title of the category's job
+    SYSINFO_NL_ATTR_SEQ,                        // u64, sequence number of the sample, left out on demand
+    SYSINFO_NL_ATTR_MONOTONIC_NS,               // u64, CLOCK_MONOTONIC time collection started
+    SYSINFO_NL_ATTR_REALTIME_NS,                // u64, CLOCK_REALTIME time collection started
+    SYSINFO_NL_ATTR_DURATION_NS,                // u64, time the collection took
+    SYSINFO_NL_ATTR_VALUE,                      // nested SYSINFO_NL_VALUE_*, one per step, in step order
+    __SYSINFO_NL_ATTR_MAX,
+};
+#define SYSINFO_NL_ATTR_MAX (__SYSINFO_NL_ATTR_MAX - 1)
+
+// attributes of a SYSINFO_NL_ATTR_VALUE, or of a value nested in one
+enum sysinfo_nl_value {
+    SYSINFO_NL_VALUE_UNSPEC,
+    SYSINFO_NL_VALUE_PAD,
+    SYSINFO_NL_VALUE_KEY,                       // string, left out in arrays
+    SYSINFO_NL_VALUE_TYPE,                      // u32, JOB_VALUE_* type in job.h
+    SYSINFO_NL_VALUE_UNIT,                      // string, left out if the value has no unit
+    SYSINFO_NL_VALUE_NUMBER,                    // s64, the value of a number
+    SYSINFO_NL_VALUE_TEXT,                      // string, the value of anything else, or of a number out of range
+    SYSINFO_NL_VALUE_STALE,                     // flag, the step ran over its time budget
+    SYSINFO_NL_VALUE_CHILD,                     // nested SYSINFO_NL_VALUE_*, the values of an object or array
+    __SYSINFO_NL_VALUE_MAX,
+};
+#define SYSINFO_NL_VALUE_MAX (__SYSINFO_NL_VALUE_MAX - 1)
+
+#endif
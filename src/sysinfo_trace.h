@@ -0,0 +1,149 @@
+/**
+ * sysinfo_trace.h
+ * 
+ * Tracepoints for job execution and sample publication.
+ * Enable them with ftrace or perf, e.g.
+ * 
+ *     echo 1 > /sys/kernel/tracing/events/sysinfo/enable
+ * 
+ * They cost a static branch when disabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sysinfo
+
+#if !defined(_SYSINFO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SYSINFO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+// size of the step keys copied into trace records, job titles are
+// recorded in full, as __string() fields
+#define SYSINFO_TRACE_KEY_LEN 32
+
+// __assign_str() finds the source given to __string() itself since 6.10
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define sysinfo_trace_assign_title(src) __assign_str(title)
+#else
+#define sysinfo_trace_assign_title(src) __assign_str(title, src)
+#endif
+
+TRACE_EVENT(sysinfo_job_start,
+
+    TP_PROTO(const char* title, int steps),
+
+    TP_ARGS(title, steps),
+
+    TP_STRUCT__entry(
+        __string(title, title)
+        __field(int, steps)
+    ),
+
+    TP_fast_assign(
+        sysinfo_trace_assign_title(title);
+        __entry->steps = steps;
+    ),
+
+    TP_printk("job=%s steps=%d", __get_str(title), __entry->steps)
+);
+
+TRACE_EVENT(sysinfo_step,
+
+    TP_PROTO(const char* title, const char* key, u64 duration_ns),
+
+    TP_ARGS(title, key, duration_ns),
+
+    TP_STRUCT__entry(
+        __string(title, title)
+        __array(char, key, SYSINFO_TRACE_KEY_LEN)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        sysinfo_trace_assign_title(title);
+        strscpy(__entry->key, key ? key : "", SYSINFO_TRACE_KEY_LEN);
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("job=%s key=\"%s\" duration_ns=%llu",
+              __get_str(title), __entry->key, __entry->duration_ns)
+);
+
+TRACE_EVENT(sysinfo_job_end,
+
+    TP_PROTO(const char* title, int steps, u64 duration_ns),
+
+    TP_ARGS(title, steps, duration_ns),
+
+    TP_STRUCT__entry(
+        __string(title, title)
+        __field(int, steps)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        sysinfo_trace_assign_title(title);
+        __entry->steps = steps;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("job=%s steps=%d duration_ns=%llu",
+              __get_str(title), __entry->steps, __entry->duration_ns)
+);
+
+TRACE_EVENT(sysinfo_sample_publish,
+
+    TP_PROTO(const char* title, u64 seq, size_t bytes),
+
+    TP_ARGS(title, seq, bytes),
+
+    TP_STRUCT__entry(
+        __string(title, title)
+        __field(u64, seq)
+        __field(size_t, bytes)
+    ),
+
+    TP_fast_assign(
+        sysinfo_trace_assign_title(title);
+        __entry->seq = seq;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("job=%s seq=%llu bytes=%zu",
+              __get_str(title), __entry->seq, __entry->bytes)
+);
+
+TRACE_EVENT(sysinfo_read_copy,
+
+    TP_PROTO(const char* title, u64 seq, loff_t pos, size_t bytes),
+
+    TP_ARGS(title, seq, pos, bytes),
+
+    TP_STRUCT__entry(
+        __string(title, title ? title : "")
+        __field(u64, seq)
+        __field(loff_t, pos)
+        __field(size_t, bytes)
+    ),
+
+    TP_fast_assign(
+        sysinfo_trace_assign_title(title ? title : "");
+        __entry->seq = seq;
+        __entry->pos = pos;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("job=%s seq=%llu pos=%lld bytes=%zu",
+              __get_str(title), __entry->seq, __entry->pos, __entry->bytes)
+);
+
+#endif /* _SYSINFO_TRACE_H */
+
+// the header is in the module's source directory, not include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sysinfo_trace
+#include <trace/define_trace.h>
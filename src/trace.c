@@ -0,0 +1,10 @@
+/**
+ * trace.c
+ * 
+ * Instantiates the tracepoints declared in sysinfo_trace.h.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#define CREATE_TRACE_POINTS
+#include "sysinfo_trace.h"
@@ -0,0 +1,255 @@
+/**
+ * bench_job.c
+ * 
+ * Microbenchmarks for the job engine, built in userspace against
+ * the kernel API shims in ./shim.
+ * 
+ * Jobs of 5, 50, 500 and 5000 steps are run through run_job(),
+ * collect_job() and serialize_job_result(), in full and in delta
+ * mode. Results are printed to stdout as CSV, one row per
+ * benchmark and job size:
+ * 
+ *     benchmark,steps,iterations,ns_per_op,bytes_per_op,ns_per_byte,allocs_per_op
+ * 
+ * Usage: bench_job [step_budget]
+ * 
+ * step_budget is the number of steps run per benchmark, which
+ * sets the iteration count for each job size (default 2000000).
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/job.h"
+#include "./shim/kernel_shim.h"
+
+#define BENCH_KEY "bench_key"
+#define DEFAULT_STEP_BUDGET 2000000UL
+#define MIN_ITERATIONS 20UL
+#define DELTA_KEYFRAME_INTERVAL 10
+
+static const int job_sizes[] = { 5, 50, 500, 5000 };
+
+// number of times bench_step has been called
+static unsigned long bench_calls;
+
+/**
+ * Results of one benchmark.
+ */
+struct bench_result {
+    const char* name;
+    int steps;
+    unsigned long iterations;
+    u64 total_ns;
+    u64 total_bytes;
+    unsigned long allocs;
+};
+
+/**
+ * @brief step used by every benchmark job.
+ * 
+ * Every tenth call returns a new value, the rest return the
+ * same value, so delta output has changes to send on each run.
+ * 
+ * @return heap allocated value, freed by the job runner.
+ */
+static
+char*
+bench_step(void)
+{
+    char value[24];
+    unsigned long call = bench_calls++;
+
+    snprintf(value, sizeof(value), "%lu", call % 10 == 0 ? call : 0);
+
+    return kstrdup(value, GFP_KERNEL);
+}
+
+/**
+ * @brief build a job with a given number of steps.
+ * 
+ * Jobs are normally static tables defined with DEFINE_JOB(),
+ * the benchmark builds the same table at runtime to vary its size.
+ * 
+ * @param job - the job to fill in.
+ * @param steps - number of steps in the job.
+ * 
+ * @return 0 on success, -ENOMEM on allocation failure.
+ */
+static
+int
+bench_job_init(Job* job,
+               int steps)
+{
+    Step* table = calloc(steps, sizeof(Step));
+    if (table == NULL)
+        return -ENOMEM;
+
+    for (int i = 0; i < steps; i++)
+    {
+        table[i] = (Step)JOB_STEP(BENCH_KEY, bench_step, JOB_VALUE_NUMBER, NULL);
+    }
+
+    job->job_title = "bench";
+    job->steps = table;
+    job->step_count = steps;
+    job->state = NULL;
+    return 0;
+}
+
+/**
+ * @brief print a result as a CSV row.
+ */
+static
+void
+bench_print(struct bench_result* r)
+{
+    double ns_per_op = (double)r->total_ns / r->iterations;
+    double bytes_per_op = (double)r->total_bytes / r->iterations;
+
+    printf("%s,%d,%lu,%.1f,%.1f,%.3f,%.1f\n",
+           r->name,
+           r->steps,
+           r->iterations,
+           ns_per_op,
+           bytes_per_op,
+           r->total_bytes ? (double)r->total_ns / r->total_bytes : 0.0,
+           (double)r->allocs / r->iterations);
+}
+
+/**
+ * @brief time run_job(), collection and serialization together.
+ */
+static
+void
+bench_run_job(const Job* job,
+              struct bench_result* r)
+{
+    unsigned long allocs = shim_alloc_count;
+    u64 start = ktime_get_ns();
+
+    for (unsigned long i = 0; i < r->iterations; i++)
+    {
+        char* out = run_job(job);
+        r->total_bytes += strlen(out);
+        free(out);
+    }
+
+    r->total_ns = ktime_get_ns() - start;
+    r->allocs = shim_alloc_count - allocs;
+}
+
+/**
+ * @brief time collect_job() and free_job_result().
+ */
+static
+void
+bench_collect_job(const Job* job,
+                  struct bench_result* r)
+{
+    unsigned long allocs = shim_alloc_count;
+    u64 start = ktime_get_ns();
+
+    for (unsigned long i = 0; i < r->iterations; i++)
+    {
+        free_job_result(collect_job(job));
+    }
+
+    r->total_ns = ktime_get_ns() - start;
+    r->allocs = shim_alloc_count - allocs;
+}
+
+/**
+ * @brief time serialize_job_result() alone.
+ * 
+ * Each iteration serializes a freshly collected result, so that
+ * delta mode sees changing values. Only serialization is timed.
+ * 
+ * @param job - the job to collect.
+ * @param d - delta state, NULL for full output.
+ * @param r - the result to fill in.
+ */
+static
+void
+bench_serialize(const Job* job,
+                JobDelta* d,
+                struct bench_result* r)
+{
+    for (unsigned long i = 0; i < r->iterations; i++)
+    {
+        JobResult* result = collect_job(job);
+
+        unsigned long allocs = shim_alloc_count;
+        u64 start = ktime_get_ns();
+        char* out = serialize_job_result(result, d);
+        r->total_ns += ktime_get_ns() - start;
+        r->allocs += shim_alloc_count - allocs;
+
+        r->total_bytes += strlen(out);
+        free(out);
+        free_job_result(result);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long step_budget = DEFAULT_STEP_BUDGET;
+
+    if (argc > 1)
+    {
+        step_budget = strtoul(argv[1], NULL, 10);
+        if (step_budget == 0)
+        {
+            fprintf(stderr, "usage: %s [step_budget]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("benchmark,steps,iterations,ns_per_op,bytes_per_op,ns_per_byte,allocs_per_op\n");
+
+    for (int i = 0; i < ARRAY_SIZE(job_sizes); i++)
+    {
+        int steps = job_sizes[i];
+        unsigned long iterations = max(MIN_ITERATIONS, step_budget / steps);
+        JobDelta* d = job_delta_init(DELTA_KEYFRAME_INTERVAL);
+        Job job;
+
+        if (bench_job_init(&job, steps) != 0 || d == NULL)
+        {
+            fprintf(stderr, "could not allocate benchmark job\n");
+            return 1;
+        }
+
+        // warm up caches and the allocator
+        free(run_job(&job));
+
+        struct bench_result results[] = {
+            { .name = "run_job" },
+            { .name = "collect_job" },
+            { .name = "serialize_json" },
+            { .name = "serialize_json_delta" },
+        };
+        for (int j = 0; j < ARRAY_SIZE(results); j++)
+        {
+            results[j].steps = steps;
+            results[j].iterations = iterations;
+        }
+
+        bench_run_job(&job, &results[0]);
+        bench_collect_job(&job, &results[1]);
+        bench_serialize(&job, NULL, &results[2]);
+        bench_serialize(&job, d, &results[3]);
+
+        for (int j = 0; j < ARRAY_SIZE(results); j++)
+        {
+            bench_print(&results[j]);
+        }
+
+        free_job_delta(d);
+        free((void *)job.steps);
+    }
+
+    return 0;
+}
@@ -0,0 +1,539 @@
+/**
+ * load_sysinfo.c
+ * 
+ * Multi-reader load generator for /dev/sysinfo. Runs against
+ * the loaded module.
+ * 
+ * Each thread reads whole documents from the device, and
+ * optionally issues ioctls, at a configurable rate. Threads
+ * open the device separately (each thread is a separate reader,
+ * as a separate process would be), or share one open file with
+ * -s. At the end, throughput, read and ioctl latency
+ * percentiles, and errors are reported.
+ * 
+ * Read latency is measured per read() call, so a read at offset 0
+ * includes the time spent waiting for a new sample, unless the
+ * device is opened with -n (O_NONBLOCK).
+ * 
+ * Usage: load_sysinfo [options]
+ * 
+ *   -t threads     number of reader threads (default 4)
+ *   -d seconds     duration of the run (default 10)
+ *   -r rate        documents read per second per thread, 0 for no limit (default 0)
+ *   -b bytes       read() buffer size (default 4096)
+ *   -i rate        ioctls per second per thread, 0 for none (default 0)
+ *   -c             ioctls cycle the current_info_type instead of reading stats
+ *   -n             open the device with O_NONBLOCK
+ *   -s             share one open file between all threads
+ *   -p path        device path (default /dev/sysinfo)
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/sysinfo_ioctl.h"
+
+#define DEFAULT_DEVICE_PATH "/dev/sysinfo"
+#define NS_PER_SEC 1000000000ULL
+#define OPEN_RETRY_NS 1000000ULL            // wait before retrying an open that failed with EBUSY
+
+/**
+ * Latencies recorded by one thread, in nanoseconds.
+ */
+struct latencies {
+    uint64_t* ns;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Options of the run.
+ */
+struct load_options {
+    int threads;
+    int duration_s;
+    int read_rate;
+    size_t buf_size;
+    int ioctl_rate;
+    bool cycle_info_type;
+    bool nonblock;
+    bool shared_fd;
+    const char* path;
+};
+
+/**
+ * Per-thread state and results.
+ */
+struct load_thread {
+    pthread_t thread;
+    int id;
+    int fd;                                 // open file, -1 if not open
+    uint64_t end_ns;
+
+    struct latencies read_lat;
+    struct latencies ioctl_lat;
+    unsigned long documents;
+    unsigned long long bytes;
+    unsigned long opens;
+    unsigned long err_busy;                 // open() failed with EBUSY
+    unsigned long err_again;                // read() failed with EAGAIN
+    unsigned long err_intr;                 // read() failed with EINTR
+    unsigned long err_other;                // any other error
+};
+
+static struct load_options opts = {
+    .threads = 4,
+    .duration_s = 10,
+    .read_rate = 0,
+    .buf_size = 4096,
+    .ioctl_rate = 0,
+    .cycle_info_type = false,
+    .nonblock = false,
+    .shared_fd = false,
+    .path = DEFAULT_DEVICE_PATH,
+};
+
+static const unsigned long info_type_cmds[] = { SET_CIT_CPU, SET_CIT_MEM, SET_CIT_DISK };
+
+/**
+ * @brief CLOCK_MONOTONIC time in nanoseconds.
+ */
+static
+uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief sleep until a CLOCK_MONOTONIC time in nanoseconds.
+ */
+static
+void
+sleep_until_ns(uint64_t t)
+{
+    struct timespec ts = {
+        .tv_sec = t / NS_PER_SEC,
+        .tv_nsec = t % NS_PER_SEC,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/**
+ * @brief record a latency.
+ * 
+ * @param l - the latencies to append to.
+ * @param ns - the latency in nanoseconds.
+ */
+static
+void
+latencies_add(struct latencies* l,
+              uint64_t ns)
+{
+    if (l->count == l->capacity)
+    {
+        size_t capacity = l->capacity ? l->capacity * 2 : 1024;
+        uint64_t* p = realloc(l->ns, capacity * sizeof(uint64_t));
+        if (p == NULL)
+            return;
+        l->ns = p;
+        l->capacity = capacity;
+    }
+    l->ns[l->count++] = ns;
+}
+
+static
+int
+compare_u64(const void* a,
+            const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief get a percentile of sorted latencies.
+ * 
+ * @param l - sorted latencies.
+ * @param p - the percentile, 0 to 100.
+ * 
+ * @return the latency at the percentile, 0 if there are none.
+ */
+static
+uint64_t
+latencies_percentile(struct latencies* l,
+                     double p)
+{
+    if (l->count == 0)
+        return 0;
+
+    size_t i = (size_t)(p / 100.0 * (l->count - 1) + 0.5);
+    return l->ns[i];
+}
+
+/**
+ * @brief open the device, retrying while it is busy.
+ * 
+ * @param t - the thread opening the device, for error counts.
+ * 
+ * @return the file descriptor, or -1 if the run ended first.
+ */
+static
+int
+open_device(struct load_thread* t)
+{
+    int flags = O_RDONLY | (opts.nonblock ? O_NONBLOCK : 0);
+
+    while (now_ns() < t->end_ns)
+    {
+        int fd = open(opts.path, flags);
+        if (fd >= 0)
+        {
+            t->opens++;
+            return fd;
+        }
+
+        if (errno == EBUSY)
+        {
+            t->err_busy++;
+            sleep_until_ns(now_ns() + OPEN_RETRY_NS);
+            continue;
+        }
+
+        fprintf(stderr, "thread %d: open %s: %s\n", t->id, opts.path, strerror(errno));
+        t->err_other++;
+        return -1;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief read one whole document from the device.
+ * 
+ * @param t - the thread reading.
+ * @param buf - buffer of opts.buf_size bytes.
+ * 
+ * @return true if a document was read.
+ */
+static
+bool
+read_document(struct load_thread* t,
+              char* buf)
+{
+    off_t off = 0;
+
+    for (;;)
+    {
+        uint64_t start = now_ns();
+        ssize_t n = pread(t->fd, buf, opts.buf_size, off);
+        latencies_add(&t->read_lat, now_ns() - start);
+
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+                t->err_again++;
+            else if (errno == EINTR)
+                t->err_intr++;
+            else
+                t->err_other++;
+            return false;
+        }
+        if (n == 0)
+            break;
+
+        off += n;
+        t->bytes += n;
+    }
+
+    t->documents++;
+    return true;
+}
+
+/**
+ * @brief issue one ioctl on the device.
+ * 
+ * @param t - the thread issuing the ioctl.
+ * @param n - number of ioctls the thread has issued so far.
+ */
+static
+void
+issue_ioctl(struct load_thread* t,
+            unsigned long n)
+{
+    struct sysinfo_stats stats;
+    uint64_t start = now_ns();
+    int ret;
+
+    if (opts.cycle_info_type)
+        ret = ioctl(t->fd, info_type_cmds[n % 3], 0);
+    else
+        ret = ioctl(t->fd, SYSINFO_IOC_GET_STATS, &stats);
+
+    latencies_add(&t->ioctl_lat, now_ns() - start);
+    if (ret < 0)
+        t->err_other++;
+}
+
+/**
+ * @brief reader thread, reads and issues ioctls until the end of the run.
+ */
+static
+void*
+load_thread_fn(void* arg)
+{
+    struct load_thread* t = arg;
+    uint64_t read_interval = opts.read_rate ? NS_PER_SEC / opts.read_rate : 0;
+    uint64_t ioctl_interval = opts.ioctl_rate ? NS_PER_SEC / opts.ioctl_rate : 0;
+    uint64_t next_read = now_ns();
+    uint64_t next_ioctl = next_read;
+    unsigned long ioctls = 0;
+    char* buf = malloc(opts.buf_size);
+
+    if (buf == NULL)
+        return NULL;
+
+    if (!opts.shared_fd)
+        t->fd = open_device(t);
+
+    while (t->fd >= 0 && now_ns() < t->end_ns)
+    {
+        if (ioctl_interval && now_ns() >= next_ioctl)
+        {
+            issue_ioctl(t, ioctls++);
+            next_ioctl += ioctl_interval;
+        }
+
+        if (now_ns() >= next_read)
+        {
+            read_document(t, buf);
+            next_read += read_interval;
+        }
+
+        // sleep until the next operation is due
+        if (read_interval)
+        {
+            uint64_t next = next_read;
+            if (ioctl_interval && next_ioctl < next)
+                next = next_ioctl;
+            if (next > t->end_ns)
+                next = t->end_ns;
+            sleep_until_ns(next);
+        }
+    }
+
+    if (!opts.shared_fd && t->fd >= 0)
+        close(t->fd);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief get the module stats, opening the device for the call.
+ * 
+ * @param stats - set to the module stats.
+ * 
+ * @return true on success.
+ */
+static
+bool
+get_module_stats(struct sysinfo_stats* stats)
+{
+    int fd = open(opts.path, O_RDONLY | O_NONBLOCK);
+    bool ok;
+
+    if (fd < 0)
+        return false;
+
+    ok = ioctl(fd, SYSINFO_IOC_GET_STATS, stats) == 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief merge the latencies of every thread and sort them.
+ */
+static
+struct latencies
+merge_latencies(struct load_thread* threads,
+                bool ioctl_lat)
+{
+    struct latencies all = { 0 };
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        struct latencies* l = ioctl_lat ? &threads[i].ioctl_lat : &threads[i].read_lat;
+        for (size_t j = 0; j < l->count; j++)
+            latencies_add(&all, l->ns[j]);
+    }
+
+    if (all.count > 0)
+        qsort(all.ns, all.count, sizeof(uint64_t), compare_u64);
+    return all;
+}
+
+/**
+ * @brief print the latency percentiles of an operation.
+ */
+static
+void
+print_latencies(const char* name,
+                struct latencies* l)
+{
+    printf("%s_count: %zu\n", name, l->count);
+    printf("%s_p50_ns: %llu\n", name, (unsigned long long)latencies_percentile(l, 50.0));
+    printf("%s_p99_ns: %llu\n", name, (unsigned long long)latencies_percentile(l, 99.0));
+    printf("%s_p999_ns: %llu\n", name, (unsigned long long)latencies_percentile(l, 99.9));
+    printf("%s_max_ns: %llu\n", name, l->count ? (unsigned long long)l->ns[l->count - 1] : 0ULL);
+}
+
+static
+void
+usage(const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-d seconds] [-r reads/s] [-b bytes] [-i ioctls/s] [-c] [-n] [-s] [-p path]\n",
+            prog);
+}
+
+int main(int argc, char** argv)
+{
+    struct sysinfo_stats before, after;
+    bool have_stats;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:r:b:i:cnsp:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': opts.threads = atoi(optarg); break;
+            case 'd': opts.duration_s = atoi(optarg); break;
+            case 'r': opts.read_rate = atoi(optarg); break;
+            case 'b': opts.buf_size = strtoul(optarg, NULL, 10); break;
+            case 'i': opts.ioctl_rate = atoi(optarg); break;
+            case 'c': opts.cycle_info_type = true; break;
+            case 'n': opts.nonblock = true; break;
+            case 's': opts.shared_fd = true; break;
+            case 'p': opts.path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.threads < 1 || opts.duration_s < 1 || opts.read_rate < 0 ||
+        opts.ioctl_rate < 0 || opts.buf_size == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct load_thread* threads = calloc(opts.threads, sizeof(struct load_thread));
+    if (threads == NULL)
+        return 1;
+
+    have_stats = get_module_stats(&before);
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)opts.duration_s * NS_PER_SEC;
+    int shared_fd = -1;
+
+    if (opts.shared_fd)
+    {
+        struct load_thread opener = { .end_ns = end };
+        shared_fd = open_device(&opener);
+        if (shared_fd < 0)
+        {
+            fprintf(stderr, "could not open %s\n", opts.path);
+            free(threads);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        threads[i].id = i;
+        threads[i].fd = shared_fd;
+        threads[i].end_ns = end;
+        if (pthread_create(&threads[i].thread, NULL, load_thread_fn, &threads[i]) != 0)
+        {
+            fprintf(stderr, "could not create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < opts.threads; i++)
+        pthread_join(threads[i].thread, NULL);
+
+    double elapsed_s = (double)(now_ns() - start) / NS_PER_SEC;
+    if (shared_fd >= 0)
+        close(shared_fd);
+
+    // totals over all threads
+    unsigned long documents = 0, opens = 0;
+    unsigned long err_busy = 0, err_again = 0, err_intr = 0, err_other = 0;
+    unsigned long long bytes = 0;
+    for (int i = 0; i < opts.threads; i++)
+    {
+        documents += threads[i].documents;
+        bytes += threads[i].bytes;
+        opens += threads[i].opens;
+        err_busy += threads[i].err_busy;
+        err_again += threads[i].err_again;
+        err_intr += threads[i].err_intr;
+        err_other += threads[i].err_other;
+    }
+
+    struct latencies read_lat = merge_latencies(threads, false);
+    struct latencies ioctl_lat = merge_latencies(threads, true);
+
+    printf("threads: %d\n", opts.threads);
+    printf("shared_fd: %s\n", opts.shared_fd ? "yes" : "no");
+    printf("nonblock: %s\n", opts.nonblock ? "yes" : "no");
+    printf("elapsed_s: %.3f\n", elapsed_s);
+    printf("opens: %lu\n", opens);
+    printf("documents: %lu\n", documents);
+    printf("documents_per_s: %.1f\n", documents / elapsed_s);
+    printf("bytes: %llu\n", bytes);
+    printf("bytes_per_s: %.1f\n", bytes / elapsed_s);
+    print_latencies("read", &read_lat);
+    print_latencies("ioctl", &ioctl_lat);
+    printf("errors_busy: %lu\n", err_busy);
+    printf("errors_again: %lu\n", err_again);
+    printf("errors_intr: %lu\n", err_intr);
+    printf("errors_other: %lu\n", err_other);
+
+    // the module's own counters over the run, when the device could be opened
+    if (have_stats && get_module_stats(&after))
+    {
+        printf("module_reads: %llu\n", (unsigned long long)(after.reads - before.reads));
+        printf("module_bytes_served: %llu\n", (unsigned long long)(after.bytes_served - before.bytes_served));
+        printf("module_samples: %llu\n", (unsigned long long)(after.samples - before.samples));
+        printf("module_errors_busy: %llu\n", (unsigned long long)(after.errors_busy - before.errors_busy));
+    }
+
+    for (int i = 0; i < opts.threads; i++)
+    {
+        free(threads[i].read_lat.ns);
+        free(threads[i].ioctl_lat.ns);
+    }
+    free(read_lat.ns);
+    free(ioctl_lat.ns);
+    free(threads);
+
+    return err_other == 0 ? 0 : 1;
+}
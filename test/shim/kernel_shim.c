@@ -0,0 +1,13 @@
+/**
+ * kernel_shim.c
+ * 
+ * State shared by the kernel API shims in kernel_shim.h.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#include "kernel_shim.h"
+
+unsigned long shim_alloc_count;
+unsigned long shim_free_count;
+unsigned long shim_fail_at;
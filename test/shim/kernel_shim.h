@@ -0,0 +1,249 @@
+/**
+ * kernel_shim.h
+ * 
+ * Userspace stand-ins for the kernel APIs used by the job
+ * engine, so that src/job.c can be compiled and tested as a
+ * normal program. The headers in ./linux include this file in
+ * place of the kernel headers of the same name.
+ * 
+ * @author Mikey Fennelly
+ */
+
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+// fixed width types
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+// allocation flags are ignored in userspace
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+// allocation counters, defined in kernel_shim.c
+extern unsigned long shim_alloc_count;          // kmalloc, kzalloc, kcalloc, krealloc and kstrdup calls
+extern unsigned long shim_free_count;           // kfree calls with a non-NULL pointer
+extern unsigned long shim_fail_at;              // value of shim_alloc_count at which an allocation fails, 0 for none
+
+/**
+ * Count an allocation about to be made, and decide whether it
+ * fails, so the tests can fail each allocation in turn.
+ */
+static inline bool shim_alloc_fails(void)
+{
+    if (shim_fail_at == 0 || shim_alloc_count + 1 != shim_fail_at)
+        return false;
+    shim_alloc_count++;
+    return true;
+}
+
+static inline void* shim_alloc(void* p)
+{
+    shim_alloc_count++;
+    return p;
+}
+
+static inline void shim_free(const void* p)
+{
+    if (p != NULL)
+        shim_free_count++;
+    free((void *)p);
+}
+
+// memory allocation
+#define kmalloc(size, flags) (shim_alloc_fails() ? NULL : shim_alloc(malloc(size)))
+#define kzalloc(size, flags) (shim_alloc_fails() ? NULL : shim_alloc(calloc(1, size)))
+#define kcalloc(n, size, flags) (shim_alloc_fails() ? NULL : shim_alloc(calloc(n, size)))
+#define krealloc(p, size, flags) (shim_alloc_fails() ? NULL : shim_alloc(realloc(p, size)))
+#define kfree(p) shim_free(p)
+#define kstrdup(s, flags) (shim_alloc_fails() ? NULL : shim_alloc(strdup(s)))
+
+// logging
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define pr_err(...) fprintf(stderr, __VA_ARGS__)
+#define pr_warn(...) fprintf(stderr, __VA_ARGS__)
+#define pr_info(...) fprintf(stderr, __VA_ARGS__)
+#define pr_debug(...) do { } while (0)
+
+// module metadata
+#define MODULE_LICENSE(license)
+#define MODULE_AUTHOR(author)
+#define MODULE_DESCRIPTION(description)
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+// helpers
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+
+// plain accesses, the tests are single threaded
+#define READ_ONCE(x) (x)
+#define WRITE_ONCE(x, val) ((x) = (val))
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// workqueues, queued work runs straight away on the calling thread
+struct workqueue_struct;
+#define system_unbound_wq ((struct workqueue_struct *)NULL)
+
+struct work_struct {
+    void (*func)(struct work_struct *work);
+};
+
+#define INIT_WORK(work, fn) ((work)->func = (fn))
+
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    work->func(work);
+    return true;
+}
+
+static inline bool flush_work(struct work_struct *work)
+{
+    return false;
+}
+
+// a single CPU, numbered 0
+#define nr_cpu_ids 1
+#define smp_processor_id() 0
+#define for_each_online_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+static inline void on_each_cpu(void (*func)(void *info), void *info, int wait)
+{
+    func(info);
+}
+
+// completions, queued work has always completed by the time it is waited for
+struct completion {
+    bool done;
+};
+
+static inline void init_completion(struct completion *x)
+{
+    x->done = false;
+}
+
+static inline void complete(struct completion *x)
+{
+    x->done = true;
+}
+
+static inline bool completion_done(struct completion *x)
+{
+    return x->done;
+}
+
+static inline void wait_for_completion(struct completion *x)
+{
+}
+
+static inline unsigned long wait_for_completion_timeout(struct completion *x, unsigned long timeout)
+{
+    return x->done ? timeout + 1 : 0;
+}
+
+// one jiffy per millisecond
+#define msecs_to_jiffies(ms) ((unsigned long)(ms))
+#define nsecs_to_jiffies(ns) ((unsigned long)((ns) / 1000000))
+
+// a single thread, so locks are never contended
+struct mutex {
+    int unused;
+};
+
+#define DEFINE_MUTEX(name) struct mutex name = { 0 }
+#define mutex_lock(lock) ((void)(lock))
+#define mutex_unlock(lock) ((void)(lock))
+
+/**
+ * Copy a string into a buffer, always NUL terminated, like the
+ * kernel's strscpy().
+ *
+ * @return length of the copy, -E2BIG if src was truncated.
+ */
+static inline ssize_t strscpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strnlen(src, size);
+
+    if (size == 0)
+        return -E2BIG;
+    if (len == size)
+    {
+        memcpy(dst, src, size - 1);
+        dst[size - 1] = '\0';
+        return -E2BIG;
+    }
+
+    memcpy(dst, src, len + 1);
+    return len;
+}
+
+/**
+ * Parse a whole string as a signed decimal number, like the
+ * kernel's kstrtos64(). A trailing newline is allowed.
+ */
+static inline int kstrtos64(const char *s, unsigned int base, s64 *res)
+{
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(s, &end, base);
+    if (end == s || (*end != '\0' && strcmp(end, "\n") != 0))
+        return -EINVAL;
+    if (errno == ERANGE)
+        return -ERANGE;
+
+    *res = value;
+    return 0;
+}
+
+// time conversions
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+
+/**
+ * CLOCK_MONOTONIC time in nanoseconds, like the kernel's ktime_get_ns().
+ */
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * CLOCK_REALTIME time in nanoseconds, like the kernel's ktime_get_real_ns().
+ */
+static inline u64 ktime_get_real_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define TEST_DYNAMIC_JOB_BUFFER_H
 
 #include <stdlib.h>
+#include <sys/types.h>
 
 #define INITIAL_CAPACITY 16
 #define GROWTH_FACTOR 2
@@ -10,13 +11,15 @@ typedef struct {
     char *data;         // The buffer
     ssize_t size;       // the current size of the buffer
     ssize_t capacity;   // allocated capacity of the buffer
+    int error;          // negative error code once an append failed
 } DynamicJobBuffer;
 
 /**
  * Initialize a DynamicJobBuffer.
  */
 DynamicJobBuffer* init_job_buffer(void);
-void resize_job_buffer(DynamicJobBuffer *b, size_t new_capacity);
-void append_to_job_buffer(DynamicJobBuffer *b, const char* text);
+int resize_job_buffer(DynamicJobBuffer *b, size_t new_capacity);
+int append_to_job_buffer(DynamicJobBuffer *b, const char* text);
+void free_job_buffer(DynamicJobBuffer *b);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
+#include <json-c/json.h>
 #include "../src/job.h"
 #include <stdio.h>
+#include <string.h>
 #include "./test_dynamic_job_buffer.h"
 
 #define TEST_KEY "test_key"
@@ -17,6 +19,8 @@ void test_init_job_buffer(void)
     CU_ASSERT_EQUAL(b->capacity, INITIAL_CAPACITY);
     CU_ASSERT_EQUAL(b->size, 0);
     CU_ASSERT_EQUAL(b->data[0], '\0');
+    free_job_buffer(b);
+    free(b);
 }
 
 void test_resize_job_buffer(void)
@@ -25,6 +29,8 @@ void test_resize_job_buffer(void)
     CU_ASSERT_EQUAL(b->capacity, 16);
     resize_job_buffer(b, 200);
     CU_ASSERT_EQUAL(b->capacity, 200);
+    free_job_buffer(b);
+    free(b);
 }
 
 void test_append_to_job_buffer(void)
@@ -32,91 +38,678 @@ void test_append_to_job_buffer(void)
     DynamicJobBuffer* b = init_job_buffer();
     append_to_job_buffer(b, TEST_TEXT);
     CU_ASSERT_STRING_EQUAL(b->data, TEST_TEXT);
+    free_job_buffer(b);
+    free(b);
 }
 
-key_value_pair return_kvp(void)
+/**
+ * Test that an append which cannot grow the buffer leaves it
+ * unchanged, and that later appends fail too.
+ */
+void test_append_to_job_buffer_failure(void)
 {
-  key_value_pair kvp;
-  kvp.key = TEST_KEY;
-  kvp.value = TEST_VALUE;
-  return kvp;
+    DynamicJobBuffer* b = init_job_buffer();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+    CU_ASSERT_EQUAL(append_to_job_buffer(b, "{"), 0);
+
+    shim_fail_at = shim_alloc_count + 1;
+    CU_ASSERT_EQUAL(append_to_job_buffer(b, TEST_TEXT), -ENOMEM);
+    shim_fail_at = 0;
+
+    CU_ASSERT_EQUAL(b->error, -ENOMEM);
+    CU_ASSERT_EQUAL(b->capacity, INITIAL_CAPACITY);
+    CU_ASSERT_STRING_EQUAL(b->data, "{");
+    CU_ASSERT_EQUAL(append_to_job_buffer(b, "}"), -ENOMEM);
+    CU_ASSERT_STRING_EQUAL(b->data, "{");
+
+    free_job_buffer(b);
+    free(b);
 }
 
-void test_return_kvp(void)
+/**
+ * Steps return a heap allocated value, which the job
+ * runner frees.
+ */
+char* return_value(void)
 {
-  key_value_pair kvp = return_kvp();
-  CU_ASSERT_EQUAL(TEST_KEY, kvp.key);
-  CU_ASSERT_EQUAL(TEST_VALUE, kvp.value);
+    return strdup(TEST_VALUE);
 }
 
-void test_step_init(void)
+char* return_number(void)
 {
-  Step* step = step_init(&return_kvp);
-  CU_ASSERT_EQUAL(TEST_KEY, step->get_kvp().key);
-  CU_ASSERT_EQUAL(TEST_VALUE, step->get_kvp().value);
+    return strdup("42");
 }
 
-void test_job_init(void)
+char* return_null(void)
 {
-  Job* my_job = job_init(TEST_JOB_TITLE, &return_kvp);
-  CU_ASSERT_EQUAL(TEST_JOB_TITLE, my_job->job_title);
-  CU_ASSERT_EQUAL(TEST_KEY, my_job->head->get_kvp().key);
-  CU_ASSERT_EQUAL(TEST_VALUE, my_job->head->get_kvp().value);
+    return NULL;
+}
+
+DEFINE_JOB(test_job, TEST_JOB_TITLE,
+    JOB_STEP(TEST_KEY, return_value, JOB_VALUE_STRING, NULL));
+
+DEFINE_JOB(test_job_three_steps, TEST_JOB_TITLE,
+    JOB_STEP(TEST_KEY, return_value, JOB_VALUE_STRING, NULL),
+    JOB_STEP("test_number", return_number, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("test_null", return_null, JOB_VALUE_STRING, NULL));
+
+void test_define_job(void)
+{
+    CU_ASSERT_STRING_EQUAL(test_job_three_steps.job_title, TEST_JOB_TITLE);
+    CU_ASSERT_EQUAL(test_job_three_steps.step_count, 3);
+    CU_ASSERT_STRING_EQUAL(test_job_three_steps.steps[0].key, TEST_KEY);
+    CU_ASSERT_PTR_NULL(test_job_three_steps.steps[0].unit);
+    CU_ASSERT_STRING_EQUAL(test_job_three_steps.steps[1].key, "test_number");
+    CU_ASSERT_EQUAL(test_job_three_steps.steps[1].type, JOB_VALUE_NUMBER);
+    CU_ASSERT_STRING_EQUAL(test_job_three_steps.steps[1].unit, "kB");
 }
 
 /**
- * Test if job_init returns a job with the pointer
- * job->head is NULL
+ * Test that collect_job runs every step in order, and copies
+ * each step's key, unit and type into the result.
  */
-void test_if_job_head_is_not_null(void)
+void test_collect_job(void)
 {
-    Job* my_job = job_init(TEST_JOB_TITLE, &return_kvp);
-    CU_ASSERT_PTR_NOT_NULL(my_job->head);
+    JobResult* r = collect_job(&test_job_three_steps);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    CU_ASSERT_EQUAL(r->kvp_count, 3);
+
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].key, TEST_KEY);
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].value, TEST_VALUE);
+    CU_ASSERT_EQUAL(r->kvps[0].type, JOB_VALUE_STRING);
+
+    CU_ASSERT_STRING_EQUAL(r->kvps[1].key, "test_number");
+    CU_ASSERT_STRING_EQUAL(r->kvps[1].value, "42");
+    CU_ASSERT_STRING_EQUAL(r->kvps[1].unit, "kB");
+    CU_ASSERT_EQUAL(r->kvps[1].type, JOB_VALUE_NUMBER);
+
+    CU_ASSERT_STRING_EQUAL(r->kvps[2].key, "test_null");
+    CU_ASSERT_PTR_NULL(r->kvps[2].value);
+
+    free_job_result(r);
+}
+
+/**
+ * Test that units follow their value, and steps without a
+ * value are left out.
+ */
+void test_run_job_units(void)
+{
+    char* actual = run_job(&test_job_three_steps);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"test_value\",\"test_number\":\"42 kB\"}");
+    free(actual);
+}
+
+void test_run_job_json()
+{
+    char* actual = run_job(&test_job);
+    char* expected = "{\"test_key\": \"test_value\"}";
+
+    struct json_object *json1 = json_tokener_parse(actual);
+    struct json_object *json2 = json_tokener_parse(expected);
+
+    CU_ASSERT_TRUE(json_object_equal(json1, json2));
+    json_object_put(json1);
+    json_object_put(json2);
+    free(actual);
 }
 
 /**
- * Tests if after job_init, the job->head->get_kvp
- * pointer is not null.
+ * Test that delta output only contains changed values,
+ * with a full document every keyframe_interval runs.
  */
-void test_job_head_get_kvp_is_non_null_pointer(void)
+void test_serialize_job_result_delta(void)
 {
-    Job* my_job = job_init(TEST_JOB_TITLE, &return_kvp);
-    CU_ASSERT_PTR_NOT_NULL(my_job->head->get_kvp);
+    JobDelta* d = job_delta_init(3);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(d);
+
+    const char* expected[] = {
+        "{\"test_key\":\"test_value\"}",     // keyframe
+        "{}",                                  // unchanged
+        "{}",                                  // unchanged
+        "{\"test_key\":\"test_value\"}",     // keyframe
+    };
+
+    for (int i = 0; i < 4; i++)
+    {
+        JobResult* r = collect_job(&test_job);
+        char* actual = serialize_job_result(r, d);
+        CU_ASSERT_STRING_EQUAL(actual, expected[i]);
+        free(actual);
+        free_job_result(r);
+    }
+
+    free_job_delta(d);
 }
 
-void test_append_step_to_job(void)
+/**
+ * Multi-value step, emits an array of one object per "CPU".
+ * The frequency of cpu 1 is emit_frequency.
+ */
+static int emit_frequency = 100;
+
+void emit_cpus(JobEmitter* e)
 {
-    Job* my_job = job_init(TEST_JOB_TITLE, &return_kvp);
-    CU_ASSERT_EQUAL(TEST_JOB_TITLE, my_job->job_title);
+    char value[16];
 
-    for (int i = 0; i<3; i++)
+    for (int cpu = 0; cpu < 2; cpu++)
     {
-      // append 3 steps to the job.
-      append_step_to_job(my_job, &return_kvp);
+        snprintf(value, sizeof(value), "%d", cpu == 0 ? 100 : emit_frequency);
+        job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+        job_emit_value(e, "cpu", cpu == 0 ? strdup("0") : strdup("1"), JOB_VALUE_NUMBER, NULL);
+        job_emit_value(e, "frequency", strdup(value), JOB_VALUE_NUMBER, "kHz");
+        job_emit_value(e, "missing", NULL, JOB_VALUE_STRING, NULL);
+        job_emit_end(e);
     }
+}
+
+void emit_unbalanced(JobEmitter* e)
+{
+    job_emit_begin(e, "open", JOB_VALUE_ARRAY);
+    job_emit_value(e, NULL, strdup(TEST_VALUE), JOB_VALUE_STRING, NULL);
+}
+
+DEFINE_JOB(test_job_emit, TEST_JOB_TITLE,
+    JOB_STEP(TEST_KEY, return_value, JOB_VALUE_STRING, NULL),
+    JOB_STEP_EMIT("cpus", emit_cpus, JOB_VALUE_ARRAY));
 
-    // walk the steps in the job. At each step
-    // assert all values are as expected
-    Step cur = (*my_job->head);
-    while (cur.next)
+DEFINE_JOB(test_job_emit_unbalanced, TEST_JOB_TITLE,
+    JOB_STEP_EMIT("test_object", emit_unbalanced, JOB_VALUE_OBJECT));
+
+void test_run_job_emit(void)
+{
+    emit_frequency = 100;
+
+    char* actual = run_job(&test_job_emit);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"test_value\","
+                           "\"cpus\":[{\"cpu\":\"0\",\"frequency\":\"100 kHz\"},"
+                           "{\"cpu\":\"1\",\"frequency\":\"100 kHz\"}]}");
+    free(actual);
+
+    // values emitted before the error are still freed with the result
+    actual = run_job(&test_job_emit_unbalanced);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_object\":{\"open\":[\"test_value\"]}}");
+    free(actual);
+}
+
+void test_serialize_job_result_delta_emit(void)
+{
+    JobDelta* d = job_delta_init(10);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(d);
+
+    const int frequencies[] = { 100, 100, 200 };
+    const char* expected[] = {
+        "{\"test_key\":\"test_value\",\"cpus\":[{\"cpu\":\"0\",\"frequency\":\"100 kHz\"},"
+            "{\"cpu\":\"1\",\"frequency\":\"100 kHz\"}]}",    // keyframe
+        "{}",                                                       // unchanged
+        "{\"cpus\":[{\"cpu\":\"0\",\"frequency\":\"100 kHz\"},"
+            "{\"cpu\":\"1\",\"frequency\":\"200 kHz\"}]}",    // cpu 1 changed
+    };
+
+    for (int i = 0; i < 3; i++)
     {
-      CU_ASSERT_EQUAL(TEST_KEY, cur.get_kvp().key);
-      CU_ASSERT_EQUAL(TEST_VALUE, cur.get_kvp().value);
-      cur = (*cur.next);
+        emit_frequency = frequencies[i];
+        JobResult* r = collect_job(&test_job_emit);
+        char* actual = serialize_job_result(r, d);
+        CU_ASSERT_STRING_EQUAL(actual, expected[i]);
+        free(actual);
+        free_job_result(r);
     }
+
+    free_job_delta(d);
 }
 
-void test_run_job_json()
+DEFINE_JOB(test_job_async, TEST_JOB_TITLE,
+    JOB_STEP_ASYNC(TEST_KEY, return_value, JOB_VALUE_STRING, NULL),
+    JOB_STEP("test_number", return_number, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP_EMIT_ASYNC("cpus", emit_cpus, JOB_VALUE_ARRAY),
+    JOB_STEP_ASYNC("test_null", return_null, JOB_VALUE_STRING, NULL));
+
+void test_collect_job_async(void)
 {
-    Job* my_job = job_init(TEST_JOB_TITLE, &return_kvp);
-    char* actual = run_job(my_job);
-    char* expected = "{\"test_key\": \"test_value\"}";
+    emit_frequency = 100;
 
-    struct json_object *json1 = json_tokener_parse(actual);
-    struct json_object *json2 = json_tokener_parse(expected);
+    JobResult* r = collect_job(&test_job_async);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    CU_ASSERT_EQUAL(r->kvp_count, 4);
 
-    CU_ASSERT_TRUE(json_object_equal(json1, json2));
+    // async steps keep their place in the result
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].key, TEST_KEY);
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].value, TEST_VALUE);
+    CU_ASSERT_STRING_EQUAL(r->kvps[1].key, "test_number");
+    CU_ASSERT_STRING_EQUAL(r->kvps[2].key, "cpus");
+    CU_ASSERT_EQUAL(r->kvps[2].child_count, 2);
+    CU_ASSERT_STRING_EQUAL(r->kvps[3].key, "test_null");
+    CU_ASSERT_PTR_NULL(r->kvps[3].value);
+    free_job_result(r);
+
+    char* actual = run_job(&test_job_async);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"test_value\",\"test_number\":\"42 kB\","
+                           "\"cpus\":[{\"cpu\":\"0\",\"frequency\":\"100 kHz\"},"
+                           "{\"cpu\":\"1\",\"frequency\":\"100 kHz\"}]}");
+    free(actual);
+}
+
+DEFINE_JOB(test_job_budget, TEST_JOB_TITLE,
+    JOB_STEP(TEST_KEY, return_value, JOB_VALUE_STRING, NULL, .budget_ms = 10),
+    JOB_STEP_EMIT_ASYNC("cpus", emit_cpus, JOB_VALUE_ARRAY, .budget_ms = 10),
+    JOB_STEP("test_null", return_null, JOB_VALUE_STRING, NULL, .budget_ms = 10));
+
+/**
+ * Test that steps which finish within their budget are fresh,
+ * and are kept as the last good value until the budgets are
+ * flushed.
+ */
+void test_collect_job_budget(void)
+{
+    emit_frequency = 100;
+
+    CU_ASSERT_EQUAL(test_job_budget.steps[0].budget_ms, 10);
+    CU_ASSERT_EQUAL(test_job_budget.steps[1].type, JOB_VALUE_ARRAY);
+
+    JobResult* r = collect_job(&test_job_budget);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].value, TEST_VALUE);
+    CU_ASSERT_FALSE(r->kvps[0].stale);
+    CU_ASSERT_EQUAL(r->kvps[1].child_count, 2);
+    CU_ASSERT_FALSE(r->kvps[1].stale);
+    CU_ASSERT_PTR_NULL(r->kvps[2].value);
+    CU_ASSERT_FALSE(r->kvps[2].stale);
+
+    // the last good value is a copy, owned by the step's state
+    CU_ASSERT_TRUE(test_job_budget.state[0].has_last);
+    CU_ASSERT_STRING_EQUAL(test_job_budget.state[0].last.value, TEST_VALUE);
+    CU_ASSERT_PTR_NOT_EQUAL(test_job_budget.state[0].last.value, r->kvps[0].value);
+    CU_ASSERT_EQUAL(test_job_budget.state[1].last.child_count, 2);
+    CU_ASSERT_FALSE(test_job_budget.state[2].has_last);
+    free_job_result(r);
+
+    // the next run starts new attempts, the previous ones have returned
+    r = collect_job(&test_job_budget);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    CU_ASSERT_STRING_EQUAL(r->kvps[0].value, TEST_VALUE);
+    CU_ASSERT_FALSE(r->kvps[0].stale);
+    CU_ASSERT_EQUAL(r->kvps[1].child_count, 2);
+    for (int i = 0; i < test_job_budget.step_count; i++)
+        CU_ASSERT_PTR_NULL(test_job_budget.state[i].pending);
+    free_job_result(r);
+
+    job_flush_budgets(&test_job_budget);
+    for (int i = 0; i < test_job_budget.step_count; i++)
+    {
+        CU_ASSERT_FALSE(test_job_budget.state[i].has_last);
+        CU_ASSERT_PTR_NULL(test_job_budget.state[i].pending);
+    }
+}
+
+/**
+ * Step handler returning the reader it is collected for, or
+ * "sampled" or "shared" without one.
+ */
+char* return_reader(const JobContext* ctx)
+{
+    if (ctx != NULL && ctx->reader != NULL)
+        return strdup(ctx->reader);
+
+    return strdup(ctx != NULL && ctx->sampled ? "sampled" : "shared");
+}
+
+/**
+ * Multi-value step, emits the reader it is collected for.
+ */
+void emit_reader(JobEmitter* e)
+{
+    if (e->ctx != NULL && e->ctx->reader != NULL)
+        job_emit_value(e, "reader", strdup(e->ctx->reader), JOB_VALUE_STRING, NULL);
+}
+
+DEFINE_JOB(test_job_ctx, TEST_JOB_TITLE,
+    JOB_STEP_CTX(TEST_KEY, return_reader, JOB_VALUE_STRING, NULL, .budget_ms = 10),
+    JOB_STEP_EMIT_ASYNC("object", emit_reader, JOB_VALUE_OBJECT));
+
+/**
+ * Test that steps are passed the context the job is collected
+ * for, and that jobs collected for a reader leave the budgets
+ * shared by every collector alone. Attempts at budgeted steps run
+ * with the context of the collector that started them.
+ */
+void test_collect_job_ctx(void)
+{
+    JobContext ctx = { .reader = "reader" };
+    JobContext sampled = { .sampled = true };
+
+    char* actual = run_job(&test_job_ctx);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"shared\",\"object\":{}}");
     free(actual);
+    CU_ASSERT_TRUE(test_job_ctx.state[0].has_last);
+    CU_ASSERT_STRING_EQUAL(test_job_ctx.state[0].last.value, "shared");
+
+    JobResult* r = collect_job_ctx(&test_job_ctx, &ctx);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    actual = serialize_job_result(r, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"reader\",\"object\":{\"reader\":\"reader\"}}");
+    free(actual);
+    free_job_result(r);
+    CU_ASSERT_STRING_EQUAL(test_job_ctx.state[0].last.value, "shared");
+
+    r = collect_job_ctx(&test_job_ctx, &sampled);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    actual = serialize_job_result(r, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"sampled\",\"object\":{}}");
+    free(actual);
+    free_job_result(r);
+    CU_ASSERT_STRING_EQUAL(test_job_ctx.state[0].last.value, "sampled");
+
+    job_flush_budgets(&test_job_ctx);
+}
+
+/**
+ * Test that stale steps are listed after the values.
+ */
+void test_serialize_job_result_stale(void)
+{
+    emit_frequency = 100;
+
+    JobResult* r = collect_job(&test_job_three_steps);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    r->kvps[1].stale = true;
+    r->kvps[2].stale = true;
+
+    char* actual = serialize_job_result(r, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"test_value\",\"test_number\":\"42 kB\","
+                           "\"_stale\":[\"test_number\",\"test_null\"]}");
+    free(actual);
+    free_job_result(r);
+}
+
+/**
+ * Step handler returning a value with a quote and a backslash.
+ */
+char* return_backslashed(void)
+{
+    return strdup("x \"y\"\\");
+}
+
+/**
+ * Multi-value step, emits a child named like a cgroup a user
+ * created, with a quote, a backslash and a newline in it.
+ */
+void emit_hostile_names(JobEmitter* e)
+{
+    job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+    job_emit_value(e, "name", strdup("a\",\"b\\c\n"), JOB_VALUE_LABEL, NULL);
+    job_emit_value(e, "k\"ey", strdup("v"), JOB_VALUE_STRING, NULL);
+    job_emit_end(e);
+}
+
+DEFINE_JOB(test_job_escape, TEST_JOB_TITLE,
+    JOB_STEP("model", return_backslashed, JOB_VALUE_STRING, NULL),
+    JOB_STEP_EMIT("children", emit_hostile_names, JOB_VALUE_ARRAY));
+
+/**
+ * Test that quotes, backslashes and control characters in keys
+ * and values are escaped, so they cannot end a JSON string.
+ */
+void test_serialize_job_result_escape(void)
+{
+    char* actual = run_job(&test_job_escape);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"model\":\"x \\\"y\\\"\\\\\","
+                           "\"children\":[{\"name\":\"a\\\",\\\"b\\\\c\\u000a\","
+                           "\"k\\\"ey\":\"v\"}]}");
+    free(actual);
+}
+
+/**
+ * Test that failing any one allocation while running a job
+ * gives either no document or a complete one. Leaks are
+ * caught by building with SANITIZE=1.
+ */
+void test_run_job_allocation_failure(void)
+{
+    JobDelta* d = job_delta_init(2);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(d);
+
+    emit_frequency = 100;
+    for (unsigned long n = 1; n <= 40; n++)
+    {
+        shim_fail_at = shim_alloc_count + n;
+        char* full = run_job(&test_job_emit);
+        JobResult* r = collect_job(&test_job_async);
+        char* delta = serialize_job_result(r, d);
+        shim_fail_at = 0;
+
+        if (full != NULL)
+        {
+            CU_ASSERT_EQUAL(full[0], '{');
+            CU_ASSERT_EQUAL(full[strlen(full) - 1], '}');
+        }
+        if (delta != NULL)
+        {
+            CU_ASSERT_EQUAL(delta[0], '{');
+            CU_ASSERT_EQUAL(delta[strlen(delta) - 1], '}');
+        }
+        free(full);
+        free(delta);
+        free_job_result(r);
+    }
+
+    free_job_delta(d);
+}
+
+/**
+ * Multi-value step, emits an array of one object per "CPU",
+ * labelled with the CPU number.
+ */
+void emit_labelled_cpus(JobEmitter* e)
+{
+    job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+    job_emit_value(e, "cpu", strdup("0"), JOB_VALUE_LABEL, NULL);
+    job_emit_value(e, "frequency", strdup("100"), JOB_VALUE_NUMBER, "kHz");
+    job_emit_value(e, "idle_time", strdup("1500"), JOB_VALUE_NUMBER, "ms");
+    job_emit_counter(e, "user_time", strdup("250"), "ms");
+    job_emit_end(e);
+
+    job_emit_begin(e, NULL, JOB_VALUE_OBJECT);
+    job_emit_value(e, "cpu", strdup("1"), JOB_VALUE_LABEL, NULL);
+    job_emit_value(e, "frequency", strdup("200"), JOB_VALUE_NUMBER, "kHz");
+    job_emit_value(e, "idle_time", strdup("-5"), JOB_VALUE_NUMBER, "ms");
+    job_emit_counter(e, "user_time", strdup("7"), "ms");
+    job_emit_end(e);
+}
+
+void emit_loads(JobEmitter* e)
+{
+    job_emit_value(e, NULL, strdup("1"), JOB_VALUE_NUMBER, NULL);
+    job_emit_value(e, NULL, strdup("2"), JOB_VALUE_NUMBER, NULL);
+}
+
+char* return_quoted(void)
+{
+    return strdup("x \"y\"\\");
+}
+
+DEFINE_JOB(test_job_prometheus, "test",
+    JOB_STEP("Total RAM", return_number, JOB_VALUE_NUMBER, "kB"),
+    JOB_STEP("model", return_quoted, JOB_VALUE_STRING, NULL),
+    JOB_STEP_EMIT("cpus", emit_labelled_cpus, JOB_VALUE_ARRAY),
+    JOB_STEP_EMIT("loads", emit_loads, JOB_VALUE_ARRAY),
+    JOB_STEP("test_null", return_null, JOB_VALUE_STRING, NULL),
+    JOB_STEP_COUNTER("interrupts", return_number, NULL));
+
+/**
+ * Test that values are written as Prometheus metrics in their
+ * base unit, with strings as info metrics, counters with a _total
+ * suffix, and elements of arrays labelled by their labels or their
+ * index.
+ */
+void test_serialize_job_result_prometheus(void)
+{
+    JobResult* r = collect_job(&test_job_prometheus);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+
+    char* actual = serialize_job_result_prometheus(r);
+    CU_ASSERT_STRING_EQUAL(actual,
+        "# HELP sysinfo_test_total_ram_bytes test: Total RAM\n"
+        "# TYPE sysinfo_test_total_ram_bytes gauge\n"
+        "sysinfo_test_total_ram_bytes 43008\n"
+        "# HELP sysinfo_test_model_info test: model\n"
+        "# TYPE sysinfo_test_model_info gauge\n"
+        "sysinfo_test_model_info{value=\"x \\\"y\\\"\\\\\"} 1\n"
+        "# HELP sysinfo_test_cpus_frequency_hertz test: cpus.frequency\n"
+        "# TYPE sysinfo_test_cpus_frequency_hertz gauge\n"
+        "sysinfo_test_cpus_frequency_hertz{cpu=\"0\"} 100000\n"
+        "sysinfo_test_cpus_frequency_hertz{cpu=\"1\"} 200000\n"
+        "# HELP sysinfo_test_cpus_idle_time_seconds test: cpus.idle_time\n"
+        "# TYPE sysinfo_test_cpus_idle_time_seconds gauge\n"
+        "sysinfo_test_cpus_idle_time_seconds{cpu=\"0\"} 1.500\n"
+        "sysinfo_test_cpus_idle_time_seconds{cpu=\"1\"} -0.005\n"
+        "# HELP sysinfo_test_cpus_user_time_seconds_total test: cpus.user_time\n"
+        "# TYPE sysinfo_test_cpus_user_time_seconds_total counter\n"
+        "sysinfo_test_cpus_user_time_seconds_total{cpu=\"0\"} 0.250\n"
+        "sysinfo_test_cpus_user_time_seconds_total{cpu=\"1\"} 0.007\n"
+        "# HELP sysinfo_test_loads test: loads\n"
+        "# TYPE sysinfo_test_loads gauge\n"
+        "sysinfo_test_loads{index=\"0\"} 1\n"
+        "sysinfo_test_loads{index=\"1\"} 2\n"
+        "# HELP sysinfo_test_interrupts_total test: interrupts\n"
+        "# TYPE sysinfo_test_interrupts_total counter\n"
+        "sysinfo_test_interrupts_total 42\n");
+    free(actual);
+
+    // labels are written as strings in JSON
+    actual = serialize_job_result(r, NULL);
+    CU_ASSERT_PTR_NOT_NULL(strstr(actual, "{\"cpu\":\"0\",\"frequency\":\"100 kHz\""));
+    free(actual);
+
+    free_job_result(r);
+}
+
+/**
+ * Test that collect_job timestamps the result, and that samples
+ * carry their metadata in every document, delta ones included.
+ */
+void test_serialize_job_result_meta(void)
+{
+    JobDelta* d = job_delta_init(10);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(d);
+
+    JobResult* r = collect_job(&test_job);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    CU_ASSERT_TRUE(r->timestamp_ns > 0);
+    CU_ASSERT_TRUE(r->realtime_ns > 0);
+    CU_ASSERT_EQUAL(r->seq, 0);
+
+    // results that are not samples have no metadata
+    char* actual = serialize_job_result(r, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, "{\"test_key\":\"test_value\"}");
+    free(actual);
+
+    r->seq = 7;
+    r->timestamp_ns = 100;
+    r->realtime_ns = 1500000000123456789ULL;
+    r->duration_ns = 2500;
+    const char* meta = "\"_seq\":\"7\",\"_monotonic_ns\":\"100\","
+                       "\"_realtime_ns\":\"1500000000123456789\",\"_duration_ns\":\"2500\"";
+
+    actual = serialize_job_result(r, d);
+    CU_ASSERT_TRUE(strncmp(actual, "{", 1) == 0 && strncmp(actual + 1, meta, strlen(meta)) == 0);
+    CU_ASSERT_STRING_EQUAL(actual + 1 + strlen(meta), ",\"test_key\":\"test_value\"}");
+    free(actual);
+
+    // unchanged values are left out, the metadata is not
+    actual = serialize_job_result(r, d);
+    CU_ASSERT_STRING_EQUAL(actual + 1 + strlen(meta), "}");
+    free(actual);
+
+    actual = serialize_job_result_prometheus(r);
+    CU_ASSERT_PTR_NOT_NULL(strstr(actual, "\nsysinfo_test_job_title_sample_seq 7\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(actual, "\nsysinfo_test_job_title_sample_timestamp_seconds 1500000000.123456789\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(actual, "\nsysinfo_test_job_title_sample_duration_seconds 0.000002500\n"));
+    free(actual);
+
+    free_job_result(r);
+    free_job_delta(d);
+}
+
+/**
+ * Test that a copied JobResult serializes the same as the
+ * original, and that changing or dropping values of the copy
+ * leaves the original as it was.
+ */
+void test_copy_job_result(void)
+{
+    JobResult* r = collect_job(&test_job_prometheus);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    r->seq = 3;
+
+    JobResult* copy = copy_job_result(r);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+    CU_ASSERT_PTR_NOT_EQUAL(copy->kvps, r->kvps);
+    CU_ASSERT_EQUAL(copy->seq, 3);
+
+    char* expected = serialize_job_result(r, NULL);
+    char* actual = serialize_job_result(copy, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, expected);
+    free(actual);
+
+    // drop the second CPU and change the first value of the copy
+    key_value_pair* cpus = &copy->kvps[2];
+    CU_ASSERT_EQUAL_FATAL(cpus->child_count, 2);
+    job_free_kvp(&cpus->children[1]);
+    cpus->child_count = 1;
+    free(copy->kvps[0].value);
+    copy->kvps[0].value = strdup("1");
+
+    actual = serialize_job_result(copy, NULL);
+    CU_ASSERT_PTR_NOT_NULL(strstr(actual, "\"Total RAM\":\"1 kB\""));
+    CU_ASSERT_PTR_NULL(strstr(actual, "\"cpu\":\"1\""));
+    free(actual);
+
+    actual = serialize_job_result(r, NULL);
+    CU_ASSERT_STRING_EQUAL(actual, expected);
+    free(actual);
+    free(expected);
+
+    free_job_result(copy);
+    free_job_result(r);
+
+    // a failed copy frees what it copied so far
+    r = collect_job(&test_job_prometheus);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+    for (int fail = 1; fail <= 8; fail++)
+    {
+        shim_fail_at = shim_alloc_count + fail;
+        copy = copy_job_result(r);
+        shim_fail_at = 0;
+        free_job_result(copy);
+    }
+    free_job_result(r);
+}
+
+struct test_cpu_slot {
+    int calls;
+    u64 value;
+};
+
+void fill_cpu_slot(void* slot)
+{
+    struct test_cpu_slot* s = slot;
+    s->calls++;
+    s->value = 1000 + smp_processor_id();
+}
+
+void test_job_collect_per_cpu(void)
+{
+    int cpu;
+    struct test_cpu_slot* slots = job_collect_per_cpu(fill_cpu_slot, sizeof(struct test_cpu_slot));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(slots);
+
+    for_each_online_cpu(cpu)
+    {
+        CU_ASSERT_EQUAL(slots[cpu].calls, 1);
+        CU_ASSERT_EQUAL(slots[cpu].value, 1000 + cpu);
+    }
+    free(slots);
 }
 
 int main(void)
@@ -153,43 +746,109 @@ int main(void)
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_return_kvp", test_return_kvp))
+    if (!CU_add_test(suite, "test_define_job", test_define_job))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_step_init", test_step_init))
+    if (!CU_add_test(suite, "test_collect_job", test_collect_job))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_job_init", test_job_init))
+    if (!CU_add_test(suite, "test_run_job_units", test_run_job_units))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_append_step_to_job", test_append_step_to_job))
+    if (!CU_add_test(suite, "test_run_job_json", test_run_job_json))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_if_job_head_is_not_null", test_if_job_head_is_not_null))
+    if (!CU_add_test(suite, "test_serialize_job_result_delta", test_serialize_job_result_delta))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_job_head_get_kvp_is_non_null_pointer", test_job_head_get_kvp_is_non_null_pointer))
+    if (!CU_add_test(suite, "test_run_job_emit", test_run_job_emit))
     {
         CU_cleanup_registry();
         return CU_get_error();
     }
 
-    if (!CU_add_test(suite, "test_run_job_json", test_run_job_json))
+    if (!CU_add_test(suite, "test_serialize_job_result_delta_emit", test_serialize_job_result_delta_emit))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_collect_job_async", test_collect_job_async))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_job_collect_per_cpu", test_job_collect_per_cpu))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_append_to_job_buffer_failure", test_append_to_job_buffer_failure))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_run_job_allocation_failure", test_run_job_allocation_failure))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_serialize_job_result_prometheus", test_serialize_job_result_prometheus))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_serialize_job_result_meta", test_serialize_job_result_meta))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_copy_job_result", test_copy_job_result))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_collect_job_budget", test_collect_job_budget))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_collect_job_ctx", test_collect_job_ctx))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_serialize_job_result_stale", test_serialize_job_result_stale))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (!CU_add_test(suite, "test_serialize_job_result_escape", test_serialize_job_result_escape))
     {
         CU_cleanup_registry();
         return CU_get_error();
@@ -197,7 +856,10 @@ int main(void)
 
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
+
+    // exit non-zero on failure, so make test can gate on it
+    unsigned int failures = CU_get_number_of_failures();
     CU_cleanup_registry();
 
-    return 0;
+    return failures == 0 ? 0 : 1;
 }
\ No newline at end of file